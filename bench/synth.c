@@ -0,0 +1,354 @@
+//
+// Synthetic fits headers, images and coordinates for benchmarks and
+// accuracy tests, no survey data needed
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#define _GNU_SOURCE 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <libsquid_wcs.h>
+
+#include "synth.h"
+
+#define SYNTH_D2R (3.14159265358979323846/180.0)
+
+// Set opts to a 4k x 4k TAN image of 1 arcsec pixels at ra,dec=150,30,
+// no distortion and no extra cards
+void synth_opts_init(struct synth_opts *opts) {
+
+  memset(opts, 0, sizeof(struct synth_opts));
+  strcpy(opts->proj, "TAN");
+  opts->naxes[0]=4096;
+  opts->naxes[1]=4096;
+  opts->cdelt=1.0/3600.0;
+  opts->crval[0]=150.0;
+  opts->crval[1]=30.0;
+  opts->sip_amp=2.0;
+  opts->tpv_amp=2.0;
+  opts->nstar=-1;
+  opts->seed=1;
+}
+
+// Uniform random number in [0,1) from a xorshift64* generator, the same
+// sequence on every platform for a given seed
+double synth_rand(uint64_t *state) {
+  uint64_t x;
+
+  if (*state == 0) *state=0x9e3779b97f4a7c15ULL;
+  x=*state;
+  x^=x >> 12;
+  x^=x << 25;
+  x^=x >> 27;
+  *state=x;
+
+  return(((x*0x2545f4914f6cdd1dULL) >> 11)*(1.0/9007199254740992.0));
+}
+
+// Append one 80 character card with a preformatted value to hdr
+static void synth_card(char *hdr, int *ncard, const char *key, const char *value, const char *comment) {
+  char card[81];
+
+  if (value == NULL) {
+    snprintf(card, sizeof(card), "%-8.8s %-71.71s", key, comment);
+  } else if (value[0] == '\'') {
+    snprintf(card, sizeof(card), "%-8.8s= %-20s / %-47.47s", key, value, comment);
+  } else {
+    snprintf(card, sizeof(card), "%-8.8s= %20s / %-47.47s", key, value, comment);
+  }
+  memset(card+strlen(card), ' ', 80-strlen(card));
+  memcpy(hdr+80*(*ncard), card, 80);
+  (*ncard)++;
+}
+
+static void synth_double(char *hdr, int *ncard, const char *key, double value, const char *comment) {
+  char str[32];
+
+  snprintf(str, sizeof(str), "%.13G", value);
+  if (strpbrk(str, ".EN") == NULL) strcat(str, ".");
+  synth_card(hdr, ncard, key, str, comment);
+}
+
+static void synth_long(char *hdr, int *ncard, const char *key, long value, const char *comment) {
+  char str[32];
+
+  snprintf(str, sizeof(str), "%ld", value);
+  synth_card(hdr, ncard, key, str, comment);
+}
+
+static void synth_string(char *hdr, int *ncard, const char *key, const char *value, const char *comment) {
+  char str[72];
+
+  snprintf(str, sizeof(str), "'%-8s'", value);
+  synth_card(hdr, ncard, key, str, comment);
+}
+
+// Write the SIP coefficients of one polynomial, prefix "A", "B", "AP" or
+// "BP", with a random distortion of about sip_amp pixels at the corners.
+// The inverse polynomials are the negated forward ones, good to first order.
+static void synth_sip(char *hdr, int *ncard, struct synth_opts *opts, const char *prefix, double *coef) {
+  char key[24];
+  double r;
+  int i, j, n=0;
+
+  snprintf(key, sizeof(key), "%s_ORDER", prefix);
+  synth_long(hdr, ncard, key, opts->sip_order, "SIP polynomial order");
+  r=0.5*hypot(opts->naxes[0], opts->naxes[1]);
+  for (i=0; i<=opts->sip_order; i++) {
+    for (j=0; j<=opts->sip_order-i; j++) {
+      if (i+j < 2) continue;
+      if (prefix[1] == '\0') coef[n]=opts->sip_amp*pow(r, -i-j)*(2.0*synth_rand(&opts->seed)-1.0);
+      snprintf(key, sizeof(key), "%s_%d_%d", prefix, i, j);
+      synth_double(hdr, ncard, key, (prefix[1] == '\0') ? coef[n] : -coef[n], "SIP coefficient");
+      n++;
+    }
+  }
+}
+
+// Number of TPV terms up to each order, and the order of each term
+static const int synth_tpv_nterm[] = {0, 4, 7, 12};
+static const int synth_tpv_power[] = {0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 3, 3};
+
+// Write the PV cards of a TPV distortion of order opts->tpv_order, for
+// axis 1 or 2, about tpv_amp pixels at the corners.  The linear term is 1,
+// the other first order terms 0.
+static void synth_tpv(char *hdr, int *ncard, struct synth_opts *opts, int axis) {
+  char key[24];
+  double r, c;
+  int i;
+
+  r=0.5*opts->cdelt*hypot(opts->naxes[0], opts->naxes[1]);
+  for (i=0; i<synth_tpv_nterm[opts->tpv_order]; i++) {
+    if (i == 1) {
+      c=1.0;
+    } else if (synth_tpv_power[i] < 2) {
+      c=0.0;
+    } else {
+      c=opts->tpv_amp*opts->cdelt*pow(r, 1-synth_tpv_power[i])*(2.0*synth_rand(&opts->seed)-1.0);
+    }
+    snprintf(key, sizeof(key), "PV%d_%d", axis, i);
+    synth_double(hdr, ncard, key, c, "TPV coefficient");
+  }
+}
+
+//
+// Set opts to one of the named test cases that stress the hot paths, on
+// top of the current settings:
+//   pole - TAN image with the north pole inside, rotated 30 deg
+//   edge - TAN image across the TSC/QSC face edge at ra=45
+//   corner - TAN image on the cube corner at ra=45, dec=35.26
+//   highsip - SIP of order 9 with 20 pixels of distortion
+//   tpv - TPV of order 3 with 5 pixels of distortion
+//   hpx, xph, tsc, qsc - all sky images in those projections
+// Function returns 0 on success and -1 if name is unknown
+//
+int synth_preset(struct synth_opts *opts, const char *name) {
+
+  if (strcmp(name, "pole") == 0) {
+    strcpy(opts->proj, "TAN");
+    opts->crval[0]=0.0;
+    opts->crval[1]=90.0-0.25*opts->cdelt*opts->naxes[1];
+    opts->rot=30.0;
+  } else if (strcmp(name, "edge") == 0) {
+    strcpy(opts->proj, "TAN");
+    opts->crval[0]=45.0;
+    opts->crval[1]=0.0;
+  } else if (strcmp(name, "corner") == 0) {
+    strcpy(opts->proj, "TAN");
+    opts->crval[0]=45.0;
+    opts->crval[1]=atan(sqrt(0.5))/SYNTH_D2R;
+  } else if (strcmp(name, "highsip") == 0) {
+    opts->sip_order=9;
+    opts->sip_amp=20.0;
+  } else if (strcmp(name, "tpv") == 0) {
+    opts->tpv_order=3;
+    opts->tpv_amp=5.0;
+  } else if ((strcmp(name, "hpx") == 0)||(strcmp(name, "xph") == 0)||
+             (strcmp(name, "tsc") == 0)||(strcmp(name, "qsc") == 0)) {
+    opts->proj[0]=name[0]-'a'+'A';
+    opts->proj[1]=name[1]-'a'+'A';
+    opts->proj[2]=name[2]-'a'+'A';
+    opts->proj[3]='\0';
+    opts->crval[0]=0.0;
+    opts->crval[1]=(name[0] == 'x') ? 90.0 : 0.0;
+    opts->cdelt=((name[0] == 'x') ? 360.0 : 180.0)/opts->naxes[1];
+    opts->rot=0.0;
+  } else {
+    fprintf(stderr, "unknown preset %s in synth_preset\n", name);
+    return(-1);
+  }
+
+  return(0);
+}
+
+// Keywords for the extra cards, numbered ones follow
+static const struct {
+  const char *key; // keyword name
+  const char *value; // string value, NULL for a random number
+} synth_keys[] = {{"DATE-OBS", "2014-06-01T04:12:33"}, {"MJD-OBS", NULL}, {"EXPTIME", NULL},
+  {"FILTER", "r"}, {"OBJECT", "synthetic field"}, {"TELESCOP", "synthetic"},
+  {"INSTRUME", "synthetic"}, {"OBSERVER", "synthetic"}, {"AIRMASS", NULL}, {"GAIN", NULL},
+  {"RDNOISE", NULL}, {"SATURATE", NULL}, {"SEEING", NULL}, {"SKYLEVEL", NULL},
+  {"ZEROPT", NULL}, {NULL, NULL}};
+
+//
+// Make a header string for the image described by opts, in the format of
+// fits_hdr2str: nkeyrec 80 character cards followed by an END card.  The
+// string is malloced, free it when done.
+// Function returns 0 on success and -1 on failure
+//
+int synth_header(const struct synth_opts *opts, char **header, int *nkeyrec) {
+  struct synth_opts o=*opts; // private copy, the random state advances
+  double acoef[SIP_NCOEF_MAX], bcoef[SIP_NCOEF_MAX], cr, sr;
+  char *hdr, key[24], str[72], ctype[16];
+  const char *proj;
+  int n=0, maxcard, i, nkey;
+
+  maxcard=((opts->ncard > 64) ? opts->ncard : 64)+4*SIP_NCOEF_MAX+32;
+  if ((hdr=(char *)malloc(80*maxcard+1)) == NULL) {
+    fprintf(stderr, "malloc failed in synth_header\n");
+    return(-1);
+  }
+  if ((opts->sip_order < 0)||(opts->sip_order >= SIP_ARRAY_MAX)||(opts->tpv_order < 0)||(opts->tpv_order > 3)) {
+    fprintf(stderr, "SIP or TPV order out of range in synth_header\n");
+    free(hdr);
+    return(-1);
+  }
+
+  synth_card(hdr, &n, "SIMPLE", "T", "conforms to FITS standard");
+  synth_long(hdr, &n, "BITPIX", -32, "array data type");
+  synth_long(hdr, &n, "NAXIS", 2, "number of array dimensions");
+  synth_long(hdr, &n, "NAXIS1", opts->naxes[0], "");
+  synth_long(hdr, &n, "NAXIS2", opts->naxes[1], "");
+  proj=(opts->tpv_order > 0) ? "TPV" : opts->proj;
+  snprintf(ctype, sizeof(ctype), "RA---%.3s%s", proj, (opts->sip_order > 0) ? "-SIP" : "");
+  synth_string(hdr, &n, "CTYPE1", ctype, "");
+  snprintf(ctype, sizeof(ctype), "DEC--%.3s%s", proj, (opts->sip_order > 0) ? "-SIP" : "");
+  synth_string(hdr, &n, "CTYPE2", ctype, "");
+  synth_double(hdr, &n, "CRVAL1", opts->crval[0], "");
+  synth_double(hdr, &n, "CRVAL2", opts->crval[1], "");
+  synth_double(hdr, &n, "CRPIX1", 0.5*(opts->naxes[0]+1), "");
+  synth_double(hdr, &n, "CRPIX2", 0.5*(opts->naxes[1]+1), "");
+  cr=cos(opts->rot*SYNTH_D2R);
+  sr=sin(opts->rot*SYNTH_D2R);
+  synth_double(hdr, &n, "CD1_1", -opts->cdelt*cr, "");
+  synth_double(hdr, &n, "CD1_2", opts->cdelt*sr, "");
+  synth_double(hdr, &n, "CD2_1", opts->cdelt*sr, "");
+  synth_double(hdr, &n, "CD2_2", opts->cdelt*cr, "");
+  synth_string(hdr, &n, "RADESYS", "ICRS", "");
+  synth_double(hdr, &n, "EQUINOX", 2000.0, "");
+  if (opts->sip_order > 0) {
+    synth_sip(hdr, &n, &o, "A", acoef);
+    synth_sip(hdr, &n, &o, "B", bcoef);
+    synth_sip(hdr, &n, &o, "AP", acoef);
+    synth_sip(hdr, &n, &o, "BP", bcoef);
+  }
+  if (opts->tpv_order > 0) {
+    synth_tpv(hdr, &n, &o, 1);
+    synth_tpv(hdr, &n, &o, 2);
+  }
+
+  // extra cards
+  for (nkey=0; synth_keys[nkey].key!=NULL; nkey++);
+  for (i=0; n<opts->ncard; i++) {
+    if (i%10 == 8) {
+      snprintf(str, sizeof(str), "synthetic processing step %d", i);
+      synth_card(hdr, &n, "HISTORY", NULL, str);
+    } else if (i%10 == 9) {
+      synth_card(hdr, &n, "COMMENT", NULL, "synthetic header for benchmarking");
+    } else if ((i < nkey)&&(synth_keys[i].value != NULL)) {
+      synth_string(hdr, &n, synth_keys[i].key, synth_keys[i].value, "");
+    } else if (i < nkey) {
+      synth_double(hdr, &n, synth_keys[i].key, 100.0*synth_rand(&o.seed), "");
+    } else {
+      snprintf(key, sizeof(key), "XKEY%04d", i);
+      synth_double(hdr, &n, key, 100.0*synth_rand(&o.seed), "synthetic value");
+    }
+  }
+  *nkeyrec=n;
+  synth_card(hdr, &n, "END", NULL, "");
+  hdr[80*n]='\0';
+  *header=hdr;
+
+  return(0);
+}
+
+// Standard normal random number
+static double synth_gauss(uint64_t *state) {
+  double u;
+
+  u=synth_rand(state);
+
+  return(sqrt(-2.0*log(1.0-u))*cos(2.0*M_PI*synth_rand(state)));
+}
+
+//
+// Fill pix (naxes[0]*naxes[1] floats) with a sky of level 100 and noise
+// of 5, and opts->nstar gaussian stars of 2 pixel sigma
+// Function returns 0 on success and -1 on failure
+//
+int synth_image(const struct synth_opts *opts, float *pix) {
+  uint64_t seed=opts->seed+1;
+  double xs, ys, flux, dx, dy;
+  long nstar, i, x, y, x0, x1, y0, y1;
+
+  if ((opts->naxes[0] < 1)||(opts->naxes[1] < 1)) {
+    fprintf(stderr, "bad image size in synth_image\n");
+    return(-1);
+  }
+  for (i=0; i<opts->naxes[0]*opts->naxes[1]; i++) pix[i]=100.0+5.0*synth_gauss(&seed);
+  nstar=(opts->nstar >= 0) ? opts->nstar : opts->naxes[0]*opts->naxes[1]/10000;
+  for (i=0; i<nstar; i++) {
+    xs=opts->naxes[0]*synth_rand(&seed);
+    ys=opts->naxes[1]*synth_rand(&seed);
+    flux=1000.0/pow(synth_rand(&seed)+0.01, 1.5);
+    x0=(xs > 8.0) ? (long)xs-8 : 0;
+    x1=(xs+8.0 < opts->naxes[0]) ? (long)xs+8 : opts->naxes[0]-1;
+    y0=(ys > 8.0) ? (long)ys-8 : 0;
+    y1=(ys+8.0 < opts->naxes[1]) ? (long)ys+8 : opts->naxes[1]-1;
+    for (y=y0; y<=y1; y++) {
+      for (x=x0; x<=x1; x++) {
+        dx=x+0.5-xs;
+        dy=y+0.5-ys;
+        pix[y*opts->naxes[0]+x]+=flux/(8.0*M_PI)*exp(-(dx*dx+dy*dy)/8.0);
+      }
+    }
+  }
+
+  return(0);
+}
+
+// n uniform random pixel coordinates covering the image of opts, from
+// 0.5 to naxes+0.5 on each axis
+void synth_points(const struct synth_opts *opts, long n, double *x, double *y) {
+  uint64_t seed=opts->seed+2;
+  long i;
+
+  for (i=0; i<n; i++) {
+    x[i]=0.5+opts->naxes[0]*synth_rand(&seed);
+    y[i]=0.5+opts->naxes[1]*synth_rand(&seed);
+  }
+}
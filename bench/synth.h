@@ -0,0 +1,54 @@
+//
+// Synthetic fits headers, images and coordinates for benchmarks and
+// accuracy tests, no survey data needed
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+
+// Description of a synthetic image header, set defaults with synth_opts_init
+struct synth_opts {
+  char proj[4]; // wcslib projection code, e.g. "TAN"
+  long naxes[2]; // image size in pixels
+  double cdelt; // pixel scale in deg
+  double rot; // rotation of the pixel axes in deg
+  double crval[2]; // ra,dec of the reference pixel (image center) in deg
+  int sip_order; // SIP distortion order, 0 for none, below SIP_ARRAY_MAX
+  double sip_amp; // SIP distortion at the image corners in pixels
+  int tpv_order; // TPV distortion order 1-3, 0 for none, overrides proj
+  double tpv_amp; // TPV distortion at the image corners in pixels
+  long nstar; // number of stars in synth_image, < 0 for one per 10000 pixels
+  int ncard; // total number of cards, filled up with extra keywords
+  uint64_t seed; // random number seed
+};
+
+void synth_opts_init(struct synth_opts *opts);
+double synth_rand(uint64_t *state);
+int synth_preset(struct synth_opts *opts, const char *name);
+int synth_header(const struct synth_opts *opts, char **header, int *nkeyrec);
+int synth_image(const struct synth_opts *opts, float *pix);
+void synth_points(const struct synth_opts *opts, long n, double *x, double *y);
+
+#endif //SYNTH_H
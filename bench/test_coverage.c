@@ -0,0 +1,271 @@
+//
+// Test the outline based coverage of wcs_getsquids_poly, and the
+// multi-resolution coverage of wcs_getsquids_moc expanded to kmax, against
+// the pixel walk of wcs_getsquids_sorted on the synth.c test cases.
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libsquid_wcs.h>
+
+#include "synth.h"
+
+#define NAXIS 1024 // test image size in pixels
+#define SCALE_FOOT 4096.0 // footprint in arcsec of the scaling test
+#define SCALE_NREP 20 // timed calls per size in the scaling test
+
+// Room for the coverage of an image of naxes pixels at scale cdelt and k
+static long cover_len(const long naxes[], double cdelt, int k) {
+  double tsize;
+
+  tsize=90.0/(1L << k);
+  return((long)(4*(naxes[0]*fabs(cdelt)/tsize+2)*(naxes[1]*fabs(cdelt)/tsize+2))+64);
+}
+
+// Test if squid at k can touch the image: its center must be within one
+// and a half tiles of the image rectangle
+static int cover_near(int proj, struct wcsprm *wcs, const long naxes[], double cdelt, int k, squid_type squid) {
+  double ra, dec, x, y, margin;
+
+  if (squid2sph(proj, squid, &ra, &dec) < 0) return(0);
+  if (wcs_rd2pix(wcs, ra/DD2R, dec/DD2R, &x, &y) != 0) return(0);
+  margin=1.5*(90.0/(1L << k))/fabs(cdelt)+1.0;
+
+  return((x >= -margin)&&(x <= naxes[0]-1+margin)&&(y >= -margin)&&(y <= naxes[1]-1+margin));
+}
+
+//
+// Compare the sorted coverage got with the sorted reference ref.  Every
+// reference tile must be in got; tiles only in got are allowed where the
+// reference sampling can miss a sliver of a tile at the image edge.
+// Returns the number of bad tiles.
+//
+static long cover_cmp(const char *name, int proj, struct wcsprm *wcs, const long naxes[], double cdelt, int k,
+    const squid_type *ref, long nref, const squid_type *got, long ngot) {
+  long i=0, j=0, nmiss=0, nextra=0, nfar=0;
+
+  while ((i < nref)||(j < ngot)) {
+    if ((j >= ngot)||((i < nref)&&(ref[i] < got[j]))) {
+      nmiss++;
+      i++;
+    } else if ((i >= nref)||(got[j] < ref[i])) {
+      nextra++;
+      if (!cover_near(proj, wcs, naxes, cdelt, k, got[j])) nfar++;
+      j++;
+    } else {
+      i++;
+      j++;
+    }
+  }
+  printf("%-28s k=%-2d ref=%-8ld got=%-8ld missing=%ld extra=%ld far=%ld %s\n",name,k,nref,ngot,nmiss,nextra,nfar,
+      ((nmiss == 0)&&(nfar == 0)) ? "ok" : "FAILED");
+
+  return(nmiss+nfar);
+}
+
+static int squid_cmp(const void *a, const void *b) {
+  squid_type sa=*(const squid_type *)a, sb=*(const squid_type *)b;
+
+  return((sa > sb)-(sa < sb));
+}
+
+// Expand the mixed resolution coverage moc into its tiles at kmax, sorted.
+// Returns the number of tiles, or -1 on failure.
+static long moc_expand(int proj, const squid_type *moc, long nmoc, int kmax, squid_type *out, long len) {
+  double ra, dec, fx, fy;
+  long i, a, b, ix, iy, m, n=0, nr, nk;
+  int face, r;
+
+  nk=1L << kmax;
+  for (i=0; i<nmoc; i++) {
+    r=squid_getres(moc[i]);
+    if ((r > kmax)||(squid2sph(proj, moc[i], &ra, &dec) < 0)||(sph2xyf(proj, ra, dec, &fx, &fy, &face) < 0)) return(-1);
+    nr=1L << r;
+    ix=(long)floor(fx*nr);
+    iy=(long)floor(fy*nr);
+    if (ix >= nr) ix=nr-1;
+    if (iy >= nr) iy=nr-1;
+    m=1L << (kmax-r);
+    if (n+m*m > len) return(-1);
+    for (b=0; b<m; b++) {
+      for (a=0; a<m; a++) {
+        if ((xyf2sph(proj, (ix*m+a+0.5)/nk, (iy*m+b+0.5)/nk, face, &ra, &dec) < 0)||
+            (sph2squid(proj, ra, dec, kmax, &out[n++]) < 0)) return(-1);
+      }
+    }
+  }
+  qsort(out, n, sizeof(squid_type), squid_cmp);
+
+  return(n);
+}
+
+//
+// Run wcs_getsquids_poly at resolution k on images of the same footprint
+// and a growing number of pixels.  The number of wcs transforms (with
+// LIBSQUIDWCS_STATS) must not grow with the image size, and without the
+// counters neither may the run time beyond noise, where a pixel walk of
+// the outline would take 64 times longer at the largest size.
+// Returns 0 if it does not grow, 1 if it does, -1 on failure.
+//
+static int poly_scaling(int proj, int k) {
+  long size[] = {1024, 4096, 16384, 65536};
+  struct squidwcs_stat stats[SQUIDWCS_STAT_N];
+  struct synth_opts so;
+  struct wcs_image img;
+  struct timespec t0, t1;
+  squid_type *got;
+  char *header;
+  double t, tmin[4];
+  unsigned long long ntrans[4];
+  long len, ngot;
+  int i, r, nkeyrec, grows;
+
+  for (i=0; i<4; i++) {
+    synth_opts_init(&so);
+    so.naxes[0]=so.naxes[1]=size[i];
+    so.cdelt=SCALE_FOOT/size[i]/3600.0;
+    if ((synth_header(&so, &header, &nkeyrec) < 0)||(wcsimg_fromhdr(header, nkeyrec, &img) < 0)) return(-1);
+    free(header);
+    len=cover_len(img.naxes, so.cdelt, k);
+    if ((got=(squid_type *)malloc(len*sizeof(squid_type))) == NULL) {
+      wcsimg_free(&img);
+      return(-1);
+    }
+    tmin[i]=HUGE_VAL;
+    for (r=0; r<SCALE_NREP; r++) {
+      squidwcs_stats_reset();
+      ngot=0;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      if (wcs_getsquids_poly(proj, img.wcs, so.cdelt, img.naxes, k, got, len, &ngot) < 0) {
+        free(got);
+        wcsimg_free(&img);
+        return(-1);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      t=(t1.tv_sec-t0.tv_sec)*1e9+(t1.tv_nsec-t0.tv_nsec);
+      if (t < tmin[i]) tmin[i]=t;
+    }
+    squidwcs_stats_get(stats, SQUIDWCS_STAT_N);
+    ntrans[i]=stats[SQUIDWCS_STAT_WCS_PIX2RD].calls;
+    printf("poly scaling k=%-2d %6ldpx tiles=%-6ld transforms=%-6llu %10.0f ns\n",k,size[i],ngot,ntrans[i],tmin[i]);
+    free(got);
+    wcsimg_free(&img);
+  }
+  if (squidwcs_stats_enabled()) grows=(ntrans[3] > ntrans[0]+ntrans[0]/4);
+  else grows=(tmin[3] > 8*tmin[0]);
+  printf("poly scaling k=%-2d %s\n",k,grows ? "FAILED" : "ok");
+
+  return(grows);
+}
+
+int main(int argc, char *argv[]) {
+  char *preset[] = {"default", "pole", "edge", "corner"};
+  char *projname[] = {"TSC", "CSC", "QSC", "HSC"};
+  int proj[] = {QSC, HSC};
+  int kval[] = {4, 8, 12, 14, 16, 18};
+  int kmin[] = {4, 6, 10}, kmax[] = {12, 14, 16};
+  struct synth_opts so;
+  struct wcs_image img;
+  squid_type *ref, *got, *moc;
+  char name[64], *header;
+  long len, nref, ngot, nmoc;
+  int ip, ij, ik, nkeyrec, fail=0;
+
+  // report library errors on stderr as they happen
+  squidwcs_error_handler(squidwcs_error_stderr, NULL);
+
+  for (ip=0; ip<4; ip++) {
+    synth_opts_init(&so);
+    so.naxes[0]=so.naxes[1]=NAXIS;
+    if ((ip > 0)&&(synth_preset(&so, preset[ip]) < 0)) {
+      fprintf(stderr,"synth_preset failed in %s\n",argv[0]);
+      exit(-1);
+    }
+    if ((synth_header(&so, &header, &nkeyrec) < 0)||(wcsimg_fromhdr(header, nkeyrec, &img) < 0)) {
+      fprintf(stderr,"cannot make %s wcs in %s\n",preset[ip],argv[0]);
+      exit(-1);
+    }
+    free(header);
+    for (ij=0; ij<2; ij++) {
+      for (ik=0; ik<(int)(sizeof(kval)/sizeof(kval[0])); ik++) {
+        snprintf(name,sizeof(name),"poly %s %s",preset[ip],projname[proj[ij]]);
+        len=cover_len(img.naxes, so.cdelt, kval[ik]);
+        ref=(squid_type *)malloc(len*sizeof(squid_type));
+        got=(squid_type *)malloc(len*sizeof(squid_type));
+        if ((ref == NULL)||(got == NULL)) {
+          fprintf(stderr,"malloc failed in %s\n",argv[0]);
+          exit(-1);
+        }
+        nref=ngot=0;
+        if ((wcs_getsquids_sorted(proj[ij], img.wcs, so.cdelt, img.naxes, kval[ik], ref, len, &nref) < 0)||
+            (wcs_getsquids_poly(proj[ij], img.wcs, so.cdelt, img.naxes, kval[ik], got, len, &ngot) < 0)) {
+          fprintf(stderr,"coverage failed for %s in %s\n",name,argv[0]);
+          exit(-1);
+        }
+        if (cover_cmp(name, proj[ij], img.wcs, img.naxes, so.cdelt, kval[ik], ref, nref, got, ngot) > 0) fail=1;
+        free(ref);
+        free(got);
+      }
+      for (ik=0; ik<(int)(sizeof(kmin)/sizeof(kmin[0])); ik++) {
+        snprintf(name,sizeof(name),"moc %s %s k>=%d",preset[ip],projname[proj[ij]],kmin[ik]);
+        len=cover_len(img.naxes, so.cdelt, kmax[ik]);
+        ref=(squid_type *)malloc(len*sizeof(squid_type));
+        got=(squid_type *)malloc(len*sizeof(squid_type));
+        moc=(squid_type *)malloc(len*sizeof(squid_type));
+        if ((ref == NULL)||(got == NULL)||(moc == NULL)) {
+          fprintf(stderr,"malloc failed in %s\n",argv[0]);
+          exit(-1);
+        }
+        nref=nmoc=0;
+        if ((wcs_getsquids_sorted(proj[ij], img.wcs, so.cdelt, img.naxes, kmax[ik], ref, len, &nref) < 0)||
+            (wcs_getsquids_moc(proj[ij], img.wcs, so.cdelt, img.naxes, kmin[ik], kmax[ik], moc, len, &nmoc) < 0)||
+            ((ngot=moc_expand(proj[ij], moc, nmoc, kmax[ik], got, len)) < 0)) {
+          fprintf(stderr,"coverage failed for %s in %s\n",name,argv[0]);
+          exit(-1);
+        }
+        if (cover_cmp(name, proj[ij], img.wcs, img.naxes, so.cdelt, kmax[ik], ref, nref, got, ngot) > 0) fail=1;
+        free(ref);
+        free(got);
+        free(moc);
+      }
+    }
+    wcsimg_free(&img);
+  }
+  for (ik=8; ik<=12; ik+=2) {
+    if ((ij=poly_scaling(QSC, ik)) < 0) {
+      fprintf(stderr,"poly scaling test failed in %s\n",argv[0]);
+      exit(-1);
+    }
+    if (ij > 0) fail=1;
+  }
+  if (fail) exit(-1);
+
+  return(0);
+}
@@ -0,0 +1,425 @@
+//
+// Micro-benchmarks of the wcs hot paths, with warmup and repetition
+// statistics, on synthetic images (see synth.c).
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#define _GNU_SOURCE 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libsquid_wcs.h>
+
+#include "synth.h"
+
+#define NPTS 4096 // points per transform benchmark iteration
+#define NTILE 64 // squids per tile_getwcs benchmark iteration
+#define MAXSQUIDS (1L << 20) // squid array size for the coverage benchmarks
+
+// Repetition settings, from the command line
+struct bench_opts {
+  int nrep; // number of timed repetitions
+  double reptime; // target seconds per repetition
+  double warmup; // seconds of untimed calls first
+  const char *filter; // only run benchmarks with this in their name
+  int csv; // print comma separated values
+  int stats; // print the library call counters after each benchmark
+};
+
+// Runs niter iterations of one benchmark
+typedef void (*bench_fn)(void *ctx, long niter);
+
+// Keeps results alive so calls are not optimized away
+static volatile double bench_sink;
+
+static double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec+1e-9*ts.tv_nsec);
+}
+
+static int bench_cmp(const void *a, const void *b) {
+  double da=*(const double *)a, db=*(const double *)b;
+
+  return((da > db)-(da < db));
+}
+
+//
+// Time fn, nop operations per iteration: warm up, find the number of
+// iterations that takes about reptime, then time nrep repetitions and
+// print min, median, mean and relative spread of ns per operation, and
+// the median throughput
+//
+static void bench_run(const struct bench_opts *bo, const char *name, bench_fn fn, void *ctx, long nop) {
+  double t0, dt, *ns, mean=0.0, var=0.0;
+  long niter;
+  int r;
+
+  if ((bo->filter != NULL)&&(strstr(name, bo->filter) == NULL)) return;
+  if (bo->stats) squidwcs_stats_reset();
+  if ((ns=(double *)malloc(bo->nrep*sizeof(double))) == NULL) {
+    fprintf(stderr,"malloc failed in bench_run\n");
+    exit(-1);
+  }
+  // warmup, doubling the iterations to calibrate
+  t0=bench_now();
+  niter=1;
+  for (;;) {
+    dt=bench_now();
+    fn(ctx, niter);
+    dt=bench_now()-dt;
+    if ((dt >= 0.25*bo->reptime)&&(bench_now()-t0 >= bo->warmup)) break;
+    if (dt < 0.25*bo->reptime) niter*=2;
+  }
+  niter=(long)ceil(niter*bo->reptime/fmax(dt, 1e-9));
+  if (niter < 1) niter=1;
+  for (r=0; r<bo->nrep; r++) {
+    dt=bench_now();
+    fn(ctx, niter);
+    ns[r]=1e9*(bench_now()-dt)/(niter*(double)nop);
+    mean+=ns[r];
+  }
+  mean/=bo->nrep;
+  for (r=0; r<bo->nrep; r++) var+=(ns[r]-mean)*(ns[r]-mean);
+  var=(bo->nrep > 1) ? var/(bo->nrep-1) : 0.0;
+  qsort(ns, bo->nrep, sizeof(double), bench_cmp);
+  if (bo->csv) {
+    printf("%s,%ld,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.6f\n",name,niter*nop,bo->nrep,ns[0],ns[bo->nrep/2],mean,
+           sqrt(var),ns[bo->nrep-1],1e3/ns[bo->nrep/2]);
+  } else {
+    printf("%-32s %12.1f %12.1f %12.1f %7.1f%% %12.4f\n",name,ns[0],ns[bo->nrep/2],mean,
+           100.0*sqrt(var)/mean,1e3/ns[bo->nrep/2]);
+  }
+  if (bo->stats) squidwcs_stats_dump(stdout);
+  fflush(stdout);
+  free(ns);
+}
+
+// Point transforms
+struct bench_xy {
+  struct wcs_image img; // synthetic image wcs and SIP
+  double x[NPTS], y[NPTS]; // pixel coordinates
+  double ra[NPTS], dec[NPTS]; // matching sky coordinates
+};
+
+static void bench_pix2rd(void *ctx, long niter) {
+  struct bench_xy *b=(struct bench_xy *)ctx;
+  double ra, dec, sum=0.0;
+  long it, i;
+
+  for (it=0; it<niter; it++) {
+    for (i=0; i<NPTS; i++) {
+      wcs_pix2rd(b->img.wcs, b->x[i], b->y[i], &ra, &dec);
+      sum+=ra;
+    }
+  }
+  bench_sink=sum;
+}
+
+static void bench_rd2pix(void *ctx, long niter) {
+  struct bench_xy *b=(struct bench_xy *)ctx;
+  double x, y, sum=0.0;
+  long it, i;
+
+  for (it=0; it<niter; it++) {
+    for (i=0; i<NPTS; i++) {
+      wcs_rd2pix(b->img.wcs, b->ra[i], b->dec[i], &x, &y);
+      sum+=x;
+    }
+  }
+  bench_sink=sum;
+}
+
+static void bench_sipfwd(void *ctx, long niter) {
+  struct bench_xy *b=(struct bench_xy *)ctx;
+  double x, y, sum=0.0;
+  long it, i;
+
+  for (it=0; it<niter; it++) {
+    for (i=0; i<NPTS; i++) {
+      sip_forward(&b->img.sparam, b->x[i], b->y[i], &x, &y);
+      sum+=x;
+    }
+  }
+  bench_sink=sum;
+}
+
+static void bench_siprev(void *ctx, long niter) {
+  struct bench_xy *b=(struct bench_xy *)ctx;
+  double x, y, sum=0.0;
+  long it, i;
+
+  for (it=0; it<niter; it++) {
+    for (i=0; i<NPTS; i++) {
+      sip_reverse(&b->img.sparam, b->x[i], b->y[i], &x, &y);
+      sum+=x;
+    }
+  }
+  bench_sink=sum;
+}
+
+// Set up b with the image of so and random points on it.
+// Returns 0 on success and -1 on failure
+static int bench_xy_init(struct bench_xy *b, const struct synth_opts *so) {
+  char *header;
+  int nkeyrec, stat[NPTS];
+
+  if (synth_header(so, &header, &nkeyrec) < 0) return(-1);
+  if (wcsimg_fromhdr(header, nkeyrec, &b->img) < 0) {
+    free(header);
+    return(-1);
+  }
+  free(header);
+  synth_points(so, NPTS, b->x, b->y);
+  wcs_pix2rd_batch(b->img.wcs, NPTS, b->x, b->y, 1, b->ra, b->dec, 1, stat);
+
+  return(0);
+}
+
+// Tile wcs creation
+struct bench_tile {
+  int proj; // squid projection
+  squid_type squid[NTILE]; // random tiles at one resolution
+  squid_type tside; // tile size
+};
+
+static void bench_getwcs(void *ctx, long niter) {
+  struct bench_tile *b=(struct bench_tile *)ctx;
+  struct wcsprm *wcs;
+  long it, i;
+
+  for (it=0; it<niter; it++) {
+    for (i=0; i<NTILE; i++) {
+      if (tile_getwcs(b->proj, b->squid[i], b->tside, &wcs) < 0) continue;
+      bench_sink=wcs->crval[0];
+      wcs_free(wcs);
+    }
+  }
+}
+
+// Image coverage
+struct bench_cover {
+  int proj; // squid projection
+  int k; // squid resolution
+  struct wcs_image img; // synthetic image
+  double cdelt; // pixel scale
+  squid_type *squids; // MAXSQUIDS results
+  int poly; // use wcs_getsquids_poly instead of wcs_getsquids
+};
+
+static void bench_getsquids(void *ctx, long niter) {
+  struct bench_cover *b=(struct bench_cover *)ctx;
+  long it, used;
+
+  for (it=0; it<niter; it++) {
+    used=0;
+    if (b->poly) {
+      wcs_getsquids_poly(b->proj, b->img.wcs, b->cdelt, b->img.naxes, b->k, b->squids, MAXSQUIDS, &used);
+    } else {
+      wcs_getsquids(b->proj, b->img.wcs, b->cdelt, b->img.naxes, b->k, b->squids, MAXSQUIDS, &used);
+    }
+    bench_sink=used;
+  }
+}
+
+// Tile header writing into an in-memory fits file
+struct bench_addwcs {
+  int proj; // squid projection
+  squid_type squid; // tile
+  struct wcsprm *wcs; // tile wcs
+  char *ihdr; // source image header
+  void *buf; // memory file buffer
+  size_t bufsize; // memory file buffer size
+};
+
+static void bench_tile_addwcs(void *ctx, long niter) {
+  struct bench_addwcs *b=(struct bench_addwcs *)ctx;
+  fitsfile *fptr;
+  long it, naxes[2]={64, 64};
+  int status;
+
+  for (it=0; it<niter; it++) {
+    status=0;
+    if (fits_create_memfile(&fptr, &b->buf, &b->bufsize, 2880, realloc, &status)||
+        fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status)) {
+      fits_report_error(stderr, status);
+      exit(-1);
+    }
+    if (tile_addwcs(b->proj, b->squid, b->wcs, b->ihdr, fptr) < 0) exit(-1);
+    fits_close_file(fptr, &status);
+  }
+}
+
+static void usage(char *argv[]) {
+  fprintf(stderr,"usage: %s [-r nrep] [-t reptime] [-w warmup] [-f filter] [-c] [-s]\n",argv[0]);
+  fprintf(stderr,"  -r nrep    timed repetitions per benchmark (default 10)\n");
+  fprintf(stderr,"  -t reptime target seconds per repetition (default 0.05)\n");
+  fprintf(stderr,"  -w warmup  seconds of untimed warmup per benchmark (default 0.1)\n");
+  fprintf(stderr,"  -f filter  only run benchmarks whose name contains filter\n");
+  fprintf(stderr,"  -c         print comma separated values\n");
+  fprintf(stderr,"  -s         print the library call counters of each benchmark\n");
+  fprintf(stderr,"             (needs a library built with LIBSQUIDWCS_STATS)\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_opts bo;
+  struct synth_opts so;
+  struct bench_xy *bxy;
+  struct bench_tile bt;
+  struct bench_cover bc;
+  struct bench_addwcs ba;
+  char *projname[] = {"tsc", "csc", "qsc", "hsc"};
+  char name[64];
+  uint64_t seed=1;
+  long size[] = {1024, 4096, 16384};
+  int kval[] = {0, 4, 8, 12};
+  int opt, order, proj, i, j, nkeyrec;
+
+  bo.nrep=10;
+  bo.reptime=0.05;
+  bo.warmup=0.1;
+  bo.filter=NULL;
+  bo.csv=0;
+  bo.stats=0;
+  while ((opt=getopt(argc, argv, "r:t:w:f:cs")) != -1) {
+    switch (opt) {
+      case 'r': bo.nrep=atoi(optarg); break;
+      case 't': bo.reptime=atof(optarg); break;
+      case 'w': bo.warmup=atof(optarg); break;
+      case 'f': bo.filter=optarg; break;
+      case 'c': bo.csv=1; break;
+      case 's': bo.stats=1; break;
+      default: usage(argv);
+    }
+  }
+  if ((optind != argc)||(bo.nrep < 1)||!(bo.reptime > 0.0)) usage(argv);
+  if (bo.csv) {
+    printf("name,nop,nrep,min_ns,median_ns,mean_ns,stddev_ns,max_ns,median_mops\n");
+  } else {
+    printf("%-32s %12s %12s %12s %8s %12s\n","benchmark","min ns/op","median ns/op","mean ns/op","spread","Mop/s");
+  }
+  if ((bxy=(struct bench_xy *)malloc(sizeof(struct bench_xy))) == NULL) {
+    fprintf(stderr,"malloc failed in %s\n",argv[0]);
+    exit(-1);
+  }
+
+  // point transforms on a plain TAN image
+  synth_opts_init(&so);
+  if (bench_xy_init(bxy, &so) < 0) exit(-1);
+  bench_run(&bo, "wcs_pix2rd tan", bench_pix2rd, bxy, NPTS);
+  bench_run(&bo, "wcs_rd2pix tan", bench_rd2pix, bxy, NPTS);
+  wcsimg_free(&bxy->img);
+
+  // the same around the pole, and with TPV distortion
+  for (i=0; i<2; i++) {
+    synth_opts_init(&so);
+    synth_preset(&so, i ? "tpv" : "pole");
+    if (bench_xy_init(bxy, &so) < 0) exit(-1);
+    sprintf(name,"wcs_pix2rd %s",i ? "tpv" : "pole");
+    bench_run(&bo, name, bench_pix2rd, bxy, NPTS);
+    sprintf(name,"wcs_rd2pix %s",i ? "tpv" : "pole");
+    bench_run(&bo, name, bench_rd2pix, bxy, NPTS);
+    wcsimg_free(&bxy->img);
+  }
+  synth_opts_init(&so);
+
+  // SIP at each order
+  for (order=2; order<=6; order++) {
+    so.sip_order=order;
+    if (bench_xy_init(bxy, &so) < 0) exit(-1);
+    sprintf(name,"sip_forward order=%d",order);
+    bench_run(&bo, name, bench_sipfwd, bxy, NPTS);
+    sprintf(name,"sip_reverse order=%d",order);
+    bench_run(&bo, name, bench_siprev, bxy, NPTS);
+    wcsimg_free(&bxy->img);
+  }
+  free(bxy);
+
+  // tile wcs for each projection and a range of resolutions
+  bt.tside=1024;
+  for (proj=TSC; proj<=HSC; proj++) {
+    bt.proj=proj;
+    for (j=0; j<(int)(sizeof(kval)/sizeof(int)); j++) {
+      for (i=0; i<NTILE; i++) {
+        if (sph2squid(proj, 2.0*M_PI*synth_rand(&seed), asin(2.0*synth_rand(&seed)-1.0), kval[j], &bt.squid[i]) < 0) {
+          fprintf(stderr,"sph2squid failed in %s\n",argv[0]);
+          exit(-1);
+        }
+      }
+      sprintf(name,"tile_getwcs %s k=%d",projname[proj],kval[j]);
+      bench_run(&bo, name, bench_getwcs, &bt, NTILE);
+    }
+  }
+
+  // coverage of images of increasing size at 1 arcsec pixels
+  if ((bc.squids=(squid_type *)malloc(MAXSQUIDS*sizeof(squid_type))) == NULL) {
+    fprintf(stderr,"malloc failed in %s\n",argv[0]);
+    exit(-1);
+  }
+  bc.proj=TSC;
+  bc.k=10;
+  synth_opts_init(&so);
+  bc.cdelt=so.cdelt;
+  for (i=0; i<(int)(sizeof(size)/sizeof(long)); i++) {
+    so.naxes[0]=so.naxes[1]=size[i];
+    if (synth_header(&so, &ba.ihdr, &nkeyrec) < 0) exit(-1);
+    if (wcsimg_fromhdr(ba.ihdr, nkeyrec, &bc.img) < 0) exit(-1);
+    free(ba.ihdr);
+    for (bc.poly=0; bc.poly<=1; bc.poly++) {
+      sprintf(name,"%s %ldpx k=%d",bc.poly ? "wcs_getsquids_poly" : "wcs_getsquids",size[i],bc.k);
+      bench_run(&bo, name, bench_getsquids, &bc, 1);
+    }
+    wcsimg_free(&bc.img);
+  }
+  free(bc.squids);
+
+  // tile header from a realistic 300 card SIP image header
+  synth_opts_init(&so);
+  so.sip_order=3;
+  so.ncard=300;
+  if (synth_header(&so, &ba.ihdr, &nkeyrec) < 0) exit(-1);
+  ba.proj=TSC;
+  ba.buf=NULL;
+  ba.bufsize=0;
+  if ((sph2squid(ba.proj, so.crval[0]*DD2R, so.crval[1]*DD2R, 8, &ba.squid) < 0)||
+      (tile_getwcs(ba.proj, ba.squid, 1024, &ba.wcs) < 0)) {
+    fprintf(stderr,"tile_getwcs failed in %s\n",argv[0]);
+    exit(-1);
+  }
+  bench_run(&bo, "tile_addwcs 300 cards", bench_tile_addwcs, &ba, 1);
+  wcs_free(ba.wcs);
+  free(ba.ihdr);
+  free(ba.buf);
+
+  return(0);
+}
@@ -0,0 +1,269 @@
+//
+// Generate synthetic fits headers, images and matching coordinate lists
+// for benchmarks and accuracy tests (see synth.c).
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#define _GNU_SOURCE 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libsquid_wcs.h>
+
+#include "synth.h"
+
+// Write the cards of header after the mandatory ones to the open image
+static int write_cards(fitsfile *fptr, const char *header, int nkeyrec) {
+  char card[FLEN_CARD];
+  int i, status=0;
+
+  for (i=0; i<nkeyrec; i++) {
+    if ((strncmp(header+80*i, "SIMPLE  ", 8) == 0)||(strncmp(header+80*i, "BITPIX  ", 8) == 0)||
+        (strncmp(header+80*i, "NAXIS", 5) == 0)) continue;
+    memcpy(card, header+80*i, 80);
+    card[80]='\0';
+    if (fits_write_record(fptr, card, &status)) {
+      fits_report_error(stderr, status);
+      return(-1);
+    }
+  }
+
+  return(0);
+}
+
+// Write a fits file with header and synthetic pixels
+static int write_image(const char *filename, const struct synth_opts *so, const char *header, int nkeyrec) {
+  fitsfile *fptr;
+  char fname[FLEN_FILENAME];
+  float *pix;
+  long naxes[2];
+  int status=0;
+
+  if ((pix=(float *)malloc(so->naxes[0]*so->naxes[1]*sizeof(float))) == NULL) {
+    fprintf(stderr,"malloc failed in write_image\n");
+    return(-1);
+  }
+  if (synth_image(so, pix) < 0) {
+    free(pix);
+    return(-1);
+  }
+  snprintf(fname,sizeof(fname),"!%s",filename);
+  naxes[0]=so->naxes[0];
+  naxes[1]=so->naxes[1];
+  if (fits_create_file(&fptr, fname, &status)||
+      fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status)) {
+    fits_report_error(stderr, status);
+    free(pix);
+    return(-1);
+  }
+  if ((write_cards(fptr, header, nkeyrec) < 0)||
+      fits_write_img(fptr, TFLOAT, 1, naxes[0]*naxes[1], pix, &status)) {
+    fits_report_error(stderr, status);
+    fits_close_file(fptr, &status);
+    free(pix);
+    return(-1);
+  }
+  free(pix);
+  if (fits_close_file(fptr, &status)) {
+    fits_report_error(stderr, status);
+    return(-1);
+  }
+
+  return(0);
+}
+
+// Write header as text, one card per line
+static int write_header(const char *filename, const char *header, int nkeyrec) {
+  FILE *out;
+  int i;
+
+  out=(strcmp(filename, "-") == 0) ? stdout : fopen(filename, "w");
+  if (out == NULL) {
+    fprintf(stderr,"cannot open %s in write_header\n",filename);
+    return(-1);
+  }
+  for (i=0; i<=nkeyrec; i++) fprintf(out,"%.80s\n",header+80*i);
+  if (out != stdout) fclose(out);
+
+  return(0);
+}
+
+// Load the wcs of header for the coordinate lists.  By default every card
+// is used (wcsimg_fromhdr), as any wcs reader and wcsbench do.  With
+// tools=1 it is loaded the way wcsxy2rd and wcsrd2xy do, with wcsimg_open
+// on a fits image (here an empty one in memory), which drops the PV?_*
+// cards and so any TPV distortion.
+static int header_wcs(const struct synth_opts *so, const char *header, int nkeyrec, int tools, struct wcs_image *img) {
+  fitsfile *fptr;
+  long naxes[2];
+  int ret, status=0;
+
+  if (!tools) return(wcsimg_fromhdr(header, nkeyrec, img));
+  naxes[0]=so->naxes[0];
+  naxes[1]=so->naxes[1];
+  if (fits_create_file(&fptr, "mem://", &status)||
+      fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status)) {
+    fits_report_error(stderr, status);
+    return(-1);
+  }
+  ret=write_cards(fptr, header, nkeyrec);
+  if (ret == 0) ret=wcsimg_open(fptr, img);
+  status=0;
+  fits_close_file(fptr, &status);
+
+  return(ret);
+}
+
+// Write npts random points of the image to xyfile (x y) and rdfile
+// (ra dec in deg), either may be NULL.  Points the wcs cannot convert
+// are left out of both.  tools is passed on to header_wcs.
+static int write_points(const struct synth_opts *so, const char *header, int nkeyrec, int tools, long npts,
+      const char *xyfile, const char *rdfile) {
+  struct wcs_image img;
+  FILE *xyout=NULL, *rdout=NULL;
+  double *x, *y, *ra, *dec;
+  int *stat;
+  long i;
+
+  x=(double *)malloc(npts*sizeof(double));
+  y=(double *)malloc(npts*sizeof(double));
+  ra=(double *)malloc(npts*sizeof(double));
+  dec=(double *)malloc(npts*sizeof(double));
+  stat=(int *)malloc(npts*sizeof(int));
+  if ((x == NULL)||(y == NULL)||(ra == NULL)||(dec == NULL)||(stat == NULL)) {
+    fprintf(stderr,"malloc failed in write_points\n");
+    return(-1);
+  }
+  if (header_wcs(so, header, nkeyrec, tools, &img) < 0) {
+    fprintf(stderr,"header_wcs failed in write_points\n");
+    return(-1);
+  }
+  synth_points(so, npts, x, y);
+  wcsimg_pix2rd_batch(&img, npts, x, y, ra, dec, stat);
+  wcsimg_free(&img);
+  if (((xyfile != NULL)&&((xyout=fopen(xyfile, "w")) == NULL))||
+      ((rdfile != NULL)&&((rdout=fopen(rdfile, "w")) == NULL))) {
+    fprintf(stderr,"cannot open coordinate file in write_points\n");
+    return(-1);
+  }
+  if (xyout != NULL) fprintf(xyout,"# x y\n");
+  if (rdout != NULL) fprintf(rdout,"# ra dec\n");
+  for (i=0; i<npts; i++) {
+    if (stat[i]) continue;
+    if (xyout != NULL) fprintf(xyout,"%.6f %.6f\n",x[i],y[i]);
+    if (rdout != NULL) fprintf(rdout,"%.10f %.10f\n",ra[i],dec[i]);
+  }
+  if (xyout != NULL) fclose(xyout);
+  if (rdout != NULL) fclose(rdout);
+  free(x);
+  free(y);
+  free(ra);
+  free(dec);
+  free(stat);
+
+  return(0);
+}
+
+static void usage(char *argv[]) {
+  fprintf(stderr,"usage: %s [options] outfile\n",argv[0]);
+  fprintf(stderr,"  -w preset   start from a test case: pole, edge, corner, highsip, tpv,\n");
+  fprintf(stderr,"              hpx, xph, tsc or qsc, options are applied in order\n");
+  fprintf(stderr,"  -p proj     wcs projection code (default TAN)\n");
+  fprintf(stderr,"  -n nx[,ny]  image size in pixels (default 4096)\n");
+  fprintf(stderr,"  -c scale    pixel scale in arcsec (default 1)\n");
+  fprintf(stderr,"  -r rot      rotation in deg (default 0)\n");
+  fprintf(stderr,"  -a ra,dec   image center in deg (default 150,30)\n");
+  fprintf(stderr,"  -s order    SIP distortion order (default none)\n");
+  fprintf(stderr,"  -v order    TPV distortion order 1-3 (default none)\n");
+  fprintf(stderr,"  -e ncard    pad the header to ncard cards with extra keywords\n");
+  fprintf(stderr,"  -S seed     random number seed (default 1)\n");
+  fprintf(stderr,"  -i          write a fits image, otherwise a text header (- for stdout)\n");
+  fprintf(stderr,"  -N npts     number of random points for -x and -d (default 10000)\n");
+  fprintf(stderr,"  -x xyfile   write random pixel coordinates, x y\n");
+  fprintf(stderr,"  -d rdfile   write the matching sky coordinates, ra dec in deg\n");
+  fprintf(stderr,"  -T          convert -x and -d as wcsxy2rd/wcsrd2xy do, without the\n");
+  fprintf(stderr,"              PV?_* (TPV) cards, otherwise with the whole header\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  struct synth_opts so;
+  char *header, *xyfile=NULL, *rdfile=NULL;
+  long npts=10000;
+  int opt, nkeyrec, image=0, tools=0;
+
+  // report library errors on stderr as they happen
+  squidwcs_error_handler(squidwcs_error_stderr, NULL);
+
+  synth_opts_init(&so);
+  while ((opt=getopt(argc, argv, "w:p:n:c:r:a:s:v:e:S:iN:x:d:T")) != -1) {
+    switch (opt) {
+      case 'w':
+        if (synth_preset(&so, optarg) < 0) usage(argv);
+        break;
+      case 'p':
+        if (strlen(optarg) != 3) usage(argv);
+        strcpy(so.proj, optarg);
+        break;
+      case 'n':
+        if (sscanf(optarg, "%ld,%ld", &so.naxes[0], &so.naxes[1]) == 1) so.naxes[1]=so.naxes[0];
+        break;
+      case 'c': so.cdelt=atof(optarg)/3600.0; break;
+      case 'r': so.rot=atof(optarg); break;
+      case 'a':
+        if (sscanf(optarg, "%lf,%lf", &so.crval[0], &so.crval[1]) != 2) usage(argv);
+        break;
+      case 's': so.sip_order=atoi(optarg); break;
+      case 'v': so.tpv_order=atoi(optarg); break;
+      case 'e': so.ncard=atoi(optarg); break;
+      case 'S': so.seed=strtoull(optarg, NULL, 10); break;
+      case 'i': image=1; break;
+      case 'N': npts=atol(optarg); break;
+      case 'x': xyfile=optarg; break;
+      case 'd': rdfile=optarg; break;
+      case 'T': tools=1; break;
+      default: usage(argv);
+    }
+  }
+  if ((optind != argc-1)||(so.naxes[0] < 1)||(so.naxes[1] < 1)||!(so.cdelt > 0.0)||(npts < 1)) usage(argv);
+
+  if (synth_header(&so, &header, &nkeyrec) < 0) exit(-1);
+  if (image) {
+    if (write_image(argv[optind], &so, header, nkeyrec) < 0) exit(-1);
+  } else {
+    if (write_header(argv[optind], header, nkeyrec) < 0) exit(-1);
+  }
+  if ((xyfile != NULL)||(rdfile != NULL)) {
+    if (write_points(&so, header, nkeyrec, tools, npts, xyfile, rdfile) < 0) exit(-1);
+  }
+  free(header);
+
+  return(0);
+}
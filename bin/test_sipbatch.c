@@ -0,0 +1,198 @@
+//
+// Test the batch SIP kernels against the scalar sip_forward and
+// sip_reverse functions for every instruction set the cpu supports.
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+#define _GNU_SOURCE 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libsquid_wcs.h>
+
+#define NPTS 10007 // odd so the vector kernels have a tail
+#define TOL 1.0e-8 // max allowed difference in pixels
+#define NAXIS1 16384 // image size for the distortion table
+#define NAXIS2 12000 // not a multiple of the table step
+
+int main(int argc, char *argv[]) {
+  struct sip_param sparam;
+  struct sip_compiled scomp;
+  struct sip_grid grid;
+  long naxes[] = {NAXIS1, NAXIS2};
+  int gstep[] = {SIP_GRID_STEP, 7};
+  // rows x0,y: from the first pixel, the table edges, mid cell, between
+  // pixels and outside the table
+  double grow[][2] = {{1.0, 1.0}, {1.0, 1.5}, {1.0, 100.3}, {1.0, NAXIS2-0.25}, {1.0, NAXIS2},
+      {2.0, 1.0}, {1.0+3*SIP_GRID_STEP+5, 1234.7}, {NAXIS1-10, 500.0}, {1.5, 200.0}, {-5.0, 300.0},
+      {1.0, 0.0}, {1.0, NAXIS2+40}};
+  double *xr,*yr;
+  double errmax;
+  char *isaname[] = {"scalar", "sse2", "avx2", "avx512"};
+  double *x,*y,*xb,*yb;
+  int *stat;
+  double xs,ys,diff,maxdiff;
+  int order,isa,i,j,fail;
+  long n;
+
+  // report library errors on stderr as they happen
+  squidwcs_error_handler(squidwcs_error_stderr, NULL);
+
+  x=(double *)malloc(NPTS*sizeof(double));
+  y=(double *)malloc(NPTS*sizeof(double));
+  xb=(double *)malloc(NPTS*sizeof(double));
+  yb=(double *)malloc(NPTS*sizeof(double));
+  stat=(int *)malloc(NPTS*sizeof(int));
+  xr=(double *)malloc((NAXIS1+64)*sizeof(double));
+  yr=(double *)malloc((NAXIS1+64)*sizeof(double));
+  if ((x == NULL)||(y == NULL)||(xb == NULL)||(yb == NULL)||(stat == NULL)||(xr == NULL)||(yr == NULL)) {
+    fprintf(stderr,"malloc failed in %s\n",argv[0]);
+    exit(-1);
+  }
+  srand(1);
+  for (n=0; n<NPTS; n++) {
+    x[n]=16384.0*rand()/(double)RAND_MAX;
+    y[n]=16384.0*rand()/(double)RAND_MAX;
+  }
+
+  fail=0;
+  for (order=2; order<=6; order++) {
+    // random distortion of a few pixels at the frame edge
+    memset(&sparam, 0, sizeof(struct sip_param));
+    sparam.have_sip=1;
+    sparam.a_order=sparam.b_order=order;
+    sparam.ap_order=sparam.bp_order=order;
+    sparam.have_inv=1;
+    sparam.crpix1=8192.5;
+    sparam.crpix2=8192.5;
+    for (i=0; i<=order; i++) {
+      for (j=0; j<=order-i; j++) {
+        if (i+j < 2) continue;
+        sparam.a[i][j]=4.0*pow(8192.0,-i-j)*(rand()/(double)RAND_MAX-0.5);
+        sparam.b[i][j]=4.0*pow(8192.0,-i-j)*(rand()/(double)RAND_MAX-0.5);
+        sparam.ap[i][j]=-sparam.a[i][j];
+        sparam.bp[i][j]=-sparam.b[i][j];
+      }
+    }
+    if (sip_compile(&sparam, &scomp) < 0) {
+      fprintf(stderr,"sip_compile failed in %s\n",argv[0]);
+      exit(-1);
+    }
+    for (isa=SIP_ISA_SCALAR; isa<=SIP_ISA_AVX512; isa++) {
+      if (sip_batch_setisa(isa) < 0) continue;
+      // forward
+      sip_forward_batch(&scomp, NPTS, x, y, xb, yb);
+      maxdiff=0.0;
+      for (n=0; n<NPTS; n++) {
+        sip_forward(&sparam, x[n], y[n], &xs, &ys);
+        diff=fmax(fabs(xs-xb[n]),fabs(ys-yb[n]));
+        if (!(diff <= maxdiff)) maxdiff=diff;
+      }
+      printf("order=%d %-6s forward maxdiff=%.3e %s\n",order,isaname[isa],maxdiff,(maxdiff <= TOL) ? "ok" : "FAILED");
+      if (!(maxdiff <= TOL)) fail=1;
+      // reverse
+      sip_reverse_batch(&scomp, NPTS, x, y, xb, yb, NULL);
+      maxdiff=0.0;
+      for (n=0; n<NPTS; n++) {
+        sip_reverse(&sparam, x[n], y[n], &xs, &ys);
+        diff=fmax(fabs(xs-xb[n]),fabs(ys-yb[n]));
+        if (!(diff <= maxdiff)) maxdiff=diff;
+      }
+      printf("order=%d %-6s reverse maxdiff=%.3e %s\n",order,isaname[isa],maxdiff,(maxdiff <= TOL) ? "ok" : "FAILED");
+      if (!(maxdiff <= TOL)) fail=1;
+    }
+    // refined reverse, starting from AP,BP and from no inverse at all
+    for (i=1; i>=0; i--) {
+      sparam.have_inv=i;
+      if ((sip_compile(&sparam, &scomp) < 0)||(sip_setinverse(&scomp, 1, 1e-10, 0) < 0)) {
+        fprintf(stderr,"sip_compile failed in %s\n",argv[0]);
+        exit(-1);
+      }
+      j=sip_reverse_batch(&scomp, NPTS, x, y, xb, yb, NULL);
+      maxdiff=0.0;
+      for (n=0; n<NPTS; n++) {
+        sip_forward(&sparam, xb[n], yb[n], &xs, &ys);
+        diff=fmax(fabs(xs-x[n]),fabs(ys-y[n]));
+        if (!(diff <= maxdiff)) maxdiff=diff;
+      }
+      printf("order=%d %-6s refined  maxdiff=%.3e %s\n",order,i ? "ap,bp" : "no inv",maxdiff,((j == 0)&&(maxdiff <= TOL)) ? "ok" : "FAILED");
+      if ((j != 0)||!(maxdiff <= TOL)) fail=1;
+    }
+    // points that cannot converge are flagged one by one
+    if ((sip_compile(&sparam, &scomp) < 0)||(sip_setinverse(&scomp, 1, 1e-300, 1) < 0)) {
+      fprintf(stderr,"sip_compile failed in %s\n",argv[0]);
+      exit(-1);
+    }
+    for (n=0; n<NPTS; n++) stat[n]=0;
+    j=sip_reverse_batch(&scomp, NPTS, x, y, xb, yb, stat);
+    for (n=0; n<NPTS; n++) {
+      if ((stat[n] != SIP_STAT_NOCONV)||!isnan(xb[n])||!isnan(yb[n])) break;
+    }
+    printf("order=%d no convergence flagged %d/%d %s\n",order,j,NPTS,((j == NPTS)&&(n == NPTS)) ? "ok" : "FAILED");
+    if ((j != NPTS)||(n != NPTS)) fail=1;
+    // interpolated distortion table, whole rows against the point by point
+    // interpolation and the exact distortion.  Rows run past the end of
+    // the table so the exact tail is covered too.
+    for (i=0; i<(int)(sizeof(gstep)/sizeof(gstep[0])); i++) {
+      if (sip_grid_init(&grid, &scomp, naxes, gstep[i]) < 0) {
+        fprintf(stderr,"sip_grid_init failed in %s\n",argv[0]);
+        exit(-1);
+      }
+      maxdiff=0.0;
+      errmax=0.0;
+      for (j=0; j<(int)(sizeof(grow)/sizeof(grow[0])); j++) {
+        sip_grid_forward_row(&grid, grow[j][0], grow[j][1], NAXIS1+64, xr, yr);
+        for (n=0; n<NAXIS1+64; n++) {
+          sip_grid_forward(&grid, grow[j][0]+n, grow[j][1], &xs, &ys);
+          diff=fmax(fabs(xs-xr[n]),fabs(ys-yr[n]));
+          if (!(diff <= maxdiff)) maxdiff=diff;
+          sip_forward_compiled(&scomp, grow[j][0]+n, grow[j][1], &xs, &ys);
+          diff=fmax(fabs(xs-xr[n]),fabs(ys-yr[n]));
+          if (!(diff <= errmax)) errmax=diff;
+        }
+      }
+      // maxerr is sampled where the error peaks, allow some margin
+      printf("order=%d grid step=%-2d row maxdiff=%.3e err=%.3e maxerr=%.3e %s\n",order,gstep[i],maxdiff,errmax,grid.maxerr,
+          ((maxdiff <= TOL)&&(errmax <= 1.5*grid.maxerr+TOL)) ? "ok" : "FAILED");
+      if (!(maxdiff <= TOL)||!(errmax <= 1.5*grid.maxerr+TOL)) fail=1;
+      sip_grid_free(&grid);
+    }
+  }
+
+  free(x);
+  free(y);
+  free(xb);
+  free(yb);
+  free(stat);
+  free(xr);
+  free(yr);
+  if (fail) exit(-1);
+
+  return(0);
+}
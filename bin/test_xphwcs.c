@@ -45,6 +45,9 @@ int main(int argc, char *argv[]) {
   double rarr[4],darr[4];
   double xarr[5],yarr[5];
   
+  // report library errors on stderr as they happen
+  squidwcs_error_handler(squidwcs_error_stderr, NULL);
+
   tside=450;
   //squid=209;
   //squid=210;
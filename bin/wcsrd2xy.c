@@ -36,78 +36,73 @@
 #include <libsquid_wcs.h>
 
 int main(int argc, char *argv[]) {
-  struct wcsprm *wcs; // wcs coordinate struct
-  char *header;
-  fitsfile *fptr;
-  int status=0, bitpix, naxis,i;
-  long naxes[2];
-  int nkeyrec, nreject, nwcs;
+  struct wcs_image img; // image wcs context
   double ra,dec,x,y;
-  struct sip_param sparam; // sip param struct
-  double xsip, ysip; // sip output
+  double tol=-1.0; // reverse SIP refinement tolerance, < 0 for none
+  FILE *in; // coordinate stream
+  int binary=0, nthread=1, opt;
+  long blocksize=0;
 
-  if (argc != 4) {
+  // report library errors on stderr as they happen
+  squidwcs_error_handler(squidwcs_error_stderr, NULL);
+
+  while ((opt=getopt(argc, argv, "+bt:n:r:")) != -1) {
+    if (opt == 'b') binary=1;
+    else if (opt == 'r') tol=atof(optarg);
+    else if (opt == 't') nthread=atoi(optarg);
+    else if (opt == 'n') blocksize=atol(optarg);
+    else argc=0;
+  }
+  if ((argc-optind != 3)&&(argc-optind != 2)) {
     printf("Example usage...\n");
-    printf("%s infile ra dec\n",argv[0]);
+    printf("%s [-r tol] infile ra dec\n",argv[0]);
+    printf("%s [-b] [-t nthread] [-n blocksize] [-r tol] infile coordfile\n",argv[0]);
     printf("infile is fits file with valid wcs\n");
     printf("ra,dec in decimal degrees\n");
+    printf("coordfile has one ra dec pair per line, - for stdin\n");
+    printf("-b reads and writes binary doubles instead of text\n");
+    printf("-t sets the number of threads, 0 for all cores\n");
+    printf("-n sets the number of points converted per block\n");
+    printf("-r refines the reverse SIP transform to tol pixels, 0 for the default\n");
     exit(-1);
   }
-  ra=atof(argv[2]);
-  dec=atof(argv[3]);
 
-  // Load original image and header
-  if (fits_open_file(&fptr, argv[1], READONLY, &status)) {
-    fits_report_error(stderr, status);
-    exit(-1);
-  }
-  if (fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status)) {
-    fits_report_error(stderr, status);
-    exit(-1);
-  }
-  // read SIP parameters if any
-  if (sip_read(fptr, &sparam) < 0) {
-    // read of sip failed, ignore sip correction
-    sparam.have_sip=0;
-  }
-  // Remove SCAMP PV* headers because they screw up wcslib
-  for (i=0; i<1000; i++) {
-    if (fits_delete_key(fptr,"PV?_*", &status)) {
-      fits_clear_errmsg();
-      status=0;
-      break;
-    }
-  }
-  // Now convert header into string for wcs parsing  
-  if (fits_hdr2str(fptr, 1, NULL, 0, &header, &nkeyrec, &status)) {
-    fits_report_error(stderr, status);
+  // Load wcs and sip parameters of original image
+  if (wcsimg_openfile(argv[optind], &img) < 0) {
+    fprintf(stderr,"wcsimg_openfile failed in %s\n",argv[0]);
     exit(-1);
   }
-  // Interpret the WCS keywords, deleting them afterwards
-  if ((status = wcspih(header, nkeyrec, WCSHDR_all, -3, &nreject, &nwcs, &wcs))) {
-    fprintf(stderr, "wcspih ERROR %d: %s.\n", status, wcshdr_errmsg[status]);
-    printf("%d rejected keywords\n",nreject);
+  // Newton refinement of the AP,BP inverse, always on without AP,BP
+  if ((tol >= 0.0)&&(sip_setinverse(&img.scomp, 1, tol, 0) < 0)) {
+    fprintf(stderr,"sip_setinverse failed in %s\n",argv[0]);
     exit(-1);
   }
 
-  // Now covert ra,dec to x,y
-  if (wcs_rd2pix(wcs,ra,dec,&x,&y) < 0) {
-    fprintf(stderr,"wcs_rd2pix failed in %s\n",argv[0]);
-    exit(-1);
-  }
-
-  // Now apply sip correction
-  if (sparam.have_sip) {
-    if (sip_reverse(&sparam, x, y, &xsip, &ysip) < 0) {
-       fprintf(stderr,"sip_reverse failed in %s\n",argv[0]);
-       exit(-1);
+  if (argc-optind == 3) {
+    ra=atof(argv[optind+1]);
+    dec=atof(argv[optind+2]);
+    // Now covert ra,dec to x,y, sip correction included
+    if (wcsimg_rd2pix(&img,ra,dec,&x,&y) < 0) {
+      fprintf(stderr,"wcsimg_rd2pix failed in %s\n",argv[0]);
+      exit(-1);
+    }
+    printf("x=%.3f y=%.3f\n",x,y);
+  } else {
+    // stream coordinates from coordfile to stdout
+    if (strcmp(argv[optind+1],"-") == 0) {
+      in=stdin;
+    } else if ((in=fopen(argv[optind+1], binary ? "rb" : "r")) == NULL) {
+      fprintf(stderr,"cannot open %s in %s\n",argv[optind+1],argv[0]);
+      exit(-1);
+    }
+    if (wcsimg_stream(&img, 1, in, stdout, binary, blocksize, nthread) < 0) {
+      fprintf(stderr,"wcsimg_stream failed in %s\n",argv[0]);
+      exit(-1);
     }
+    if (in != stdin) fclose(in);
   }
-  printf("x=%.3f y=%.3f\n",xsip,ysip);
 
-  free(header);
-  free(wcs);
-  fits_close_file(fptr,&status);
+  wcsimg_free(&img);
 
   return(0);
 }
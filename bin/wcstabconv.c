@@ -0,0 +1,189 @@
+//
+// Given a fits file with valid wcs and a fits binary table with x,y
+// columns, add ra,dec columns to the table (or the reverse)
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+#define _GNU_SOURCE 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libsquid_wcs.h>
+
+// Find column colname in the table, adding it as a double column with
+// unit tunit if it is not there.  Returns column number, or -1 on failure.
+static int get_outcol(fitsfile *fptr, char *colname, char *tunit) {
+  char keyname[FLEN_KEYWORD];
+  int colnum, ncols, status=0;
+
+  if (fits_get_colnum(fptr, CASEINSEN, colname, &colnum, &status) == 0) return(colnum);
+  status=0;
+  fits_clear_errmsg();
+  if (fits_get_num_cols(fptr, &ncols, &status)) {
+    fits_report_error(stderr, status);
+    return(-1);
+  }
+  colnum=ncols+1;
+  sprintf(keyname,"TUNIT%d",colnum);
+  if (fits_insert_col(fptr, colnum, colname, "1D", &status) ||
+      fits_write_key(fptr, TSTRING, keyname, tunit, "physical unit of field", &status)) {
+    fits_report_error(stderr, status);
+    return(-1);
+  }
+
+  return(colnum);
+}
+
+int main(int argc, char *argv[]) {
+  struct wcs_image img; // image wcs context
+  fitsfile *fptr; // table file
+  char *incol[2]={"X","Y"}, *outcol[2]={"RA","DEC"};
+  char *outunit="deg"; // unit of added columns
+  char *tmp;
+  int icol[2], ocol[2]; // input and output column numbers
+  int reverse=0, opt, hdutype, anynul, i;
+  int status=0;
+  long nrows, nbuf, first, n;
+  double nulval=NAN; // null input values become NAN
+  double *a, *b, *c, *d; // input and output column chunks
+
+  // report library errors on stderr as they happen
+  squidwcs_error_handler(squidwcs_error_stderr, NULL);
+
+  while ((opt=getopt(argc, argv, "Rx:y:r:d:")) != -1) {
+    if (opt == 'R') reverse=1;
+    else if (opt == 'x') incol[0]=optarg;
+    else if (opt == 'y') incol[1]=optarg;
+    else if (opt == 'r') outcol[0]=optarg;
+    else if (opt == 'd') outcol[1]=optarg;
+    else argc=0;
+  }
+  if (argc-optind != 2) {
+    printf("Example usage...\n");
+    printf("%s [-R] [-x xcol] [-y ycol] [-r racol] [-d deccol] imgfile tabfile\n",argv[0]);
+    printf("imgfile is fits file with valid wcs header\n");
+    printf("tabfile is fits file with a binary table, e.g. cat.fits[1]\n");
+    printf("converts x,y columns (X,Y) to ra,dec columns (RA,DEC) in deg,\n");
+    printf("adding the ra,dec columns if needed\n");
+    printf("-R converts ra,dec columns to x,y columns instead\n");
+    exit(-1);
+  }
+  if (reverse) {
+    for (i=0; i<2; i++) {
+      tmp=incol[i];
+      incol[i]=outcol[i];
+      outcol[i]=tmp;
+    }
+    outunit="pix";
+  }
+
+  // Load wcs and sip parameters of original image
+  if (wcsimg_openfile(argv[optind], &img) < 0) {
+    fprintf(stderr,"wcsimg_openfile failed in %s\n",argv[0]);
+    exit(-1);
+  }
+
+  // Open table, moving to the first extension if no table was named
+  if (fits_open_file(&fptr, argv[optind+1], READWRITE, &status)) {
+    fits_report_error(stderr, status);
+    exit(-1);
+  }
+  if (fits_get_hdu_type(fptr, &hdutype, &status)) {
+    fits_report_error(stderr, status);
+    exit(-1);
+  }
+  if ((hdutype != BINARY_TBL)&&fits_movabs_hdu(fptr, 2, &hdutype, &status)) {
+    fits_report_error(stderr, status);
+    exit(-1);
+  }
+  if (hdutype != BINARY_TBL) {
+    fprintf(stderr,"%s has no binary table in %s\n",argv[optind+1],argv[0]);
+    exit(-1);
+  }
+  for (i=0; i<2; i++) {
+    if (fits_get_colnum(fptr, CASEINSEN, incol[i], &icol[i], &status)) {
+      fprintf(stderr,"no %s column in %s\n",incol[i],argv[0]);
+      exit(-1);
+    }
+    if ((ocol[i]=get_outcol(fptr, outcol[i], outunit)) < 0) {
+      fprintf(stderr,"cannot add %s column in %s\n",outcol[i],argv[0]);
+      exit(-1);
+    }
+  }
+
+  // rows per chunk is the cfitsio optimal number of rows to buffer
+  if (fits_get_num_rows(fptr, &nrows, &status) ||
+      fits_get_rowsize(fptr, &nbuf, &status)) {
+    fits_report_error(stderr, status);
+    exit(-1);
+  }
+  if (nbuf < 1) nbuf=1;
+  if ((a=(double *)malloc(4*nbuf*sizeof(double))) == NULL) {
+    fprintf(stderr,"malloc failed in %s\n",argv[0]);
+    exit(-1);
+  }
+  b=a+nbuf;
+  c=b+nbuf;
+  d=c+nbuf;
+
+  // convert the table a chunk at a time
+  for (first=1; first<=nrows; first+=n) {
+    n=((nrows-first+1) < nbuf) ? nrows-first+1 : nbuf;
+    if (fits_read_col(fptr, TDOUBLE, icol[0], first, 1, n, &nulval, a, &anynul, &status) ||
+        fits_read_col(fptr, TDOUBLE, icol[1], first, 1, n, &nulval, b, &anynul, &status)) {
+      fits_report_error(stderr, status);
+      exit(-1);
+    }
+    if (reverse) {
+      if (wcsimg_rd2pix_batch(&img, n, a, b, c, d, NULL) < 0) {
+        fprintf(stderr,"wcsimg_rd2pix_batch failed in %s\n",argv[0]);
+        exit(-1);
+      }
+    } else {
+      if (wcsimg_pix2rd_batch(&img, n, a, b, c, d, NULL) < 0) {
+        fprintf(stderr,"wcsimg_pix2rd_batch failed in %s\n",argv[0]);
+        exit(-1);
+      }
+    }
+    if (fits_write_col(fptr, TDOUBLE, ocol[0], first, 1, n, c, &status) ||
+        fits_write_col(fptr, TDOUBLE, ocol[1], first, 1, n, d, &status)) {
+      fits_report_error(stderr, status);
+      exit(-1);
+    }
+  }
+
+  free(a);
+  wcsimg_free(&img);
+  if (fits_close_file(fptr, &status)) {
+    fits_report_error(stderr, status);
+    exit(-1);
+  }
+
+  return(0);
+}
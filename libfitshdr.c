@@ -0,0 +1,384 @@
+//
+// In-memory fits header builder and card filter used to write tile headers
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+#include <libsquid_wcs.h>
+
+// Get keyword of an 80 char card.  Returns keyword length, or 0 for
+// commentary cards (COMMENT, HISTORY, blank or no value indicator),
+// which have no keyword to match.
+int card_keyword(const char *card, char *keyname) {
+   const char *eq; // value indicator
+   int len;
+
+   if (strncmp(card, "HIERARCH ", 9) == 0) {
+      eq=memchr(card, '=', 80);
+      if (eq == NULL) return(0);
+      len=(int)(eq-card);
+   } else {
+      if ((card[8] != '=')||(card[9] != ' ')) return(0);
+      len=8;
+   }
+   while ((len > 0)&&(card[len-1] == ' ')) len--;
+   if (len > FLEN_KEYWORD-1) len=FLEN_KEYWORD-1;
+   memcpy(keyname, card, len);
+   keyname[len]='\0';
+
+   return(len);
+}
+
+// Hash of a keyword (FNV-1a)
+static unsigned long hdrbuild_hash(const char *keyname) {
+   unsigned long h;
+
+   h=2166136261UL;
+   while (*keyname != '\0') {
+      h=(h^(unsigned char)(*keyname))*16777619UL;
+      keyname++;
+   }
+
+   return(h);
+}
+
+// Find card index of keyword, or -1.  *slot is set to its hash slot.
+static long hdrbuild_find(struct hdr_build *hb, const char *keyname, long *slot) {
+   char key[FLEN_KEYWORD]; // keyword of a stored card
+   long h;
+
+   h=(long)(hdrbuild_hash(keyname) & (unsigned long)(hb->hsize-1));
+   while (hb->hash[h] != 0) {
+      card_keyword(hb->card[hb->hash[h]-1], key);
+      if (strcmp(key, keyname) == 0) {
+         *slot=h;
+         return(hb->hash[h]-1);
+      }
+      h=(h+1) & (hb->hsize-1);
+   }
+   *slot=h;
+
+   return(-1);
+}
+
+// Initialize an empty header builder
+// Function returns 0 on success and -1 on failure
+int hdrbuild_init(struct hdr_build *hb) {
+
+   hb->n=0;
+   hb->nalloc=128;
+   hb->hsize=256;
+   hb->nown=0;
+   hb->card=(const char **)malloc(hb->nalloc*sizeof(const char *));
+   hb->hash=(long *)calloc(hb->hsize,sizeof(long));
+   if ((hb->card == NULL)||(hb->hash == NULL)) {
+      hdrbuild_free(hb);
+      return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "hdrbuild_init", "malloc failed"));
+   }
+
+   return(0);
+}
+
+// Free memory held by a header builder
+void hdrbuild_free(struct hdr_build *hb) {
+
+   free(hb->card);
+   free(hb->hash);
+   hb->card=NULL;
+   hb->hash=NULL;
+   hb->n=0;
+   hb->nalloc=0;
+   hb->hsize=0;
+   hb->nown=0;
+}
+
+// Add an 80 char card.  Like fits_update_card, a card replaces an earlier
+// card with the same keyword in place, otherwise it is appended.
+// Commentary cards are always appended.  Only a pointer to the card is
+// kept, so it must stay valid (and unchanged) until hdrbuild_write; it
+// does not need to be NUL terminated.
+// Function returns 0 on success and -1 on failure
+int hdrbuild_update(struct hdr_build *hb, const char *card) {
+   char keyname[FLEN_KEYWORD];
+   const char **cards; // grown card list
+   long *hash; // grown hash table
+   long i,h,hsize;
+   long slot=0; // hash slot for a new keyword
+   int haskey;
+
+   haskey=card_keyword(card, keyname);
+   if (haskey) {
+      if ((i=hdrbuild_find(hb, keyname, &slot)) >= 0) {
+         hb->card[i]=card;
+         return(0);
+      }
+   }
+
+   // append card
+   if (hb->n >= hb->nalloc) {
+      cards=(const char **)realloc(hb->card,2*hb->nalloc*sizeof(const char *));
+      if (cards == NULL) return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "hdrbuild_update", "realloc failed"));
+      hb->card=cards;
+      hb->nalloc=2*hb->nalloc;
+   }
+   hb->card[hb->n]=card;
+   hb->n++;
+   if (!haskey) return(0);
+   hb->hash[slot]=hb->n;
+
+   // keep hash table at most half full
+   if (2*hb->n > hb->hsize) {
+      hsize=2*hb->hsize;
+      hash=(long *)calloc(hsize,sizeof(long));
+      if (hash == NULL) return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "hdrbuild_update", "calloc failed"));
+      for (i=0; i<hb->n; i++) {
+         if (!card_keyword(hb->card[i], keyname)) continue;
+         h=(long)(hdrbuild_hash(keyname) & (unsigned long)(hsize-1));
+         while (hash[h] != 0) h=(h+1) & (hsize-1);
+         hash[h]=i+1;
+      }
+      free(hb->hash);
+      hb->hash=hash;
+      hb->hsize=hsize;
+   }
+
+   return(0);
+}
+
+// Format a keyword card the same way fits_update_key does and add it.
+// datatype is one of TSTRING, TINT, TLONG or TDOUBLE.  The card is kept
+// in hb itself, up to HDRBUILD_MAXKEY of them.
+// Function returns 0 on success and -1 on failure
+int hdrbuild_key(struct hdr_build *hb, int datatype, const char *keyname, void *value, const char *comment) {
+   char valstr[FLEN_VALUE]; // formatted value
+   char *card; // formatted card
+   int status=0; // return value for cfitsio calls
+
+   if (hb->nown >= HDRBUILD_MAXKEY) return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "hdrbuild_key", "too many keys"));
+   card=hb->own[hb->nown];
+
+   if (datatype == TSTRING) {
+      ffs2c((char *)value, valstr, &status);
+   } else if (datatype == TINT) {
+      ffi2c((LONGLONG)(*(int *)value), valstr, &status);
+   } else if (datatype == TLONG) {
+      ffi2c((LONGLONG)(*(long *)value), valstr, &status);
+   } else if (datatype == TDOUBLE) {
+      ffd2e(*(double *)value, -15, valstr, &status);
+   } else {
+      return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "hdrbuild_key", "unsupported datatype"));
+   }
+   if (fits_make_key(keyname, valstr, comment, card, &status)) {
+      return(squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "hdrbuild_key", "fits_make_key failed"));
+   }
+   // pad to 80 chars
+   memset(card+strlen(card), ' ', 80-strlen(card));
+   card[80]='\0';
+   hb->nown++;
+
+   return(hdrbuild_update(hb, card));
+}
+
+// Write all cards to ofptr in one pass.  Header space for all cards is
+// reserved first.  cfitsio has no call writing many cards at once, so the
+// cards are still written one at a time, but new keywords are appended
+// with fits_write_record, which does not search the header, keeping the
+// write linear in the number of cards.  Only keywords already present in
+// ofptr, found with a single scan of its header, go through the searching
+// fits_update_card.
+// Function returns 0 on success and -1 on failure
+int hdrbuild_write(struct hdr_build *hb, fitsfile *ofptr) {
+   char keyname[FLEN_KEYWORD];
+   char card[FLEN_CARD];
+   char *exist; // 1 for cards whose keyword is already in ofptr
+   int status=0; // return value for cfitsio calls
+   int nexist,nmore,i;
+   long j,slot;
+
+   exist=(char *)calloc(hb->n+1,1);
+   if (exist == NULL) return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "hdrbuild_write", "calloc failed"));
+
+   // scan existing header once
+   if (fits_get_hdrspace(ofptr, &nexist, &nmore, &status)) {
+      free(exist);
+      return(squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "hdrbuild_write", "fits_get_hdrspace failed"));
+   }
+   for (i=1; i<=nexist; i++) {
+      if (fits_read_record(ofptr, i, card, &status)) {
+         free(exist);
+         return(squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "hdrbuild_write", "fits_read_record failed"));
+      }
+      if (strlen(card) < 80) memset(card+strlen(card), ' ', 80-strlen(card));
+      card[80]='\0';
+      if (!card_keyword(card, keyname)) continue;
+      if ((j=hdrbuild_find(hb, keyname, &slot)) >= 0) exist[j]=1;
+   }
+
+   // reserve room, a no-op once the data unit has been written
+   if (hb->n > nmore) {
+      if (fits_set_hdrsize(ofptr, (int)(hb->n-nmore), &status)) {
+         fits_clear_errmsg();
+         status=0;
+      }
+   }
+
+   for (j=0; j<hb->n; j++) {
+      if (exist[j]) {
+         memcpy(card, hb->card[j], 80);
+         card[80]='\0';
+         card_keyword(card, keyname);
+         fits_update_card(ofptr, keyname, card, &status);
+      } else {
+         fits_write_record(ofptr, hb->card[j], &status);
+      }
+      if (status) {
+         free(exist);
+         return(squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "hdrbuild_write", "writing card failed"));
+      }
+   }
+   free(exist);
+
+   return(0);
+}
+
+// Name used to match a card against a filter: its keyword, or the first
+// 8 chars (trimmed) for commentary cards such as HISTORY
+static int card_filtername(const char *card, char *keyname) {
+   int len;
+
+   if ((len=card_keyword(card, keyname)) > 0) return(len);
+   len=8;
+   while ((len > 0)&&(card[len-1] == ' ')) len--;
+   memcpy(keyname, card, len);
+   keyname[len]='\0';
+
+   return(len);
+}
+
+// Default tile_addwcs card filter: the CARD_EXCLUDE keywords (matched as
+// prefixes, so NAXISn is covered by NAXIS) and the SIP A_, B_, AP_, BP_
+// keywords.  COMMENT cards are never excluded.
+static int card_default_match(const char *card) {
+   static const char *hcardx[] = CARD_EXCLUDE;
+   static const char *hsip[] = {"A_", "B_", "AP_", "BP_", NULL};
+   int j;
+
+   if (strncmp("COMMENT",card,7) == 0) return(0);
+   for (j=0; hcardx[j] != NULL; j++) {
+      if (strncmp(hcardx[j],card,strlen(hcardx[j])) == 0) return(1);
+   }
+   for (j=0; hsip[j] != NULL; j++) {
+      if (strncmp(hsip[j],card,strlen(hsip[j])) == 0) return(1);
+   }
+
+   return(0);
+}
+
+// qsort/bsearch comparison for filter keywords
+static int card_filter_cmp(const void *a, const void *b) {
+
+   return(strcmp((const char *)a, (const char *)b));
+}
+
+// Initialize a card filter with the default tile_addwcs exclusions.
+// Extend it with card_filter_addkey and card_filter_addprefix.
+// Function returns 0 on success and -1 on failure
+int card_filter_init(struct card_filter *filter) {
+   const char *hcardx[] = CARD_EXCLUDE;
+   int j;
+
+   memset(filter, 0, sizeof(struct card_filter));
+   for (j=0; hcardx[j] != NULL; j++) {
+      // NAXIS covers NAXISn as in the default filter
+      if (strcmp(hcardx[j], "NAXIS") == 0) {
+         if (card_filter_addprefix(filter, hcardx[j]) < 0) return(-1);
+      } else {
+         if (card_filter_addkey(filter, hcardx[j]) < 0) return(-1);
+      }
+   }
+   if ((card_filter_addprefix(filter, "A_") < 0)||(card_filter_addprefix(filter, "B_") < 0)||
+       (card_filter_addprefix(filter, "AP_") < 0)||(card_filter_addprefix(filter, "BP_") < 0)) return(-1);
+
+   return(0);
+}
+
+// Free memory held by a card filter
+void card_filter_free(struct card_filter *filter) {
+
+   free(filter->key);
+   free(filter->prefix);
+   memset(filter, 0, sizeof(struct card_filter));
+}
+
+// Exclude cards with exactly this keyword.  The keyword table is kept
+// sorted so matching is a binary search.
+// Function returns 0 on success and -1 on failure
+int card_filter_addkey(struct card_filter *filter, const char *keyname) {
+   char (*key)[FLEN_KEYWORD]; // grown keyword table
+
+   if (strlen(keyname) >= FLEN_KEYWORD) return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "card_filter_addkey", "keyword too long"));
+   if (filter->nkey >= filter->nkeyalloc) {
+      key=realloc(filter->key, (2*filter->nkeyalloc+8)*sizeof(*filter->key));
+      if (key == NULL) return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "card_filter_addkey", "realloc failed"));
+      filter->key=key;
+      filter->nkeyalloc=2*filter->nkeyalloc+8;
+   }
+   strcpy(filter->key[filter->nkey], keyname);
+   filter->nkey++;
+   qsort(filter->key, filter->nkey, sizeof(*filter->key), card_filter_cmp);
+
+   return(0);
+}
+
+// Exclude cards whose keyword starts with prefix
+// Function returns 0 on success and -1 on failure
+int card_filter_addprefix(struct card_filter *filter, const char *prefix) {
+   char (*pre)[FLEN_KEYWORD]; // grown prefix table
+
+   if (strlen(prefix) >= FLEN_KEYWORD) return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "card_filter_addprefix", "prefix too long"));
+   if (filter->nprefix >= filter->nprefixalloc) {
+      pre=realloc(filter->prefix, (2*filter->nprefixalloc+8)*sizeof(*filter->prefix));
+      if (pre == NULL) return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "card_filter_addprefix", "realloc failed"));
+      filter->prefix=pre;
+      filter->nprefixalloc=2*filter->nprefixalloc+8;
+   }
+   strcpy(filter->prefix[filter->nprefix], prefix);
+   filter->nprefix++;
+
+   return(0);
+}
+
+// Test an 80 char card (need not be NUL terminated) against a filter.
+// A NULL filter uses the default tile_addwcs exclusions.
+// Returns 1 if the card is excluded, 0 if not.
+int card_filter_match(const struct card_filter *filter, const char *card) {
+   char keyname[FLEN_KEYWORD];
+   int j;
+
+   if (filter == NULL) return(card_default_match(card));
+   card_filtername(card, keyname);
+   if ((filter->nkey > 0) &&
+       (bsearch(keyname, filter->key, filter->nkey, sizeof(*filter->key), card_filter_cmp) != NULL)) return(1);
+   for (j=0; j<filter->nprefix; j++) {
+      if (strncmp(filter->prefix[j], keyname, strlen(filter->prefix[j])) == 0) return(1);
+   }
+
+   return(0);
+}
@@ -0,0 +1,410 @@
+//
+// Reprojection of an image into squid tiles
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Number of samples per tile side used to find the source bounding box
+#define REPROJ_BBOXSAMP 16
+
+// Max number of points per call of the tile to source transform
+#define REPROJ_BLOCK 256
+
+// Lanczos kernel half width
+#define REPROJ_LANCZOS_A 3
+
+// Context of the tile to source pixel transform
+struct reproj_map {
+   struct wcsprm *twcs; // tile wcs
+   const struct wcs_image *img; // source image wcs
+};
+
+// Tile pixel x,y to source pixel x,y, NAN for points off the sky or image
+// wcs.  Has the surrogate_fn signature.
+static int reproj_mapfn(void *ctx, long n, const double *x, const double *y, double *out) {
+   struct reproj_map *map=(struct reproj_map *)ctx;
+   double ra[REPROJ_BLOCK], dec[REPROJ_BLOCK], sx[REPROJ_BLOCK], sy[REPROJ_BLOCK];
+   long i, i0, nblk;
+
+   for (i0=0; i0<n; i0+=nblk) {
+      nblk=((n-i0) < REPROJ_BLOCK) ? n-i0 : REPROJ_BLOCK;
+      if (wcs_pix2rd_batch(map->twcs, nblk, x+i0, y+i0, 1, ra, dec, 1, NULL) < 0) return(-1);
+      if (wcsimg_rd2pix_batch(map->img, nblk, ra, dec, sx, sy, NULL) < 0) return(-1);
+      for (i=0; i<nblk; i++) {
+         out[2*(i0+i)]=sx[i];
+         out[2*(i0+i)+1]=sy[i];
+      }
+   }
+
+   return(0);
+}
+
+// Kernel half width in source pixels
+static int reproj_radius(int kernel) {
+
+   if (kernel == REPROJ_LANCZOS) return(REPROJ_LANCZOS_A);
+
+   return(1);
+}
+
+// Set opts to the defaults: bilinear, exact transform, all threads
+void reproj_opts_init(struct reproj_opts *opts) {
+
+   opts->kernel=REPROJ_BILINEAR;
+   opts->tol=0.0;
+   opts->nthread=0;
+}
+
+// Set up tile for squid, with the tile wcs.  Free with reproj_tile_free.
+// Function returns 0 on success and -1 on failure
+int reproj_tile_init(struct reproj_tile *tile, int projection, squid_type squid, squid_type tside) {
+
+   memset(tile, 0, sizeof(struct reproj_tile));
+   tile->projection=projection;
+   tile->squid=squid;
+   tile->tside=tside;
+   if (tile_getwcs(projection, squid, tside, &tile->wcs) < 0) {
+      fprintf(stderr, "tile_getwcs failed in reproj_tile_init\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
+// Free memory held by tile
+void reproj_tile_free(struct reproj_tile *tile) {
+
+   if (tile->wcs != NULL) wcs_free(tile->wcs);
+   free(tile->src);
+   free(tile->pix);
+   tile->wcs=NULL;
+   tile->src=NULL;
+   tile->pix=NULL;
+}
+
+//
+// Stage 1: find the box of source pixels the tile needs.  The tile is
+// sampled on a grid, edges included, and the hull of the samples that
+// land on the source wcs is padded by the kernel width and clipped to the
+// image.  img is only used by this thread, see wcsimg_clone.  tile->bbox
+// is x0,x1,y0,y1 (1 based, inclusive), with x0 > x1 if the tile misses
+// the image.
+// Function returns 0 on success and -1 on failure
+//
+int reproj_tile_bbox(struct reproj_tile *tile, const struct wcs_image *img, int kernel) {
+   struct reproj_map map;
+   double x[(REPROJ_BBOXSAMP+1)*(REPROJ_BBOXSAMP+1)], y[(REPROJ_BBOXSAMP+1)*(REPROJ_BBOXSAMP+1)];
+   double out[2*(REPROJ_BBOXSAMP+1)*(REPROJ_BBOXSAMP+1)];
+   double xmin, xmax, ymin, ymax;
+   long i, j, n, pad;
+
+   n=0;
+   for (j=0; j<=REPROJ_BBOXSAMP; j++) {
+      for (i=0; i<=REPROJ_BBOXSAMP; i++) {
+         x[n]=0.5+tile->tside*i/(double)REPROJ_BBOXSAMP;
+         y[n]=0.5+tile->tside*j/(double)REPROJ_BBOXSAMP;
+         n++;
+      }
+   }
+   map.twcs=tile->wcs;
+   map.img=img;
+   if (reproj_mapfn(&map, n, x, y, out) < 0) {
+      fprintf(stderr, "reproj_mapfn failed in reproj_tile_bbox\n");
+      return(-1);
+   }
+   xmin=ymin=HUGE_VAL;
+   xmax=ymax=-HUGE_VAL;
+   for (i=0; i<n; i++) {
+      if (!(isfinite(out[2*i])&&isfinite(out[2*i+1]))) continue;
+      if (out[2*i] < xmin) xmin=out[2*i];
+      if (out[2*i] > xmax) xmax=out[2*i];
+      if (out[2*i+1] < ymin) ymin=out[2*i+1];
+      if (out[2*i+1] > ymax) ymax=out[2*i+1];
+   }
+   tile->bbox[0]=1;
+   tile->bbox[1]=0;
+   tile->bbox[2]=1;
+   tile->bbox[3]=0;
+   if (xmin > xmax) return(0);
+
+   pad=reproj_radius(kernel)+1;
+   xmin=floor(xmin)-pad;
+   xmax=ceil(xmax)+pad;
+   ymin=floor(ymin)-pad;
+   ymax=ceil(ymax)+pad;
+   if ((xmax < 1)||(ymax < 1)||(xmin > img->naxes[0])||(ymin > img->naxes[1])) return(0);
+   tile->bbox[0]=(xmin < 1) ? 1 : (long)xmin;
+   tile->bbox[1]=(xmax > img->naxes[0]) ? img->naxes[0] : (long)xmax;
+   tile->bbox[2]=(ymin < 1) ? 1 : (long)ymin;
+   tile->bbox[3]=(ymax > img->naxes[1]) ? img->naxes[1] : (long)ymax;
+
+   return(0);
+}
+
+//
+// Stage 2: read the source pixels in tile->bbox from fptr as floats, as
+// one strip of whole bbox rows, with blank pixels as NAN.  cfitsio file
+// handles are not thread safe, so callers running tiles in parallel must
+// serialize the calls for one fptr.
+// Function returns 0 on success and -1 on failure
+//
+int reproj_tile_read(struct reproj_tile *tile, fitsfile *fptr) {
+   long fpixel[2], lpixel[2], inc[2]={1,1};
+   float nulval=NAN;
+   int anynul, status=0;
+
+   free(tile->src);
+   tile->src=NULL;
+   if (tile->bbox[0] > tile->bbox[1]) return(0);
+   tile->nx=tile->bbox[1]-tile->bbox[0]+1;
+   tile->ny=tile->bbox[3]-tile->bbox[2]+1;
+   tile->src=(float *)malloc(tile->nx*tile->ny*sizeof(float));
+   if (tile->src == NULL) {
+      fprintf(stderr, "malloc failed in reproj_tile_read\n");
+      return(-1);
+   }
+   fpixel[0]=tile->bbox[0];
+   fpixel[1]=tile->bbox[2];
+   lpixel[0]=tile->bbox[1];
+   lpixel[1]=tile->bbox[3];
+   if (fits_read_subset(fptr, TFLOAT, fpixel, lpixel, inc, &nulval, tile->src, &anynul, &status)) {
+      fits_report_error(stderr, status);
+      free(tile->src);
+      tile->src=NULL;
+      return(-1);
+   }
+
+   return(0);
+}
+
+// Lanczos weight at distance d
+static inline double reproj_lanczos(double d) {
+   double pd;
+
+   if (d == 0.0) return(1.0);
+   if (fabs(d) >= REPROJ_LANCZOS_A) return(0.0);
+   pd=PI*d;
+
+   return(REPROJ_LANCZOS_A*sin(pd)*sin(pd/REPROJ_LANCZOS_A)/(pd*pd));
+}
+
+// Sample the source strip of tile at source pixel sx,sy with kernel.
+// Blank pixels are left out of the weighted sum, NAN if all are blank.
+static float reproj_sample(const struct reproj_tile *tile, int kernel, double sx, double sy) {
+   double wx[2*REPROJ_LANCZOS_A], wy[2*REPROJ_LANCZOS_A];
+   double sum, wsum, w, fx, fy;
+   long ix, iy, i, j, r;
+   float v;
+
+   // to 0 based strip coords
+   sx-=tile->bbox[0];
+   sy-=tile->bbox[2];
+   if (!(isfinite(sx)&&isfinite(sy))) return(NAN);
+   if (kernel == REPROJ_NEAREST) {
+      ix=(long)floor(sx+0.5);
+      iy=(long)floor(sy+0.5);
+      if ((ix < 0)||(iy < 0)||(ix >= tile->nx)||(iy >= tile->ny)) return(NAN);
+      return(tile->src[iy*tile->nx+ix]);
+   }
+
+   r=reproj_radius(kernel);
+   ix=(long)floor(sx);
+   iy=(long)floor(sy);
+   fx=sx-ix;
+   fy=sy-iy;
+   if ((ix+r < 0)||(iy+r < 0)||(ix-r+1 >= tile->nx)||(iy-r+1 >= tile->ny)) return(NAN);
+   if (kernel == REPROJ_BILINEAR) {
+      wx[0]=1.0-fx;
+      wx[1]=fx;
+      wy[0]=1.0-fy;
+      wy[1]=fy;
+   } else {
+      for (i=0; i<2*r; i++) {
+         wx[i]=reproj_lanczos(fx-(i-r+1));
+         wy[i]=reproj_lanczos(fy-(i-r+1));
+      }
+   }
+   sum=0.0;
+   wsum=0.0;
+   for (j=0; j<2*r; j++) {
+      if ((iy-r+1+j < 0)||(iy-r+1+j >= tile->ny)) continue;
+      for (i=0; i<2*r; i++) {
+         if ((ix-r+1+i < 0)||(ix-r+1+i >= tile->nx)) continue;
+         v=tile->src[(iy-r+1+j)*tile->nx+(ix-r+1+i)];
+         if (isnan(v)) continue;
+         w=wx[i]*wy[j];
+         sum+=w*v;
+         wsum+=w;
+      }
+   }
+   if (wsum == 0.0) return(NAN);
+
+   return((float)(sum/wsum));
+}
+
+//
+// Stage 3: resample the source strip into tile->pix, tside x tside floats
+// (row major, tile pixel x,y at pix[(y-1)*tside+x-1]), NAN where the tile
+// is off the image.  With opts->tol > 0 the tile to source transform is
+// interpolated by a wcs_surrogate accurate to tol source pixels, otherwise
+// it is evaluated exactly a row at a time.  img is only used by this
+// thread.
+// Function returns 0 on success and -1 on failure
+//
+int reproj_tile_pix(struct reproj_tile *tile, const struct wcs_image *img, const struct reproj_opts *opts) {
+   struct reproj_map map;
+   struct wcs_surrogate sur;
+   double *x=NULL, *y, *out; // one row of tile pixels and source pixels
+   long naxes[2];
+   long i, j, tside;
+
+   tside=tile->tside;
+   tile->ngood=0;
+   free(tile->pix);
+   tile->pix=(float *)malloc(tside*tside*sizeof(float));
+   if (tile->pix == NULL) {
+      fprintf(stderr, "malloc failed in reproj_tile_pix\n");
+      return(-1);
+   }
+   if (tile->src == NULL) {
+      for (i=0; i<tside*tside; i++) tile->pix[i]=NAN;
+      return(0);
+   }
+
+   map.twcs=tile->wcs;
+   map.img=img;
+   if ((x=(double *)malloc(4*tside*sizeof(double))) == NULL) {
+      fprintf(stderr, "malloc failed in reproj_tile_pix\n");
+      return(-1);
+   }
+   y=x+tside;
+   out=y+tside;
+   if (opts->tol > 0.0) {
+      naxes[0]=tside;
+      naxes[1]=tside;
+      if (wcs_surrogate_initfn(&sur, reproj_mapfn, &map, 2, naxes, opts->tol) < 0) {
+         fprintf(stderr, "wcs_surrogate_initfn failed in reproj_tile_pix\n");
+         free(x);
+         return(-1);
+      }
+   }
+   for (j=0; j<tside; j++) {
+      if (opts->tol > 0.0) {
+         for (i=0; i<tside; i++) {
+            if (wcs_surrogate_eval(&sur, NULL, (double)(i+1), (double)(j+1), out+2*i) < 0) {
+               out[2*i]=NAN;
+               out[2*i+1]=NAN;
+            }
+         }
+      } else {
+         for (i=0; i<tside; i++) {
+            x[i]=i+1;
+            y[i]=j+1;
+         }
+         if (reproj_mapfn(&map, tside, x, y, out) < 0) {
+            fprintf(stderr, "reproj_mapfn failed in reproj_tile_pix\n");
+            free(x);
+            return(-1);
+         }
+      }
+      for (i=0; i<tside; i++) {
+         tile->pix[j*tside+i]=reproj_sample(tile, opts->kernel, out[2*i], out[2*i+1]);
+         if (!isnan(tile->pix[j*tside+i])) tile->ngood++;
+      }
+   }
+   if (opts->tol > 0.0) wcs_surrogate_free(&sur);
+   free(x);
+
+   return(0);
+}
+
+//
+// Reproject the image in fptr, with wcs img, into the nsquid tiles of
+// squids (all of the same resolution, e.g. from wcs_getsquids) with tside
+// pixels per side.  Tiles are processed in parallel by opts->nthread
+// threads (<= 0 for all cores), each with its own copy of img; source
+// reads are serialized.  Each finished tile is passed to fn(tile, arg),
+// one at a time, so fn can write it out; the tile is freed when fn
+// returns.  A negative return from fn stops the run.
+// Function returns 0 on success and -1 on failure
+//
+int reproj_run(fitsfile *fptr, const struct wcs_image *img, int projection, squid_type squids[], long nsquid, squid_type tside,
+      const struct reproj_opts *opts, reproj_fn fn, void *arg) {
+   struct wcs_image *clone; // per thread copies of img
+   int nthread, t, fail=0;
+
+#ifdef _OPENMP
+   nthread=(opts->nthread > 0) ? opts->nthread : omp_get_max_threads();
+#else
+   nthread=1;
+#endif
+   clone=(struct wcs_image *)calloc(nthread, sizeof(struct wcs_image));
+   if (clone == NULL) {
+      fprintf(stderr, "calloc failed in reproj_run\n");
+      return(-1);
+   }
+   for (t=0; (t<nthread)&&(!fail); t++) {
+      if (wcsimg_clone(img, &clone[t]) < 0) fail=1;
+   }
+
+   if (!fail) {
+      long i;
+
+      #pragma omp parallel for schedule(dynamic) num_threads(nthread)
+      for (i=0; i<nsquid; i++) {
+         struct reproj_tile tile;
+         const struct wcs_image *timg;
+         int tfail;
+
+         // fail is set under reproj_write, read it atomically to skip the rest
+         if (__atomic_load_n(&fail, __ATOMIC_RELAXED)) continue;
+#ifdef _OPENMP
+         timg=&clone[omp_get_thread_num()];
+#else
+         timg=&clone[0];
+#endif
+         tfail=(reproj_tile_init(&tile, projection, squids[i], tside) < 0);
+         if (!tfail) tfail=(reproj_tile_bbox(&tile, timg, opts->kernel) < 0);
+         if (!tfail) {
+            #pragma omp critical(reproj_read)
+            tfail=(reproj_tile_read(&tile, fptr) < 0);
+         }
+         if (!tfail) tfail=(reproj_tile_pix(&tile, timg, opts) < 0);
+         #pragma omp critical(reproj_write)
+         {
+            if ((!tfail)&&(!fail)&&(fn(&tile, arg) < 0)) tfail=1;
+            if (tfail) __atomic_store_n(&fail, 1, __ATOMIC_RELAXED);
+         }
+         reproj_tile_free(&tile);
+      }
+   }
+
+   for (t=0; t<nthread; t++) wcsimg_free(&clone[t]);
+   free(clone);
+
+   return(fail ? -1 : 0);
+}
@@ -0,0 +1,527 @@
+//
+// Batch SIP distortion kernels with runtime cpu dispatch
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+#include <pthread.h>
+
+#include <libsquid_wcs.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIP_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*sip_batch_kernel)(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y, double *xout, double *yout);
+
+// Forward distortion p+F(p) of n points and the partial derivatives
+// fu,fv,gu,gv of F, for the Newton refinement of the reverse transform
+typedef void (*sip_grad_kernel)(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y,
+      double *xout, double *yout, double *fu, double *fv, double *gu, double *gv);
+
+// Portable kernel, also used for the tails of the vector kernels.
+// Same Horner order as sip_forward_compiled.
+static void sip_batch_scalar(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y, double *xout, double *yout) {
+   double u,v,pf,pg,fs,gs;
+   long i;
+   int k,j,m;
+
+   for (i=0; i<n; i++) {
+      u=x[i]-crpix1;
+      v=y[i]-crpix2;
+      fs=0.0;
+      gs=0.0;
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=0.0;
+         pg=0.0;
+         for (j=order-k; j>=0; j--) {
+            pf=pf*v+coef[m++];
+            pg=pg*v+coef[m++];
+         }
+         fs=fs*u+pf;
+         gs=gs*u+pg;
+      }
+      xout[i]=x[i]+fs;
+      yout[i]=y[i]+gs;
+   }
+}
+
+// Portable gradient kernel, also used for the tails of the vector ones.
+// Same Horner pass as sip_horner_grad, which sip_reverse_refine uses.
+static void sip_grad_scalar(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y,
+      double *xout, double *yout, double *fu, double *fv, double *gu, double *gv) {
+   double u,v,pf,pg,dpf,dpg,fs,gs,fsu,gsu,fsv,gsv;
+   long i;
+   int k,j,m;
+
+   for (i=0; i<n; i++) {
+      u=x[i]-crpix1;
+      v=y[i]-crpix2;
+      fs=gs=fsu=gsu=fsv=gsv=0.0;
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=pg=dpf=dpg=0.0;
+         for (j=order-k; j>=0; j--) {
+            dpf=dpf*v+pf;
+            dpg=dpg*v+pg;
+            pf=pf*v+coef[m++];
+            pg=pg*v+coef[m++];
+         }
+         fsu=fsu*u+fs;
+         gsu=gsu*u+gs;
+         fsv=fsv*u+dpf;
+         gsv=gsv*u+dpg;
+         fs=fs*u+pf;
+         gs=gs*u+pg;
+      }
+      xout[i]=x[i]+fs;
+      yout[i]=y[i]+gs;
+      fu[i]=fsu;
+      fv[i]=fsv;
+      gu[i]=gsu;
+      gv[i]=gsv;
+   }
+}
+
+#ifdef SIP_HAVE_X86
+
+// 2 points per instruction
+__attribute__((target("sse2")))
+static void sip_batch_sse2(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y, double *xout, double *yout) {
+   __m128d c1,c2,vx,vy,u,v,pf,pg,fs,gs;
+   long i;
+   int k,j,m;
+
+   c1=_mm_set1_pd(crpix1);
+   c2=_mm_set1_pd(crpix2);
+   for (i=0; i+2<=n; i=i+2) {
+      vx=_mm_loadu_pd(x+i);
+      vy=_mm_loadu_pd(y+i);
+      u=_mm_sub_pd(vx,c1);
+      v=_mm_sub_pd(vy,c2);
+      fs=_mm_setzero_pd();
+      gs=_mm_setzero_pd();
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=_mm_setzero_pd();
+         pg=_mm_setzero_pd();
+         for (j=order-k; j>=0; j--) {
+            pf=_mm_add_pd(_mm_mul_pd(pf,v),_mm_set1_pd(coef[m++]));
+            pg=_mm_add_pd(_mm_mul_pd(pg,v),_mm_set1_pd(coef[m++]));
+         }
+         fs=_mm_add_pd(_mm_mul_pd(fs,u),pf);
+         gs=_mm_add_pd(_mm_mul_pd(gs,u),pg);
+      }
+      _mm_storeu_pd(xout+i,_mm_add_pd(vx,fs));
+      _mm_storeu_pd(yout+i,_mm_add_pd(vy,gs));
+   }
+   sip_batch_scalar(coef, order, crpix1, crpix2, n-i, x+i, y+i, xout+i, yout+i);
+}
+
+// 4 points per instruction
+__attribute__((target("avx2,fma")))
+static void sip_batch_avx2(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y, double *xout, double *yout) {
+   __m256d c1,c2,vx,vy,u,v,pf,pg,fs,gs;
+   long i;
+   int k,j,m;
+
+   c1=_mm256_set1_pd(crpix1);
+   c2=_mm256_set1_pd(crpix2);
+   for (i=0; i+4<=n; i=i+4) {
+      vx=_mm256_loadu_pd(x+i);
+      vy=_mm256_loadu_pd(y+i);
+      u=_mm256_sub_pd(vx,c1);
+      v=_mm256_sub_pd(vy,c2);
+      fs=_mm256_setzero_pd();
+      gs=_mm256_setzero_pd();
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=_mm256_setzero_pd();
+         pg=_mm256_setzero_pd();
+         for (j=order-k; j>=0; j--) {
+            pf=_mm256_fmadd_pd(pf,v,_mm256_set1_pd(coef[m++]));
+            pg=_mm256_fmadd_pd(pg,v,_mm256_set1_pd(coef[m++]));
+         }
+         fs=_mm256_fmadd_pd(fs,u,pf);
+         gs=_mm256_fmadd_pd(gs,u,pg);
+      }
+      _mm256_storeu_pd(xout+i,_mm256_add_pd(vx,fs));
+      _mm256_storeu_pd(yout+i,_mm256_add_pd(vy,gs));
+   }
+   sip_batch_scalar(coef, order, crpix1, crpix2, n-i, x+i, y+i, xout+i, yout+i);
+}
+
+// 8 points per instruction
+__attribute__((target("avx512f")))
+static void sip_batch_avx512(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y, double *xout, double *yout) {
+   __m512d c1,c2,vx,vy,u,v,pf,pg,fs,gs;
+   long i;
+   int k,j,m;
+
+   c1=_mm512_set1_pd(crpix1);
+   c2=_mm512_set1_pd(crpix2);
+   for (i=0; i+8<=n; i=i+8) {
+      vx=_mm512_loadu_pd(x+i);
+      vy=_mm512_loadu_pd(y+i);
+      u=_mm512_sub_pd(vx,c1);
+      v=_mm512_sub_pd(vy,c2);
+      fs=_mm512_setzero_pd();
+      gs=_mm512_setzero_pd();
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=_mm512_setzero_pd();
+         pg=_mm512_setzero_pd();
+         for (j=order-k; j>=0; j--) {
+            pf=_mm512_fmadd_pd(pf,v,_mm512_set1_pd(coef[m++]));
+            pg=_mm512_fmadd_pd(pg,v,_mm512_set1_pd(coef[m++]));
+         }
+         fs=_mm512_fmadd_pd(fs,u,pf);
+         gs=_mm512_fmadd_pd(gs,u,pg);
+      }
+      _mm512_storeu_pd(xout+i,_mm512_add_pd(vx,fs));
+      _mm512_storeu_pd(yout+i,_mm512_add_pd(vy,gs));
+   }
+   sip_batch_scalar(coef, order, crpix1, crpix2, n-i, x+i, y+i, xout+i, yout+i);
+}
+
+// Gradient, 2 points per instruction
+__attribute__((target("sse2")))
+static void sip_grad_sse2(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y,
+      double *xout, double *yout, double *fu, double *fv, double *gu, double *gv) {
+   __m128d c1,c2,vx,vy,u,v,cf,cg,pf,pg,dpf,dpg,fs,gs,fsu,gsu,fsv,gsv;
+   long i;
+   int k,j,m;
+
+   c1=_mm_set1_pd(crpix1);
+   c2=_mm_set1_pd(crpix2);
+   for (i=0; i+2<=n; i=i+2) {
+      vx=_mm_loadu_pd(x+i);
+      vy=_mm_loadu_pd(y+i);
+      u=_mm_sub_pd(vx,c1);
+      v=_mm_sub_pd(vy,c2);
+      fs=gs=fsu=gsu=fsv=gsv=_mm_setzero_pd();
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=pg=dpf=dpg=_mm_setzero_pd();
+         for (j=order-k; j>=0; j--) {
+            cf=_mm_set1_pd(coef[m++]);
+            cg=_mm_set1_pd(coef[m++]);
+            dpf=_mm_add_pd(_mm_mul_pd(dpf,v),pf);
+            dpg=_mm_add_pd(_mm_mul_pd(dpg,v),pg);
+            pf=_mm_add_pd(_mm_mul_pd(pf,v),cf);
+            pg=_mm_add_pd(_mm_mul_pd(pg,v),cg);
+         }
+         fsu=_mm_add_pd(_mm_mul_pd(fsu,u),fs);
+         gsu=_mm_add_pd(_mm_mul_pd(gsu,u),gs);
+         fsv=_mm_add_pd(_mm_mul_pd(fsv,u),dpf);
+         gsv=_mm_add_pd(_mm_mul_pd(gsv,u),dpg);
+         fs=_mm_add_pd(_mm_mul_pd(fs,u),pf);
+         gs=_mm_add_pd(_mm_mul_pd(gs,u),pg);
+      }
+      _mm_storeu_pd(xout+i,_mm_add_pd(vx,fs));
+      _mm_storeu_pd(yout+i,_mm_add_pd(vy,gs));
+      _mm_storeu_pd(fu+i,fsu);
+      _mm_storeu_pd(fv+i,fsv);
+      _mm_storeu_pd(gu+i,gsu);
+      _mm_storeu_pd(gv+i,gsv);
+   }
+   sip_grad_scalar(coef, order, crpix1, crpix2, n-i, x+i, y+i, xout+i, yout+i, fu+i, fv+i, gu+i, gv+i);
+}
+
+// Gradient, 4 points per instruction
+__attribute__((target("avx2,fma")))
+static void sip_grad_avx2(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y,
+      double *xout, double *yout, double *fu, double *fv, double *gu, double *gv) {
+   __m256d c1,c2,vx,vy,u,v,cf,cg,pf,pg,dpf,dpg,fs,gs,fsu,gsu,fsv,gsv;
+   long i;
+   int k,j,m;
+
+   c1=_mm256_set1_pd(crpix1);
+   c2=_mm256_set1_pd(crpix2);
+   for (i=0; i+4<=n; i=i+4) {
+      vx=_mm256_loadu_pd(x+i);
+      vy=_mm256_loadu_pd(y+i);
+      u=_mm256_sub_pd(vx,c1);
+      v=_mm256_sub_pd(vy,c2);
+      fs=gs=fsu=gsu=fsv=gsv=_mm256_setzero_pd();
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=pg=dpf=dpg=_mm256_setzero_pd();
+         for (j=order-k; j>=0; j--) {
+            cf=_mm256_set1_pd(coef[m++]);
+            cg=_mm256_set1_pd(coef[m++]);
+            dpf=_mm256_fmadd_pd(dpf,v,pf);
+            dpg=_mm256_fmadd_pd(dpg,v,pg);
+            pf=_mm256_fmadd_pd(pf,v,cf);
+            pg=_mm256_fmadd_pd(pg,v,cg);
+         }
+         fsu=_mm256_fmadd_pd(fsu,u,fs);
+         gsu=_mm256_fmadd_pd(gsu,u,gs);
+         fsv=_mm256_fmadd_pd(fsv,u,dpf);
+         gsv=_mm256_fmadd_pd(gsv,u,dpg);
+         fs=_mm256_fmadd_pd(fs,u,pf);
+         gs=_mm256_fmadd_pd(gs,u,pg);
+      }
+      _mm256_storeu_pd(xout+i,_mm256_add_pd(vx,fs));
+      _mm256_storeu_pd(yout+i,_mm256_add_pd(vy,gs));
+      _mm256_storeu_pd(fu+i,fsu);
+      _mm256_storeu_pd(fv+i,fsv);
+      _mm256_storeu_pd(gu+i,gsu);
+      _mm256_storeu_pd(gv+i,gsv);
+   }
+   sip_grad_scalar(coef, order, crpix1, crpix2, n-i, x+i, y+i, xout+i, yout+i, fu+i, fv+i, gu+i, gv+i);
+}
+
+// Gradient, 8 points per instruction
+__attribute__((target("avx512f")))
+static void sip_grad_avx512(const double *coef, int order, double crpix1, double crpix2, long n, const double *x, const double *y,
+      double *xout, double *yout, double *fu, double *fv, double *gu, double *gv) {
+   __m512d c1,c2,vx,vy,u,v,cf,cg,pf,pg,dpf,dpg,fs,gs,fsu,gsu,fsv,gsv;
+   long i;
+   int k,j,m;
+
+   c1=_mm512_set1_pd(crpix1);
+   c2=_mm512_set1_pd(crpix2);
+   for (i=0; i+8<=n; i=i+8) {
+      vx=_mm512_loadu_pd(x+i);
+      vy=_mm512_loadu_pd(y+i);
+      u=_mm512_sub_pd(vx,c1);
+      v=_mm512_sub_pd(vy,c2);
+      fs=gs=fsu=gsu=fsv=gsv=_mm512_setzero_pd();
+      m=0;
+      for (k=order; k>=0; k--) {
+         pf=pg=dpf=dpg=_mm512_setzero_pd();
+         for (j=order-k; j>=0; j--) {
+            cf=_mm512_set1_pd(coef[m++]);
+            cg=_mm512_set1_pd(coef[m++]);
+            dpf=_mm512_fmadd_pd(dpf,v,pf);
+            dpg=_mm512_fmadd_pd(dpg,v,pg);
+            pf=_mm512_fmadd_pd(pf,v,cf);
+            pg=_mm512_fmadd_pd(pg,v,cg);
+         }
+         fsu=_mm512_fmadd_pd(fsu,u,fs);
+         gsu=_mm512_fmadd_pd(gsu,u,gs);
+         fsv=_mm512_fmadd_pd(fsv,u,dpf);
+         gsv=_mm512_fmadd_pd(gsv,u,dpg);
+         fs=_mm512_fmadd_pd(fs,u,pf);
+         gs=_mm512_fmadd_pd(gs,u,pg);
+      }
+      _mm512_storeu_pd(xout+i,_mm512_add_pd(vx,fs));
+      _mm512_storeu_pd(yout+i,_mm512_add_pd(vy,gs));
+      _mm512_storeu_pd(fu+i,fsu);
+      _mm512_storeu_pd(fv+i,fsv);
+      _mm512_storeu_pd(gu+i,gsu);
+      _mm512_storeu_pd(gv+i,gsv);
+   }
+   sip_grad_scalar(coef, order, crpix1, crpix2, n-i, x+i, y+i, xout+i, yout+i, fu+i, fv+i, gu+i, gv+i);
+}
+
+#endif // SIP_HAVE_X86
+
+// Kernel of each instruction set, scalar where not built
+static const sip_batch_kernel sip_kernels[SIP_ISA_AVX512+1] = {
+#ifdef SIP_HAVE_X86
+   sip_batch_scalar, sip_batch_sse2, sip_batch_avx2, sip_batch_avx512
+#else
+   sip_batch_scalar, sip_batch_scalar, sip_batch_scalar, sip_batch_scalar
+#endif
+};
+
+// Gradient kernel of each instruction set, scalar where not built
+static const sip_grad_kernel sip_grad_kernels[SIP_ISA_AVX512+1] = {
+#ifdef SIP_HAVE_X86
+   sip_grad_scalar, sip_grad_sse2, sip_grad_avx2, sip_grad_avx512
+#else
+   sip_grad_scalar, sip_grad_scalar, sip_grad_scalar, sip_grad_scalar
+#endif
+};
+
+// Selected instruction set, -1 until first use.  Only read and written
+// with atomics, the batch functions are called from many threads at once.
+static int sip_isa=-1;
+
+// Instruction sets supported by the running cpu, probed once
+static pthread_once_t sip_cpu_once=PTHREAD_ONCE_INIT;
+static int sip_cpu_isa[SIP_ISA_AVX512+1];
+
+static void sip_cpu_probe(void) {
+
+   sip_cpu_isa[SIP_ISA_SCALAR]=1;
+#ifdef SIP_HAVE_X86
+   __builtin_cpu_init();
+   sip_cpu_isa[SIP_ISA_SSE2]=__builtin_cpu_supports("sse2") ? 1 : 0;
+   sip_cpu_isa[SIP_ISA_AVX2]=(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? 1 : 0;
+   sip_cpu_isa[SIP_ISA_AVX512]=__builtin_cpu_supports("avx512f") ? 1 : 0;
+#endif
+}
+
+// Return 1 if the running cpu supports the given instruction set
+static int sip_batch_supported(int isa) {
+
+   if ((isa < SIP_ISA_SCALAR)||(isa > SIP_ISA_AVX512)) return(0);
+   pthread_once(&sip_cpu_once, sip_cpu_probe);
+
+   return(sip_cpu_isa[isa]);
+}
+
+// Force the instruction set used by the batch SIP kernels.  Batch calls
+// already running in other threads finish with the kernel they started.
+// Function returns 0 on success and -1 if the cpu does not support it.
+int sip_batch_setisa(int isa) {
+
+   if (!sip_batch_supported(isa)) return(-1);
+   __atomic_store_n(&sip_isa, isa, __ATOMIC_RELEASE);
+
+   return(0);
+}
+
+// Return the instruction set used by the batch SIP kernels, picking the
+// widest one supported by the running cpu on first use.
+int sip_batch_getisa(void) {
+   int isa, unset=-1;
+
+   if ((isa=__atomic_load_n(&sip_isa, __ATOMIC_ACQUIRE)) >= 0) return(isa);
+   for (isa=SIP_ISA_AVX512; isa>SIP_ISA_SCALAR; isa--) {
+      if (sip_batch_supported(isa)) break;
+   }
+   // keep a choice made meanwhile by another thread or by sip_batch_setisa
+   if (!__atomic_compare_exchange_n(&sip_isa, &unset, isa, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) isa=unset;
+
+   return(isa);
+}
+
+// Kernel of the selected instruction set
+static sip_batch_kernel sip_batch_kernel_get(void) {
+
+   return(sip_kernels[sip_batch_getisa()]);
+}
+
+// Apply the forward SIP distortion to n points given as separate x[] and
+// y[] arrays.  xout,yout may be the same arrays as x,y.
+int sip_forward_batch(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout) {
+   sip_batch_kernel kern;
+
+   if (n <= 0) return(0);
+   kern=sip_batch_kernel_get();
+   kern(scomp->fwd, scomp->order, scomp->crpix1, scomp->crpix2, n, x, y, xout, yout);
+
+   return(0);
+}
+
+// Number of points per block when refining the reverse transform
+#define SIP_REFINE_BLOCK 256
+
+//
+// Newton refinement of the reverse SIP transform for n <= SIP_REFINE_BLOCK
+// points, as sip_reverse_refine but a whole iteration at a time: each
+// iteration evaluates the forward polynomials and their analytic
+// derivatives for all points still moving with the gradient kernel, and
+// points drop out as they converge.  The step is the same as in
+// sip_reverse_refine.  Points that do not converge are set to NAN and get
+// SIP_STAT_NOCONV in stat (if not NULL).  Points that are not finite are
+// left as is.
+// Returns the number of points that did not converge.
+//
+static int sip_refine_block(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout, int stat[]) {
+   double px[SIP_REFINE_BLOCK], py[SIP_REFINE_BLOCK]; // current estimates
+   double fx[SIP_REFINE_BLOCK], fy[SIP_REFINE_BLOCK]; // p+F(p)
+   double fu[SIP_REFINE_BLOCK], fv[SIP_REFINE_BLOCK]; // partial derivatives of F
+   double gu[SIP_REFINE_BLOCK], gv[SIP_REFINE_BLOCK];
+   long idx[SIP_REFINE_BLOCK]; // points still moving
+   double rx, ry, det, dx, dy, tol2;
+   long i, j, m, na=0;
+   int it, nfail=0;
+   sip_grad_kernel kern;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_REVERSE_REFINE);
+
+   kern=sip_grad_kernels[sip_batch_getisa()];
+   tol2=scomp->tol*scomp->tol;
+   for (i=0; i<n; i++) {
+      if (isfinite(xout[i])&&isfinite(yout[i])&&isfinite(x[i])&&isfinite(y[i])) idx[na++]=i;
+   }
+   for (it=0; (it<scomp->maxiter)&&(na > 0); it++) {
+      for (j=0; j<na; j++) {
+         px[j]=xout[idx[j]];
+         py[j]=yout[idx[j]];
+      }
+      kern(scomp->fwd, scomp->order, scomp->crpix1, scomp->crpix2, na, px, py, fx, fy, fu, fv, gu, gv);
+      m=0;
+      for (j=0; j<na; j++) {
+         i=idx[j];
+         rx=fx[j]-x[i];
+         ry=fy[j]-y[i];
+         // Jacobian of p+F(p) is I+dF
+         det=(1.0+fu[j])*(1.0+gv[j])-fv[j]*gu[j];
+         if (det == 0.0) {
+            xout[i]=NAN;
+            yout[i]=NAN;
+            if (stat != NULL) stat[i]=SIP_STAT_NOCONV;
+            nfail++;
+            continue;
+         }
+         dx=((1.0+gv[j])*rx-fv[j]*ry)/det;
+         dy=((1.0+fu[j])*ry-gu[j]*rx)/det;
+         xout[i]=px[j]-dx;
+         yout[i]=py[j]-dy;
+         if (dx*dx+dy*dy > tol2) idx[m++]=i;
+      }
+      na=m;
+   }
+   for (j=0; j<na; j++) {
+      xout[idx[j]]=NAN;
+      yout[idx[j]]=NAN;
+      if (stat != NULL) stat[idx[j]]=SIP_STAT_NOCONV;
+   }
+
+   return(nfail+(int)na);
+}
+
+// Apply the reverse SIP distortion to n points, as in sip_forward_batch.
+// If refinement is on (see sip_setinverse) the AP,BP result from the
+// batch kernel is refined block by block with sip_refine_block.  Points
+// that do not converge are set to NAN and, if stat is not NULL, get
+// SIP_STAT_NOCONV in stat; stat is not touched for the other points.
+// Returns the number of points that did not converge, 0 without refinement
+int sip_reverse_batch(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout, int stat[]) {
+   double tx[SIP_REFINE_BLOCK], ty[SIP_REFINE_BLOCK]; // undistorted block
+   long i, nblk;
+   int nfail=0;
+   sip_batch_kernel kern;
+
+   if (n <= 0) return(0);
+   kern=sip_batch_kernel_get();
+   if (!scomp->refine) {
+      kern(scomp->rev, scomp->porder, scomp->crpix1, scomp->crpix2, n, x, y, xout, yout);
+      return(0);
+   }
+
+   // keep a copy of the input, xout,yout may be the same arrays as x,y
+   for (i=0; i<n; i+=nblk) {
+      nblk=((n-i) < SIP_REFINE_BLOCK) ? n-i : SIP_REFINE_BLOCK;
+      memcpy(tx, x+i, nblk*sizeof(double));
+      memcpy(ty, y+i, nblk*sizeof(double));
+      kern(scomp->rev, scomp->porder, scomp->crpix1, scomp->crpix2, nblk, tx, ty, xout+i, yout+i);
+      nfail+=sip_refine_block(scomp, nblk, tx, ty, xout+i, yout+i, stat ? stat+i : NULL);
+   }
+
+   return(nfail);
+}
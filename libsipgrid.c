@@ -0,0 +1,230 @@
+//
+// Interpolated SIP distortion table for full frame undistortion
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+
+// Catmull-Rom cubic convolution weights for the 4 nodes around offset t
+static inline void sipgrid_weights(double t, double w[4]) {
+   double t2,t3;
+
+   t2=t*t;
+   t3=t2*t;
+   w[0]=0.5*(-t3+2.0*t2-t);
+   w[1]=0.5*(3.0*t3-5.0*t2+2.0);
+   w[2]=0.5*(-3.0*t3+4.0*t2+t);
+   w[3]=0.5*(t3-t2);
+}
+
+// Interpolate the distortion table at grid coords gx,gy (node units).
+// Returns 0, or -1 if the point is outside the table.
+static inline int sipgrid_interp(const struct sip_grid *grid, double gx, double gy, double *dx, double *dy) {
+   double wx[4],wy[4]; // node weights
+   double sx,sy,rx,ry;
+   const double *row;
+   long i,j;
+   int a,b;
+
+   i=(long)floor(gx);
+   j=(long)floor(gy);
+   if ((i < 1)||(j < 1)||(i > grid->nx-3)||(j > grid->ny-3)) return(-1);
+   sipgrid_weights(gx-i, wx);
+   sipgrid_weights(gy-j, wy);
+   sx=0.0;
+   sy=0.0;
+   for (b=0; b<4; b++) {
+      row=grid->d+2*((j-1+b)*grid->nx+(i-1));
+      rx=0.0;
+      ry=0.0;
+      for (a=0; a<4; a++) {
+         rx+=wx[a]*row[2*a];
+         ry+=wx[a]*row[2*a+1];
+      }
+      sx+=wy[b]*rx;
+      sy+=wy[b]*ry;
+   }
+   *dx=sx;
+   *dy=sy;
+
+   return(0);
+}
+
+//
+// Build a forward SIP distortion table for an image of naxes pixels.
+// The distortion dx,dy is evaluated exactly every step pixels (<= 0 for
+// SIP_GRID_STEP), with one extra node before and two after each axis, and
+// interpolated in between by bicubic (Catmull-Rom) convolution.  The
+// interpolation error is then measured at 4 points of every cell, where
+// it peaks, and its max is stored in grid->maxerr.  This is a measured
+// bound, not a proven one, so allow some margin when choosing step.
+// Free with sip_grid_free.
+// Function returns 0 on success and -1 on failure
+//
+int sip_grid_init(struct sip_grid *grid, const struct sip_compiled *scomp, long naxes[], int step) {
+   double x,y,xs,ys,dx,dy,err;
+   long i,j;
+   int c;
+
+   memset(grid, 0, sizeof(struct sip_grid));
+   if (step <= 0) step=SIP_GRID_STEP;
+   if ((naxes[0] < 1)||(naxes[1] < 1)) {
+      fprintf(stderr, "bad image size in sip_grid_init\n");
+      return(-1);
+   }
+   grid->scomp=scomp;
+   grid->step=step;
+   grid->x0=1.0-step;
+   grid->y0=1.0-step;
+   grid->nx=(long)ceil((naxes[0]-1)/(double)step)+4;
+   grid->ny=(long)ceil((naxes[1]-1)/(double)step)+4;
+   grid->d=(double *)malloc(2*grid->nx*grid->ny*sizeof(double));
+   if (grid->d == NULL) {
+      fprintf(stderr, "malloc failed in sip_grid_init\n");
+      return(-1);
+   }
+
+   // exact distortion at the nodes
+   for (j=0; j<grid->ny; j++) {
+      y=grid->y0+j*step;
+      for (i=0; i<grid->nx; i++) {
+         x=grid->x0+i*step;
+         xs=x;
+         ys=y;
+         if (scomp->have_sip) sip_forward_compiled(scomp, x, y, &xs, &ys);
+         grid->d[2*(j*grid->nx+i)]=xs-x;
+         grid->d[2*(j*grid->nx+i)+1]=ys-y;
+      }
+   }
+
+   // measure the interpolation error over the image, at the offsets
+   // 1/2 -+ 1/(2 sqrt(3)) from the nodes where the 1D cubic convolution
+   // error peaks
+   for (j=1; j<grid->ny-3; j++) {
+      for (i=1; i<grid->nx-3; i++) {
+         for (c=0; c<4; c++) {
+            x=i+((c & 1) ? 0.7886751346 : 0.2113248654);
+            y=j+((c & 2) ? 0.7886751346 : 0.2113248654);
+            sipgrid_interp(grid, x, y, &dx, &dy);
+            x=grid->x0+x*step;
+            y=grid->y0+y*step;
+            xs=x;
+            ys=y;
+            if (scomp->have_sip) sip_forward_compiled(scomp, x, y, &xs, &ys);
+            err=fmax(fabs(xs-x-dx), fabs(ys-y-dy));
+            if (err > grid->maxerr) grid->maxerr=err;
+         }
+      }
+   }
+
+   return(0);
+}
+
+// Free memory held by grid
+void sip_grid_free(struct sip_grid *grid) {
+
+   free(grid->d);
+   grid->d=NULL;
+   grid->nx=0;
+   grid->ny=0;
+}
+
+// Same as sip_forward_compiled, with the distortion interpolated from
+// grid.  Points outside the table are evaluated exactly.
+int sip_grid_forward(const struct sip_grid *grid, double x, double y, double *xout, double *yout) {
+   double dx,dy;
+
+   if (sipgrid_interp(grid, (x-grid->x0)/grid->step, (y-grid->y0)/grid->step, &dx, &dy) < 0) {
+      if (grid->scomp->have_sip) return(sip_forward_compiled(grid->scomp, x, y, xout, yout));
+      dx=0.0;
+      dy=0.0;
+   }
+   *xout=x+dx;
+   *yout=y+dy;
+
+   return(0);
+}
+
+// Batch version of sip_grid_forward.  xout,yout may be the same arrays as x,y.
+int sip_grid_forward_batch(const struct sip_grid *grid, long n, const double *x, const double *y, double *xout, double *yout) {
+   long i;
+
+   for (i=0; i<n; i++) sip_grid_forward(grid, x[i], y[i], &xout[i], &yout[i]);
+
+   return(0);
+}
+
+//
+// Undistort a row of n pixels at x=x0,x0+1,... and fixed y, as needed to
+// resample a whole image.  The table is collapsed over y once for the row
+// and, when x0 falls on whole pixels of the grid, the x weights of the
+// step pixels in a cell are tabulated too, leaving 8 multiply-adds per
+// pixel.
+//
+int sip_grid_forward_row(const struct sip_grid *grid, double x0, double y, long n, double *xout, double *yout) {
+   double wy[4]; // node weights along y
+   double *col=NULL; // table collapsed over y, dx,dy per node
+   double *wt; // x weights for each pixel offset in a cell
+   double gy,off,x;
+   const double *row, *w;
+   long i,j,k,m;
+   int b;
+
+   gy=(y-grid->y0)/grid->step;
+   j=(long)floor(gy);
+   off=x0-grid->x0;
+   if ((j < 1)||(j > grid->ny-3)||(off != floor(off))||(off < grid->step)||
+       ((col=(double *)malloc((2*grid->nx+4*grid->step)*sizeof(double))) == NULL)) {
+      // row outside the table, x0 between pixels or no memory for the
+      // row: point by point
+      for (k=0; k<n; k++) sip_grid_forward(grid, x0+k, y, &xout[k], &yout[k]);
+      return(0);
+   }
+   wt=col+2*grid->nx;
+   sipgrid_weights(gy-j, wy);
+   for (k=0; k<2*grid->nx; k++) col[k]=0.0;
+   for (b=0; b<4; b++) {
+      row=grid->d+2*(j-1+b)*grid->nx;
+      for (k=0; k<2*grid->nx; k++) col[k]+=wy[b]*row[k];
+   }
+   for (m=0; m<grid->step; m++) sipgrid_weights(m/(double)grid->step, wt+4*m);
+
+   // cell i and pixel offset m in the cell of the current pixel
+   i=(long)off/grid->step;
+   m=(long)off%grid->step;
+   for (k=0; (k<n)&&(i <= grid->nx-3); k++) {
+      x=x0+k;
+      w=wt+4*m;
+      row=col+2*(i-1);
+      xout[k]=x+w[0]*row[0]+w[1]*row[2]+w[2]*row[4]+w[3]*row[6];
+      yout[k]=y+w[0]*row[1]+w[1]*row[3]+w[2]*row[5]+w[3]*row[7];
+      if (++m == grid->step) {
+         m=0;
+         i++;
+      }
+   }
+   // rest of the row is past the table
+   for (; k<n; k++) sip_grid_forward(grid, x0+k, y, &xout[k], &yout[k]);
+   free(col);
+
+   return(0);
+}
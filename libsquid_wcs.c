@@ -23,38 +23,53 @@
 
 #include <libsquid_wcs.h>
 
-// Transform image coords to squid and append to squidarr if not there already
-int wcs_addsquid(int projection, struct wcsprm *wcs, int k, double x, double y, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Transform image coords to squid at resolution k
+static int wcs_pix2squid(int projection, struct wcsprm *wcs, int k, double x, double y, squid_type *squid) {
    double ra_deg, dec_deg;
    double ra_rad, dec_rad;
+
+   // Transform (x, y) to (ra, dec)
+   if (0 != wcs_pix2rd(wcs, x, y, &ra_deg, &dec_deg)) {
+      return(-1);
+   }
+
+   // Degrees to radians
+   ra_rad  = fmod(ra_deg*DD2R+2*PI,2*PI);
+   dec_rad = dec_deg*DD2R;
+
+   // Transform (ra,dec) to squid
+   if (0 != sph2squid(projection, ra_rad, dec_rad, k, squid)) {
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "wcs_pix2squid", "sph2squid failed");
+      return(-1);
+   }
+
+   return(0);
+}
+
+// Transform image coords to squid and append to squidarr if not there already
+int wcs_addsquid(int projection, struct wcsprm *wcs, int k, double x, double y, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
    squid_type squid;
    long i;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_ADDSQUID);
 
    // Test for NULL counter
    if (NULL == squidarr_used) {
-      fprintf(stderr, "NULL counter (NULL == squidarr_used) in wcs_addsquid\n");
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "wcs_addsquid", "NULL counter");
       return(-1);
    }
 
    // Test for full array
    if (squidarr_len <= (*squidarr_used)) {
-      fprintf(stderr, "Full array (%li <= %li) (squidarr_len <= (*squidarr_used)) in wcs_addsquid\n", squidarr_len, (*squidarr_used));
-      return(-1);
-   }
-
-   // Transform (x, y) to (ra, dec)
-   if (0 != wcs_pix2rd(wcs, x, y, &ra_deg, &dec_deg)) {
-      fprintf(stderr, "wcs_pix2rd failed in wcs_addsquid\n");
+      squidwcs_error(SQUIDWCS_ERR_FULL, 0, "wcs_addsquid", "array full");
       return(-1);
    }
 
-   // Degrees to radians
-   ra_rad  = fmod(ra_deg*DD2R+2*PI,2*PI);
-   dec_rad = dec_deg*DD2R;
-
-   // Transform (ra,dec) to squid
-   if (0 != sph2squid(projection, ra_rad, dec_rad, k, &squid)) {
-      fprintf(stderr, "sph2squid failed in wcs_addsquid\n");
+   // Transform (x, y) to squid
+   if (0 != wcs_pix2squid(projection, wcs, k, x, y, &squid)) {
       return(-1);
    }
 
@@ -73,147 +88,952 @@ int wcs_addsquid(int projection, struct wcsprm *wcs, int k, double x, double y,
    return(0);
 }
 
+// Hash a squid into a table index (splitmix64 finalizer)
+static unsigned long long squidset_hash(squid_type squid) {
+   unsigned long long h;
+
+   h=(unsigned long long)squid;
+   h=(h^(h >> 30))*0xbf58476d1ce4e5b9ULL;
+   h=(h^(h >> 27))*0x94d049bb133111ebULL;
+   h=h^(h >> 31);
+
+   return(h);
+}
+
+// Initialize an empty squid set
+// Function returns 0 on success and -1 on failure
+int squidset_init(struct squid_set *set) {
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SQUIDSET_INIT);
+
+   set->n=0;
+   set->nalloc=64;
+   set->hsize=128;
+   set->list=(squid_type *)malloc(set->nalloc*sizeof(squid_type));
+   set->hash=(long *)calloc(set->hsize,sizeof(long));
+   if ((set->list == NULL)||(set->hash == NULL)) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "squidset_init", "malloc failed");
+      squidset_free(set);
+      return(-1);
+   }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_SQUIDSET_INIT);
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_SQUIDSET_INIT);
+
+   return(0);
+}
+
+// Free memory held by a squid set
+void squidset_free(struct squid_set *set) {
+
+   free(set->list);
+   free(set->hash);
+   set->list=NULL;
+   set->hash=NULL;
+   set->n=0;
+   set->nalloc=0;
+   set->hsize=0;
+}
+
+// Add squid to set if not there already.
+// Function returns 1 if squid was added, 0 if already present, -1 on failure
+int squidset_add(struct squid_set *set, squid_type squid) {
+   squid_type *list; // grown insertion list
+   long *hash; // grown hash table
+   long hsize,i,h;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SQUIDSET_ADD);
+
+   // look up squid, hash slots hold list index+1 with 0 for empty
+   h=(long)(squidset_hash(squid) & (set->hsize-1));
+   while (set->hash[h] != 0) {
+      if (set->list[set->hash[h]-1] == squid) return(0);
+      h=(h+1) & (set->hsize-1);
+   }
+
+   // grow insertion list
+   if (set->n >= set->nalloc) {
+      list=(squid_type *)realloc(set->list,2*set->nalloc*sizeof(squid_type));
+      if (list == NULL) {
+         squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "squidset_add", "realloc failed");
+         return(-1);
+      }
+      SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_SQUIDSET_ADD);
+      set->list=list;
+      set->nalloc=2*set->nalloc;
+   }
+   set->list[set->n]=squid;
+   set->n++;
+   set->hash[h]=set->n;
+
+   // keep hash table at most half full
+   if (2*set->n > set->hsize) {
+      hsize=2*set->hsize;
+      hash=(long *)calloc(hsize,sizeof(long));
+      if (hash == NULL) {
+         squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "squidset_add", "calloc failed");
+         return(-1);
+      }
+      SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_SQUIDSET_ADD);
+      for (i=0; i<set->n; i++) {
+         h=(long)(squidset_hash(set->list[i]) & (hsize-1));
+         while (hash[h] != 0) h=(h+1) & (hsize-1);
+         hash[h]=i+1;
+      }
+      free(set->hash);
+      set->hash=hash;
+      set->hsize=hsize;
+   }
+
+   return(1);
+}
+
+// qsort comparison for squids
+static int squid_cmp(const void *a, const void *b) {
+   squid_type sa=*(const squid_type *)a;
+   squid_type sb=*(const squid_type *)b;
+
+   return((sa > sb)-(sa < sb));
+}
+
+// Copy squids in set to squidarr, in insertion order or sorted.
+// squidarr_used is set to the number of squids copied.
+// Function returns 0 on success and -1 on failure
+int squidset_copy(struct squid_set *set, int sorted, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+
+   if (squidarr_len < set->n) {
+      squidwcs_error(SQUIDWCS_ERR_FULL, 0, "squidset_copy", "array full");
+      return(-1);
+   }
+   memcpy(squidarr, set->list, set->n*sizeof(squid_type));
+   if (sorted) qsort(squidarr, set->n, sizeof(squid_type), squid_cmp);
+   *squidarr_used=set->n;
+
+   return(0);
+}
+
+// Sample points used by wcs_getsquids: every pixel on the image edges,
+// then a grid in the interior with a step of a quarter tile.
+struct squid_sample {
+   long nx,ny; // image size
+   double step; // interior grid step in pix
+   long gx,gy; // interior grid size
+   long n; // total number of samples
+};
+
+// Set up sample points for an image at resolution k
+static void wcs_sampleinit(double cdelt, long naxes[], int k, struct squid_sample *samp) {
+   double N; // Nside
+   double omega; // healpix width in deg
+
+   N=pow(2,(double)k);
+   omega=90.0/N; // in degrees
+   samp->step=floor(omega/(4*cdelt));
+   if (samp->step < 1) samp->step=1;
+   samp->nx=naxes[0];
+   samp->ny=naxes[1];
+   samp->gx=(long)ceil(samp->nx/samp->step);
+   samp->gy=(long)ceil(samp->ny/samp->step);
+   samp->n=2*samp->ny+2*samp->nx+samp->gx*samp->gy;
+}
+
+// Get image coords of sample i, in the order wcs_getsquids visits them
+static void wcs_sample(struct squid_sample *samp, long i, double *x, double *y) {
+
+   // first all pix on edge of image
+   if (i < samp->ny) {
+      *x=0;
+      *y=i;
+      return;
+   }
+   i=i-samp->ny;
+   if (i < samp->ny) {
+      *x=samp->nx-1;
+      *y=i;
+      return;
+   }
+   i=i-samp->ny;
+   if (i < samp->nx) {
+      *x=i;
+      *y=0;
+      return;
+   }
+   i=i-samp->nx;
+   if (i < samp->nx) {
+      *x=i;
+      *y=samp->ny-1;
+      return;
+   }
+   i=i-samp->nx;
+
+   // now grid in interior
+   *x=(i%samp->gx)*samp->step;
+   *y=(i/samp->gx)*samp->step;
+}
+
+// Add squid for every sample point used by wcs_getsquids to set
+static int wcs_squidsample(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, struct squid_set *set) {
+   struct squid_sample samp;
+   double x,y; // img coords
+   squid_type squid;
+   long i;
+
+   wcs_sampleinit(cdelt, naxes, k, &samp);
+   for (i=0; i<samp.n; i++) {
+      wcs_sample(&samp, i, &x, &y);
+      if (0 != wcs_pix2squid(projection, wcs, k, x, y, &squid)) return(-1);
+      if (squidset_add(set, squid) < 0) return(-1);
+   }
+
+   return(0);
+}
+
+// Same as wcs_squidsample, with the samples split over nthread threads.
+// Each thread converts with its own wcs clone into its own squid set,
+// and the sets are merged into set at the end.
+static int wcs_squidsample_omp(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, int nthread, struct squid_set *set) {
+#ifdef _OPENMP
+   struct squid_sample samp;
+   struct wcs_pool pool;
+   int fail; // set by any thread on failure
+
+   if (nthread <= 0) nthread=omp_get_max_threads();
+   if (nthread == 1) return(wcs_squidsample(projection, wcs, cdelt, naxes, k, set));
+   if (wcs_pool_init(&pool, wcs, nthread) < 0) {
+      return(-1);
+   }
+   wcs_sampleinit(cdelt, naxes, k, &samp);
+   fail=0;
+   #pragma omp parallel num_threads(nthread)
+   {
+      struct squid_set tset; // this thread's squids
+      struct wcsprm *twcs; // this thread's wcs
+      double x,y; // img coords
+      squid_type squid;
+      long i;
+      int tfail;
+
+      twcs=wcs_pool_get(&pool, omp_get_thread_num());
+      tfail=(squidset_init(&tset) < 0);
+      #pragma omp for schedule(static)
+      for (i=0; i<samp.n; i++) {
+         if (tfail) continue;
+         wcs_sample(&samp, i, &x, &y);
+         if ((0 != wcs_pix2squid(projection, twcs, k, x, y, &squid))||(squidset_add(&tset, squid) < 0)) tfail=1;
+      }
+      #pragma omp critical(wcs_squidsample_merge)
+      {
+         if (tfail) fail=1;
+         for (i=0; (!fail)&&(i<tset.n); i++) {
+            if (squidset_add(set, tset.list[i]) < 0) fail=1;
+         }
+      }
+      squidset_free(&tset);
+   }
+   wcs_pool_free(&pool);
+   // the worker raised into its own thread's last error, so raise here too
+   if (fail) return(squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "wcs_squidsample_omp", "sampling failed"));
+
+   return(0);
+#else
+   return(wcs_squidsample(projection, wcs, cdelt, naxes, k, set));
+#endif
+}
+
+// Sample the image like wcs_getsquids and store the result in squidarr,
+// merged with any squids already there.
+static int wcs_getsquids_set(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, int sorted, int nthread, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+   struct squid_set set;
+   long i;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_GETSQUIDS);
+
+   // Test for NULL counter
+   if (NULL == squidarr_used) {
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "wcs_getsquids", "NULL counter");
+      return(-1);
+   }
+
+   // Test for full array
+   if (squidarr_len <= (*squidarr_used)) {
+      squidwcs_error(SQUIDWCS_ERR_FULL, 0, "wcs_getsquids", "array full");
+      return(-1);
+   }
+
+   if (squidset_init(&set) < 0) return(-1);
+   for (i=0; i<(*squidarr_used); i++) {
+      if (squidset_add(&set, squidarr[i]) < 0) {
+         squidset_free(&set);
+         return(-1);
+      }
+   }
+   if (((nthread == 1) ? wcs_squidsample(projection, wcs, cdelt, naxes, k, &set) : wcs_squidsample_omp(projection, wcs, cdelt, naxes, k, nthread, &set)) < 0) {
+      squidset_free(&set);
+      return(-1);
+   }
+   if (squidset_copy(&set, sorted, squidarr, squidarr_len, squidarr_used) < 0) {
+      squidset_free(&set);
+      return(-1);
+   }
+   squidset_free(&set);
+
+   return(0);
+}
+
 // Get array of squid ids at k that are within image
 // squidarr should be pre-allocated with size squidarr_len
 // When starting from zero, squidarr_used is number of ids found
 int wcs_getsquids(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+
+   return(wcs_getsquids_set(projection, wcs, cdelt, naxes, k, 0, 1, squidarr, squidarr_len, squidarr_used));
+}
+
+// Same as wcs_getsquids, but squidarr is returned sorted in ascending order
+int wcs_getsquids_sorted(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+
+   return(wcs_getsquids_set(projection, wcs, cdelt, naxes, k, 1, 1, squidarr, squidarr_len, squidarr_used));
+}
+
+// Same as wcs_getsquids_sorted, with the image samples split over nthread
+// threads (nthread <= 0 uses the OpenMP default).  Each thread works on a
+// private clone of wcs, but wcs itself is prepared with wcsset first, so
+// it must not be in use by other threads during the call.  The output is
+// sorted and identical to wcs_getsquids_sorted.  Without OpenMP this runs
+// serially.
+int wcs_getsquids_omp(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, int nthread, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+
+   return(wcs_getsquids_set(projection, wcs, cdelt, naxes, k, 1, nthread, squidarr, squidarr_len, squidarr_used));
+}
+
+// Add squid of cell ix,iy on a face gridded at resolution k to set
+static int face_addcell(int projection, int face, int k, long N, long ix, long iy, struct squid_set *set) {
+   double ra,dec; // cell center
+   squid_type squid;
+
+   if ((ix < 0)||(ix >= N)||(iy < 0)||(iy >= N)) return(0);
+   if (xyf2sph(projection, (ix+0.5)/N, (iy+0.5)/N, face, &ra, &dec) < 0) {
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "face_addcell", "xyf2sph failed");
+      return(-1);
+   }
+   if (sph2squid(projection, ra, dec, k, &squid) < 0) {
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "face_addcell", "sph2squid failed");
+      return(-1);
+   }
+   if (squidset_add(set, squid) < 0) return(-1);
+
+   return(0);
+}
+
+// Add every face grid cell touched by the segment x0,y0 to x1,y1 to set.
+// Coordinates are in cells, walked with a supercover DDA so a segment
+// passing exactly through a cell corner adds both neighbouring cells.
+static int face_addline(int projection, int face, int k, long N, double x0, double y0, double x1, double y1, struct squid_set *set) {
+   long ix,iy,ix1,iy1; // current and final cell
+   long sx,sy; // cell steps
+   double tdx,tdy,tmx,tmy; // DDA parameters
+   long nstep; // guard
+
+   ix=(long)floor(x0);
+   iy=(long)floor(y0);
+   ix1=(long)floor(x1);
+   iy1=(long)floor(y1);
+   sx=(x1 > x0) ? 1 : -1;
+   sy=(y1 > y0) ? 1 : -1;
+   tdx=(x1 != x0) ? fabs(1.0/(x1-x0)) : HUGE_VAL;
+   tdy=(y1 != y0) ? fabs(1.0/(y1-y0)) : HUGE_VAL;
+   tmx=(x1 != x0) ? ((sx > 0) ? (ix+1-x0) : (x0-ix))*tdx : HUGE_VAL;
+   tmy=(y1 != y0) ? ((sy > 0) ? (iy+1-y0) : (y0-iy))*tdy : HUGE_VAL;
+
+   if (face_addcell(projection, face, k, N, ix, iy, set) < 0) return(-1);
+   nstep=labs(ix1-ix)+labs(iy1-iy);
+   while (((ix != ix1)||(iy != iy1)) && (nstep-- > 0)) {
+      if (tmx < tmy) {
+         ix=ix+sx;
+         tmx=tmx+tdx;
+      } else if (tmy < tmx) {
+         iy=iy+sy;
+         tmy=tmy+tdy;
+      } else {
+         if (face_addcell(projection, face, k, N, ix+sx, iy, set) < 0) return(-1);
+         if (face_addcell(projection, face, k, N, ix, iy+sy, set) < 0) return(-1);
+         ix=ix+sx;
+         iy=iy+sy;
+         tmx=tmx+tdx;
+         tmy=tmy+tdy;
+         nstep--;
+      }
+      if (face_addcell(projection, face, k, N, ix, iy, set) < 0) return(-1);
+   }
+
+   return(0);
+}
+
+// Even-odd test for point x,y inside polygon px[],py[] of n vertices
+static int poly_inside(long n, const double *px, const double *py, double x, double y) {
+   long i,j;
+   int in;
+
+   in=0;
+   for (i=0, j=n-1; i<n; j=i++) {
+      if (((py[i] > y) != (py[j] > y)) &&
+          (x < (px[j]-px[i])*(y-py[i])/(py[j]-py[i])+px[i])) in=!in;
+   }
+
+   return(in);
+}
+
+// Number of boundary samples per image side that wcs_getsquids_poly
+// starts from before refining
+#define POLY_MINSAMP 4
+
+// Largest distance in tiles between the projected outline and its chords
+// in wcs_getsquids_poly.  Chords are walked with this margin on both sides.
+#define POLY_TOL 0.01
+
+// Outline segments of wcs_getsquids_poly are not split below this length
+// in image pixels, the resolution of the wcs_getsquids pixel walk
+#define POLY_MINSEG 1.0
+
+// Deepest bisection of one initial outline segment
+#define POLY_MAXDEPTH 24
+
+// Projected image outline of wcs_getsquids_poly, in face cell coords
+struct poly_outline {
+   struct wcsprm *wcs;
+   struct squid_set *set; // gets the squid of every sample
+   int projection;
+   int k;
    double N; // Nside
-   double omega; // healpix width in deg
-   double step; // step size
-   double x,y; // img coords
+   int face; // face of the first sample
+   double *px, *py; // outline points
+   long n, nalloc;
+};
+
+// Project image point x,y to face cell coords fx,fy and add its squid to
+// the set.  Returns 0, 1 if the point is not on the face of the first
+// sample, or -1 on failure.
+static int poly_sample(struct poly_outline *ol, double x, double y, double *fx, double *fy) {
+   double ra,dec;
+   squid_type squid;
+   int face;
+
+   if (0 != wcs_pix2rd(ol->wcs, x, y, &ra, &dec)) return(-1);
+   ra=fmod(ra*DD2R+2*PI,2*PI);
+   dec=dec*DD2R;
+   if ((0 != sph2squid(ol->projection, ra, dec, ol->k, &squid))||(squidset_add(ol->set, squid) < 0)) {
+      return(squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "wcs_getsquids_poly", "sph2squid failed"));
+   }
+   if (sph2xyf(ol->projection, ra, dec, fx, fy, &face) < 0) {
+      return(squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "wcs_getsquids_poly", "sph2xyf failed"));
+   }
+   if (ol->face < 0) ol->face=face;
+   if (face != ol->face) return(1);
+   *fx=*fx*ol->N;
+   *fy=*fy*ol->N;
+
+   return(0);
+}
+
+// Append point fx,fy to the outline
+static int poly_append(struct poly_outline *ol, double fx, double fy) {
+   double *p;
+   long nalloc;
+
+   if (ol->n == ol->nalloc) {
+      nalloc=2*ol->nalloc+16;
+      if ((p=(double *)realloc(ol->px, nalloc*sizeof(double))) == NULL) goto fail;
+      ol->px=p;
+      if ((p=(double *)realloc(ol->py, nalloc*sizeof(double))) == NULL) goto fail;
+      ol->py=p;
+      ol->nalloc=nalloc;
+      SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_GETSQUIDS_POLY);
+   }
+   ol->px[ol->n]=fx;
+   ol->py[ol->n]=fy;
+   ol->n++;
+
+   return(0);
+
+fail:
+   return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcs_getsquids_poly", "realloc failed"));
+}
+
+// Append the points between image points a and b (face coords fa, fb,
+// both excluded) needed to keep the chords within POLY_TOL tiles of the
+// projected outline, bisecting in image coords.  Returns as poly_sample.
+static int poly_refine(struct poly_outline *ol, double xa, double ya, double fxa, double fya,
+      double xb, double yb, double fxb, double fyb, int depth) {
+   double xm,ym,fxm,fym;
+   int ret;
+
+   if ((depth >= POLY_MAXDEPTH)||(hypot(xb-xa, yb-ya) <= POLY_MINSEG)) return(0);
+   xm=0.5*(xa+xb);
+   ym=0.5*(ya+yb);
+   if ((ret=poly_sample(ol, xm, ym, &fxm, &fym)) != 0) return(ret);
+   if (hypot(fxm-0.5*(fxa+fxb), fym-0.5*(fya+fyb)) <= POLY_TOL) return(0);
+   if ((ret=poly_refine(ol, xa, ya, fxa, fya, xm, ym, fxm, fym, depth+1)) != 0) return(ret);
+   if (poly_append(ol, fxm, fym) < 0) return(-1);
+
+   return(poly_refine(ol, xm, ym, fxm, fym, xb, yb, fxb, fyb, depth+1));
+}
+
+// Get array of squid ids at k that are within image, like
+// wcs_getsquids_sorted, but from the image outline instead of a pixel walk.
+// Only the image boundary is projected: POLY_MINSAMP points per side,
+// bisected until the chords stay within POLY_TOL tiles of the projected
+// outline.  The number of transforms depends on the curvature of the
+// outline in tiles, not on the number of image pixels.  If the whole
+// outline falls on one face it is rasterized onto the face grid: tiles
+// crossed by the outline are found by walking each chord, and its copies
+// shifted POLY_TOL to either side, through the grid, and the rest by
+// testing tile centers against the outline.  Images that cross a face
+// boundary fall back to wcs_getsquids_sorted.
+// squidarr is returned sorted in ascending order.
+int wcs_getsquids_poly(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int k, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+   struct squid_set set;
+   struct poly_outline ol;
+   double *px,*py; // outline in face cell coords
+   double cx[4],cy[4]; // image corners
+   double x0,y0,fx0,fy0; // first sample
+   double xa,ya,fxa,fya,x,y,fx,fy,nx,ny,d;
+   double xmin,xmax,ymin,ymax;
+   long i,j,np,ix,iy;
+   int side,ret=0;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_GETSQUIDS_POLY);
 
    // Test for NULL counter
    if (NULL == squidarr_used) {
-      fprintf(stderr, "NULL counter (NULL == squidarr_used) in wcs_getsquids\n");
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "wcs_getsquids_poly", "NULL counter");
       return(-1);
    }
 
    // Test for full array
    if (squidarr_len <= (*squidarr_used)) {
-      fprintf(stderr, "Full array (%li <= %li) (squidarr_len <= (*squidarr_used)) in wcs_getsquids\n", squidarr_len, (*squidarr_used));
+      squidwcs_error(SQUIDWCS_ERR_FULL, 0, "wcs_getsquids_poly", "array full");
       return(-1);
    }
 
-   N=pow(2,(double)k);
-   omega=90.0/N; // in degrees
-   step=floor(omega/(4*cdelt));
-   //printf("omega=%.3f step=%.3f\n",omega,step);
-
-   // first search all pix on edge of image
-   x=0;
-   for (y=0; y<naxes[1]; y=y+1) {
-      if (0 != wcs_addsquid(projection, wcs, k, x, y, squidarr, squidarr_len, squidarr_used)) {
-         fprintf(stderr, "wcs_addsquid failed in wcs_getsquids\n");
-         return(-1);
+   cx[0]=0;          cy[0]=0;
+   cx[1]=naxes[0]-1; cy[1]=0;
+   cx[2]=naxes[0]-1; cy[2]=naxes[1]-1;
+   cx[3]=0;          cy[3]=naxes[1]-1;
+   if (squidset_init(&set) < 0) return(-1);
+   memset(&ol, 0, sizeof(struct poly_outline));
+   ol.wcs=wcs;
+   ol.set=&set;
+   ol.projection=projection;
+   ol.k=k;
+   ol.N=pow(2,(double)k);
+   ol.face=-1;
+   for (i=0; i<(*squidarr_used); i++) {
+      if (squidset_add(&set, squidarr[i]) < 0) goto fail;
+   }
+
+   // project outline, keeping the squid of every sample as well
+   x0=cx[0];
+   y0=cy[0];
+   if ((ret=poly_sample(&ol, x0, y0, &fx0, &fy0)) != 0) goto sampled;
+   if ((ret=poly_append(&ol, fx0, fy0)) < 0) goto fail;
+   xa=x0;
+   ya=y0;
+   fxa=fx0;
+   fya=fy0;
+   for (side=0; side<4; side++) {
+      for (i=1; i<=POLY_MINSAMP; i++) {
+         x=cx[side]+(cx[(side+1)%4]-cx[side])*i/(double)POLY_MINSAMP;
+         y=cy[side]+(cy[(side+1)%4]-cy[side])*i/(double)POLY_MINSAMP;
+         if ((side == 3)&&(i == POLY_MINSAMP)) {
+            // back to the first sample
+            ret=poly_refine(&ol, xa, ya, fxa, fya, x0, y0, fx0, fy0, 0);
+            if (ret != 0) goto sampled;
+            break;
+         }
+         if ((ret=poly_sample(&ol, x, y, &fx, &fy)) != 0) goto sampled;
+         if ((ret=poly_refine(&ol, xa, ya, fxa, fya, x, y, fx, fy, 0)) != 0) goto sampled;
+         if ((ret=poly_append(&ol, fx, fy)) < 0) goto fail;
+         xa=x;
+         ya=y;
+         fxa=fx;
+         fya=fy;
       }
    }
-   x=naxes[0]-1;
-   for (y=0; y<naxes[1]; y=y+1) {
-      if (0 != wcs_addsquid(projection, wcs, k, x, y, squidarr, squidarr_len, squidarr_used)) {
-         fprintf(stderr, "wcs_addsquid failed in wcs_getsquids\n");
-         return(-1);
+sampled:
+   if (ret < 0) goto fail;
+   if (ret > 0) {
+      // outline crosses a face boundary, sample the image instead
+      squidset_free(&set);
+      free(ol.px);
+      free(ol.py);
+      return(wcs_getsquids_sorted(projection, wcs, cdelt, naxes, k, squidarr, squidarr_len, squidarr_used));
+   }
+   np=ol.n;
+   px=ol.px;
+   py=ol.py;
+
+   // tiles crossed by the outline, within POLY_TOL of each chord
+   for (i=0, j=np-1; i<np; j=i++) {
+      d=hypot(px[i]-px[j], py[i]-py[j]);
+      nx=(d > 0.0) ? -POLY_TOL*(py[i]-py[j])/d : 0.0;
+      ny=(d > 0.0) ? POLY_TOL*(px[i]-px[j])/d : 0.0;
+      for (side=-1; side<=1; side++) {
+         if (face_addline(projection, ol.face, k, (long)ol.N, px[j]+side*nx, py[j]+side*ny,
+               px[i]+side*nx, py[i]+side*ny, &set) < 0) goto fail;
+      }
+   }
+
+   // tiles with centers inside the outline
+   xmin=xmax=px[0];
+   ymin=ymax=py[0];
+   for (i=1; i<np; i++) {
+      if (px[i] < xmin) xmin=px[i];
+      if (px[i] > xmax) xmax=px[i];
+      if (py[i] < ymin) ymin=py[i];
+      if (py[i] > ymax) ymax=py[i];
+   }
+   for (iy=(long)floor(ymin); iy<=(long)floor(ymax); iy++) {
+      for (ix=(long)floor(xmin); ix<=(long)floor(xmax); ix++) {
+         if (!poly_inside(np, px, py, ix+0.5, iy+0.5)) continue;
+         if (face_addcell(projection, ol.face, k, (long)ol.N, ix, iy, &set) < 0) goto fail;
+      }
+   }
+
+   if (squidset_copy(&set, 1, squidarr, squidarr_len, squidarr_used) < 0) goto fail;
+   squidset_free(&set);
+   free(ol.px);
+   free(ol.py);
+
+   return(0);
+
+fail:
+   squidset_free(&set);
+   free(ol.px);
+   free(ol.py);
+   return(-1);
+}
+
+// Get face and face grid cell of squid at resolution k
+static int squid_facecell(int projection, squid_type squid, int k, int *face, long *ix, long *iy) {
+   double ra,dec,fx,fy;
+   long N;
+
+   N=1L << k;
+   if ((squid2sph(projection, squid, &ra, &dec) < 0)||
+       (sph2xyf(projection, ra, dec, &fx, &fy, face) < 0)) {
+      return(squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "squid_facecell", "squid2sph/sph2xyf failed"));
+   }
+   *ix=(long)floor(fx*N);
+   *iy=(long)floor(fy*N);
+   if (*ix >= N) *ix=N-1;
+   if (*iy >= N) *iy=N-1;
+
+   return(0);
+}
+
+// Test if segments a0-a1 and b0-b1 intersect
+static int seg_cross(double ax0, double ay0, double ax1, double ay1, double bx0, double by0, double bx1, double by1) {
+   double d1,d2,d3,d4;
+
+   d1=(bx1-bx0)*(ay0-by0)-(by1-by0)*(ax0-bx0);
+   d2=(bx1-bx0)*(ay1-by0)-(by1-by0)*(ax1-bx0);
+   d3=(ax1-ax0)*(by0-ay0)-(ay1-ay0)*(bx0-ax0);
+   d4=(ax1-ax0)*(by1-ay0)-(ay1-ay0)*(bx1-ax0);
+
+   return((((d1 > 0) != (d2 > 0)) || (d1 == 0) || (d2 == 0)) &&
+          (((d3 > 0) != (d4 > 0)) || (d3 == 0) || (d4 == 0)));
+}
+
+// Number of outline samples per tile side used to classify tiles
+#define MOC_TILESAMP 4
+
+// Overlap of tile with image, found by projecting the tile outline into
+// image pixel coords.  Outline samples the image projection cannot reach
+// make the tile partial; if none can be reached the tile only overlaps when
+// it holds the image, which is tested with the image corners.
+// Returns 2 if the tile is inside the image, 1 if it partially overlaps,
+// 0 if it misses it and -1 on failure.
+static int tile_overlap(int projection, struct wcsprm *wcs, long naxes[], squid_type squid, int k) {
+   double tx[4*MOC_TILESAMP],ty[4*MOC_TILESAMP]; // tile outline in img pix
+   double cx[4],cy[4]; // image corners
+   double fx,fy,ra,dec;
+   long ix,iy,N;
+   int face,side,i,j,n,nin,nbad;
+   squid_type csquid; // squid of an image corner
+
+   if (squid_facecell(projection, squid, k, &face, &ix, &iy) < 0) return(-1);
+   N=1L << k;
+   cx[0]=0;          cy[0]=0;
+   cx[1]=naxes[0]-1; cy[1]=0;
+   cx[2]=naxes[0]-1; cy[2]=naxes[1]-1;
+   cx[3]=0;          cy[3]=naxes[1]-1;
+
+   // tile outline, counter-clockwise on the face
+   n=0;
+   nin=0;
+   nbad=0;
+   for (side=0; side<4; side++) {
+      for (i=0; i<MOC_TILESAMP; i++) {
+         fx=(double)i/MOC_TILESAMP;
+         if (side == 0) { fy=0.0; }
+         else if (side == 1) { fy=fx; fx=1.0; }
+         else if (side == 2) { fy=1.0; fx=1.0-fx; }
+         else { fy=1.0-fx; fx=0.0; }
+         if (xyf2sph(projection, (ix+fx)/N, (iy+fy)/N, face, &ra, &dec) < 0) return(-1);
+         if (0 != wcs_rd2pix(wcs, ra/DD2R, dec/DD2R, &tx[n], &ty[n])) {
+            // outline leaves the image projection
+            nbad++;
+            continue;
+         }
+         if ((tx[n] >= cx[0])&&(tx[n] <= cx[2])&&(ty[n] >= cy[0])&&(ty[n] <= cy[2])) nin++;
+         n++;
+      }
+   }
+   if (nbad > 0) {
+      if (n > 0) return(1);
+      // whole outline off the projection, the tile can still hold the image
+      for (i=0; i<4; i++) {
+         if ((wcs_pix2squid(projection, wcs, k, cx[i], cy[i], &csquid) == 0)&&(csquid == squid)) return(1);
+      }
+      return(0);
+   }
+   if (nin == n) return(2);
+   if (nin > 0) return(1);
+
+   // image corner inside tile, or outlines crossing
+   for (i=0; i<4; i++) {
+      if (poly_inside(n, tx, ty, cx[i], cy[i])) return(1);
+   }
+   for (i=0; i<n; i++) {
+      for (j=0; j<4; j++) {
+         if (seg_cross(tx[i], ty[i], tx[(i+1)%n], ty[(i+1)%n], cx[j], cy[j], cx[(j+1)%4], cy[(j+1)%4])) return(1);
       }
    }
-   y=0;
-   for (x=0; x<naxes[0]; x=x+1) {
-      if (0 != wcs_addsquid(projection, wcs, k, x, y, squidarr, squidarr_len, squidarr_used)) {
-         fprintf(stderr, "wcs_addsquid failed in wcs_getsquids\n");
+
+   return(0);
+}
+
+// Classify squid at k and recurse into the children of partial tiles
+static int moc_addsquid(int projection, struct wcsprm *wcs, long naxes[], squid_type squid, int k, int kmax, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+   double ra,dec;
+   squid_type child;
+   long ix,iy,N;
+   int face,ov,i;
+
+   if ((ov=tile_overlap(projection, wcs, naxes, squid, k)) < 0) return(-1);
+   if (ov == 0) return(0);
+   if ((ov == 2)||(k >= kmax)) {
+      if (squidarr_len <= (*squidarr_used)) {
+         squidwcs_error(SQUIDWCS_ERR_FULL, 0, "wcs_getsquids_moc", "array full");
          return(-1);
       }
+      squidarr[(*squidarr_used)]=squid;
+      ++(*squidarr_used);
+      return(0);
    }
-   y=naxes[1]-1;
-   for (x=0; x<naxes[0]; x=x+1) {
-      if (0 != wcs_addsquid(projection, wcs, k, x, y, squidarr, squidarr_len, squidarr_used)) {
-         fprintf(stderr, "wcs_addsquid failed in wcs_getsquids\n");
+
+   // partial tile, go through the 4 children at k+1
+   if (squid_facecell(projection, squid, k, &face, &ix, &iy) < 0) return(-1);
+   N=1L << (k+1);
+   for (i=0; i<4; i++) {
+      if (xyf2sph(projection, (2*ix+(i & 1)+0.5)/N, (2*iy+(i >> 1)+0.5)/N, face, &ra, &dec) < 0) {
+         squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "wcs_getsquids_moc", "xyf2sph failed");
+         return(-1);
+      }
+      if (sph2squid(projection, ra, dec, k+1, &child) < 0) {
+         squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "wcs_getsquids_moc", "sph2squid failed");
          return(-1);
       }
+      if (moc_addsquid(projection, wcs, naxes, child, k+1, kmax, squidarr, squidarr_len, squidarr_used) < 0) return(-1);
    }
 
-   // now search grid in interior
-   for (y=0; y<naxes[1]; y=y+step) {
-      for (x=0; x<naxes[0]; x=x+step) {
-         if (0 != wcs_addsquid(projection, wcs, k, x, y, squidarr, squidarr_len, squidarr_used)) {
-            fprintf(stderr, "wcs_addsquid failed in wcs_getsquids\n");
-            return(-1);
-         }
+   return(0);
+}
+
+// Get multi-resolution coverage of image from kmin down to kmax.
+// Tiles found by wcs_getsquids_poly at kmin are classified against the
+// image outline: tiles inside the image are kept at their resolution,
+// tiles partially covered are split into their 4 children at k+1 down to
+// kmax, where partial tiles are kept as well.  The result is a compact
+// set of squids of mixed resolution (use squid_getres) with fully covered
+// parents standing in for all their children.
+// squidarr is overwritten and returned sorted in ascending order.
+int wcs_getsquids_moc(int projection, struct wcsprm *wcs, double cdelt, long naxes[], int kmin, int kmax, squid_type squidarr[], long squidarr_len, long *squidarr_used) {
+   squid_type *top; // coverage at kmin
+   long ntop,i;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_GETSQUIDS_MOC);
+
+   // Test for NULL counter
+   if (NULL == squidarr_used) {
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "wcs_getsquids_moc", "NULL counter");
+      return(-1);
+   }
+   if ((kmin < 0)||(kmax < kmin)) {
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "wcs_getsquids_moc", "invalid kmin or kmax");
+      return(-1);
+   }
+
+   // start from the tiles at kmin
+   top=(squid_type *)malloc(squidarr_len*sizeof(squid_type));
+   if (top == NULL) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcs_getsquids_moc", "malloc failed");
+      return(-1);
+   }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_GETSQUIDS_MOC);
+   ntop=0;
+   if (wcs_getsquids_poly(projection, wcs, cdelt, naxes, kmin, top, squidarr_len, &ntop) < 0) {
+      free(top);
+      return(-1);
+   }
+
+   *squidarr_used=0;
+   for (i=0; i<ntop; i++) {
+      if (moc_addsquid(projection, wcs, naxes, top[i], kmin, kmax, squidarr, squidarr_len, squidarr_used) < 0) {
+         free(top);
+         return(-1);
       }
    }
+   free(top);
+   qsort(squidarr, *squidarr_used, sizeof(squid_type), squid_cmp);
 
    return(0);
 }
 
 // Get wcs struct for a given squid for any tside
 // Here tside is the number of pixels per side of the tile.
+// The wcs struct is allocated here, free it with wcs_free.
 int tile_getwcs(int projection, squid_type squid, squid_type tside, struct wcsprm **wcs) {
+   struct tile_wcsparam tparam; // tile wcs parameters
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_TILE_GETWCS);
+
+   if (tile_getwcsparam(projection, squid, tside, &tparam) == -1) {
+      return(-1);
+   }
+   if (tile_wcsparam2wcs(&tparam, wcs) == -1) {
+      return(-1);
+   }
+
+   return(0);
+}
+
+// Get wcs parameters for a given squid for any tside
+// Here tside is the number of pixels per side of the tile.
+int tile_getwcsparam(int projection, squid_type squid, squid_type tside, struct tile_wcsparam *tparam) {
    double ra,dec;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_TILE_GETWCSPARAM);
 
    // Make sure squid is valid
    if (squid_validate(squid) == 0) {
-      fprintf(stderr,"invalid squid argument in tile_getwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "tile_getwcsparam", "invalid squid argument");
       return(-1);
    }
 
    squid2sph(projection,squid,&ra,&dec);
    if ((projection == TSC)||(projection == CSC)||(projection == QSC)) {
-      if (quadcube_getwcs(projection, squid, tside, wcs) == -1) {
-         fprintf(stderr,"quadcube_getwcs failed in tile_getwcs\n");
+      if (quadcube_getwcsparam(projection, squid, tside, tparam) == -1) {
          return(-1);
       }
    } else if (projection == HSC) {
       if (fabs(dec) < THETAX) {
-         if (hsc_getwcs_equator(squid, tside, wcs) == -1) {
-            fprintf(stderr,"hsc_getwcs_equator failed in tile_getwcs\n");
+         if (hsc_getwcsparam_equator(squid, tside, tparam) == -1) {
             return(-1);
          }
       } else {
-         if (hsc_getwcs_pole(squid, tside, wcs) == -1) {
-            fprintf(stderr,"hsc_getwcs_pole failed in tile_getwcs\n");
+         if (hsc_getwcsparam_pole(squid, tside, tparam) == -1) {
             return(-1);
          }
       }
    } else {
-      fprintf(stderr,"unknown projection in tile_getwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "tile_getwcsparam", "unknown projection");
+      return(-1);
+   }
+
+   return(0);
+}
+
+// Create a wcs struct directly from tile wcs parameters with wcsini and
+// wcsset, without going through a fits header string.
+// The wcs struct is allocated here, free it with wcs_free.
+int tile_wcsparam2wcs(struct tile_wcsparam *tparam, struct wcsprm **wcs) {
+   struct wcsprm *wcs0; // temp wcs pointer
+   int status; // output from wcslib
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_TILE_WCSPARAM2WCS);
+
+   wcs0=(struct wcsprm *)malloc(sizeof(struct wcsprm));
+   if (wcs0 == NULL) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "tile_wcsparam2wcs", "malloc failed");
       return(-1);
    }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_TILE_WCSPARAM2WCS);
+   wcs0->flag=-1;
+   if ((status=wcsini(1, 2, wcs0))) {
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_TILE_WCSPARAM2WCS);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "tile_wcsparam2wcs", "wcsini failed");
+      free(wcs0);
+      return(-1);
+   }
+   strcpy(wcs0->ctype[0], tparam->ctype1);
+   strcpy(wcs0->ctype[1], tparam->ctype2);
+   wcs0->crval[0]=tparam->crval1;
+   wcs0->crval[1]=tparam->crval2;
+   wcs0->crpix[0]=tparam->crpix1;
+   wcs0->crpix[1]=tparam->crpix2;
+   wcs0->cdelt[0]=tparam->cdelt1;
+   wcs0->cdelt[1]=tparam->cdelt2;
+   wcs0->pc[0]=tparam->pc11;
+   wcs0->pc[1]=tparam->pc12;
+   wcs0->pc[2]=tparam->pc21;
+   wcs0->pc[3]=tparam->pc22;
+   wcs0->altlin=1; // PCi_j given
+   wcs0->lonpole=tparam->lonpole;
+   wcs0->latpole=tparam->latpole;
+   if ((status=wcsset(wcs0))) {
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_TILE_WCSPARAM2WCS);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "tile_wcsparam2wcs", "wcsset failed");
+      wcs_free(wcs0);
+      return(-1);
+   }
+   *wcs=wcs0;
 
    return(0);
 }
 
+// Free a wcs struct created by tile_getwcs or a single wcs from wcspih
+void wcs_free(struct wcsprm *wcs) {
+
+   if (wcs == NULL) return;
+   wcsfree(wcs);
+   free(wcs);
+}
 
 // Get quadcube projection wcs struct for a given squid for any tside.
 // Here tside is the number of pixels per side of the tile.
 // This works for TSC, CSC, and QSC, but not HSC.
 int quadcube_getwcs(int projection, squid_type squid, squid_type tside, struct wcsprm **wcs) {
-   struct wcsprm *wcs0; // temp wcs pointer
+   struct tile_wcsparam tparam; // tile wcs parameters
+
+   if (quadcube_getwcsparam(projection, squid, tside, &tparam) == -1) return(-1);
+
+   return(tile_wcsparam2wcs(&tparam, wcs));
+}
+
+// Get quadcube projection wcs parameters for a given squid for any tside.
+int quadcube_getwcsparam(int projection, squid_type squid, squid_type tside, struct tile_wcsparam *tparam) {
    double pc11,pc12,pc21,pc22; //wcs rotation parameters
    double wx,wy,wxr,wyr; // world wcs pix coords
    double rac,decc; // img center coords
    double crval1,crval2,cdelt1,cdelt2,crpix1,crpix2;
-   char fithdr[HDR_MAXLEN];
-   char naxis1card[81],naxis2card[81];
-   char ctype1card[81],ctype2card[81];
-   char crval1card[81],crpix1card[81],cdelt1card[81];
-   char crval2card[81],crpix2card[81],cdelt2card[81];
-   char pc11card[81],pc12card[81],pc21card[81],pc22card[81];
-   int status, nreject, nwcs; // output from wcslib
    int k, face; // squid resolution, quadcube face number
    double rot; // image rotation in deg
    long latpole,lonpole; // pole of ref coord system
-   char latpolecard[81],lonpolecard[81]; // header cards
    double fx, fy; // face xy coords (goes from 0 to 1 across face)
    double fxx, fyy; // same as fx,fy but goes from -45 to 45 across face
 
    // get center coords
    if ((k=squid_getres(squid)) < 0) {
-      fprintf(stderr,"squid_getres failed in quadcube_getwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "quadcube_getwcsparam", "squid_getres failed");
       return(-1);
    }
    if (squid2sph(projection,squid,&rac,&decc) < 0) {
-      fprintf(stderr,"squid2sph failed in quadcube_getwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "quadcube_getwcsparam", "squid2sph failed");
       return(-1);
    }
    if (sph2xyf(projection, rac, decc, &fx, &fy, &face) < 0) {
-      fprintf(stderr,"sph2xyf failed in quadcube_getwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "quadcube_getwcsparam", "sph2xyf failed");
       return(-1);
    }
 
@@ -252,7 +1072,7 @@ int quadcube_getwcs(int projection, squid_type squid, squid_type tside, struct w
       wx=fxx;
       wy=fyy-90.0;
    } else {
-      fprintf(stderr,"invalid face in quadcube_getwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "quadcube_getwcsparam", "invalid face");
       return(-1);
    }
    wxr=pc11*wx+pc12*wy;
@@ -264,65 +1084,33 @@ int quadcube_getwcs(int projection, squid_type squid, squid_type tside, struct w
    crpix1=((double)tside/2.0)-(wxr/cdelt1);
    crpix2=((double)tside/2.0)-(wyr/cdelt2);
 
-   // set up variable header strings
-   sprintf(naxis1card,"NAXIS1  = %20ld / length of axis 1                               ",(long)tside); 
-   sprintf(naxis2card,"NAXIS2  = %20ld / length of axis 2                               ",(long)tside);
+   // fill in parameters
    if (projection == TSC) {
-      sprintf(ctype1card,"CTYPE1  = 'RA---TSC'           / Tangental Spherical Cube RA                    ");   
-      sprintf(ctype2card,"CTYPE2  = 'DEC--TSC'           / Tangental Spherical Cube DEC                   ");   
+      strcpy(tparam->ctype1,"RA---TSC");
+      strcpy(tparam->ctype2,"DEC--TSC");
    } else if (projection == CSC) {
-      sprintf(ctype1card,"CTYPE1  = 'RA---CSC'           / COBE Spherical Cube RA                         ");   
-      sprintf(ctype2card,"CTYPE2  = 'DEC--CSC'           / COBE Spherical Cube DEC                        ");   
+      strcpy(tparam->ctype1,"RA---CSC");
+      strcpy(tparam->ctype2,"DEC--CSC");
    } else if (projection == QSC) {
-      sprintf(ctype1card,"CTYPE1  = 'RA---QSC'           / Quadrilateral Spherical Cube RA                ");   
-      sprintf(ctype2card,"CTYPE2  = 'DEC--QSC'           / Quadrilateral Spherical Cube DEC               ");   
+      strcpy(tparam->ctype1,"RA---QSC");
+      strcpy(tparam->ctype2,"DEC--QSC");
    } else {
-      fprintf(stderr,"unrecognized projection for quadcube_getwcs\n");
-      return(-1);
-   }
-   sprintf(crval1card,"CRVAL1  = %20.15f / ref world                                      ",crval1);
-   sprintf(crpix1card,"CRPIX1  = %20.12f / ref pix                                        ",crpix1);
-   sprintf(cdelt1card,"CDELT1  = %20.15f / deg/pix                                        ",cdelt1);
-   sprintf(crval2card,"CRVAL2  = %20.15f / ref world                                      ",crval2);
-   sprintf(crpix2card,"CRPIX2  = %20.12f / ref pix                                        ",crpix2);
-   sprintf(cdelt2card,"CDELT2  = %20.15f / deg/pix                                        ",cdelt2);
-   sprintf(pc11card,"PC1_1   = %20.15f / rotation matrix                                ",pc11);
-   sprintf(pc12card,"PC1_2   = %20.15f / rotation matrix                                ",pc12);
-   sprintf(pc21card,"PC2_1   = %20.15f / rotation matrix                                ",pc21);
-   sprintf(pc22card,"PC2_2   = %20.15f / rotation matrix                                ",pc22);
-   sprintf(lonpolecard,"LONPOLE = %20ld / native lon of pole                             ",lonpole);
-   sprintf(latpolecard,"LATPOLE = %20ld / native lat of pole                             ",latpole);
-
-   // create fithdr string
-   fithdr[0]='\0';
-   strncat(fithdr,"SIMPLE  =                    T / file does conform to FITS standard             ",81);   
-   strncat(fithdr,"BITPIX  =                   16 / number of bits per data pixel                  ",81);   
-   strncat(fithdr,"NAXIS   =                    2 / number of data axes                            ",81);   
-   strncat(fithdr,naxis1card,81);   
-   strncat(fithdr,naxis2card,81);
-   strncat(fithdr,"EXTEND  =                    T / FITS dataset may contain extensions            ",81);   
-   strncat(fithdr,ctype1card,81);   
-   strncat(fithdr,crval1card,81);   
-   strncat(fithdr,crpix1card,81);   
-   strncat(fithdr,cdelt1card,81);   
-   strncat(fithdr,ctype2card,81);   
-   strncat(fithdr,crval2card,81);   
-   strncat(fithdr,crpix2card,81);   
-   strncat(fithdr,cdelt2card,81);   
-   strncat(fithdr,pc11card,81);   
-   strncat(fithdr,pc12card,81);   
-   strncat(fithdr,pc21card,81);   
-   strncat(fithdr,pc22card,81);   
-   strncat(fithdr,latpolecard,81);   
-   strncat(fithdr,lonpolecard,81);   
-   strncat(fithdr,"END                                                                             ",81);   
-
-   // Interpret the WCS keywords to create wcs struct
-   if ((status = wcspih(fithdr, 21, WCSHDR_all, -3, &nreject, &nwcs, &wcs0))) {
-      fprintf(stderr, "wcspih ERROR %d: %s.\n", status, wcshdr_errmsg[status]);
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "quadcube_getwcsparam", "unrecognized projection");
       return(-1);
    }
-   *wcs=wcs0;
+   tparam->tside=tside;
+   tparam->crval1=crval1;
+   tparam->crval2=crval2;
+   tparam->crpix1=crpix1;
+   tparam->crpix2=crpix2;
+   tparam->cdelt1=cdelt1;
+   tparam->cdelt2=cdelt2;
+   tparam->pc11=pc11;
+   tparam->pc12=pc12;
+   tparam->pc21=pc21;
+   tparam->pc22=pc22;
+   tparam->lonpole=lonpole;
+   tparam->latpole=latpole;
 
    return(0);
 
@@ -331,19 +1119,20 @@ int quadcube_getwcs(int projection, squid_type squid, squid_type tside, struct w
 // Get HSC projection wcs struct for a given squid for any tside
 // Here tside is the number of pixels per side of the tile.
 int hsc_getwcs_pole(squid_type squid, squid_type tside, struct wcsprm **wcs) {
-   struct wcsprm *wcs0; // temp wcs pointer
+   struct tile_wcsparam tparam; // tile wcs parameters
+
+   if (hsc_getwcsparam_pole(squid, tside, &tparam) == -1) return(-1);
+
+   return(tile_wcsparam2wcs(&tparam, wcs));
+}
+
+// Get HSC projection wcs parameters for a polar squid for any tside
+int hsc_getwcsparam_pole(squid_type squid, squid_type tside, struct tile_wcsparam *tparam) {
    double pc11,pc12,pc21,pc22; //wcs rotation parameters
    double wx,wy,wxf,wyf;
    double xc,yc,rac,decc; // img center coords
    double crrot; // rotation angle for crval1
    double crval1,crval2,cdelt1,cdelt2,crpix1,crpix2;
-   char fithdr[HDR_MAXLEN];
-   char naxis1card[81],naxis2card[81];
-   char crval1card[81],crpix1card[81],cdelt1card[81];
-   char crval2card[81],crpix2card[81],cdelt2card[81];
-   char pc11card[81],pc12card[81],pc21card[81],pc22card[81];
-   char latpolecard[81], lonpolecard[81];
-   int status, nreject, nwcs; // libwcs output
    int k,face; // squid resolution, face number
    double rot; // image rotation in deg
    squid_type tside2; // # pix across entire face
@@ -375,8 +1164,7 @@ int hsc_getwcs_pole(squid_type squid, squid_type tside, struct wcsprm **wcs) {
    pc22=pc11;
 
    if (sph2xyf(HSC,rac,decc,&wxf,&wyf,&face) == -1) {
-      printf("sph2xyf failed!\n");
-      return(-1);
+      return(squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "hsc_getwcsparam_pole", "sph2xyf failed"));
    }
    wx=tside2*(0.5-wxf); // world x coord of pole
    wy=tside2*(0.5-wyf); // world y coord of pole
@@ -386,52 +1174,22 @@ int hsc_getwcs_pole(squid_type squid, squid_type tside, struct wcsprm **wcs) {
    crpix1=wx+xc;
    crpix2=wy+yc;
 
-   // set up variable header strings
-   sprintf(naxis1card,"NAXIS1  = %20ld / length of axis 1                               ",(long)tside); 
-   sprintf(naxis2card,"NAXIS2  = %20ld / length of axis 2                               ",(long)tside);
-   sprintf(latpolecard,"LATPOLE = %20.15f / native lat of pole                             ",crval2);
-   sprintf(lonpolecard,"LONPOLE = %20.15f / native lon of pole                             ",crval1);
-   sprintf(crval1card,"CRVAL1  = %20.15f / ref world                                      ",0.0);
-   sprintf(crpix1card,"CRPIX1  = %20.12f / ref pix                                        ",crpix1);
-   sprintf(cdelt1card,"CDELT1  = %20.15f / deg/pix                                        ",cdelt1);
-   sprintf(crval2card,"CRVAL2  = %20.15f / ref world                                      ",crval2);
-   sprintf(crpix2card,"CRPIX2  = %20.12f / ref pix                                        ",crpix2);
-   sprintf(cdelt2card,"CDELT2  = %20.15f / deg/pix                                        ",cdelt2);
-   sprintf(pc11card,"PC1_1   = %20.15f / rotation matrix                                ",pc11);
-   sprintf(pc12card,"PC1_2   = %20.15f / rotation matrix                                ",pc12);
-   sprintf(pc21card,"PC2_1   = %20.15f / rotation matrix                                ",pc21);
-   sprintf(pc22card,"PC2_2   = %20.15f / rotation matrix                                ",pc22);
-
-   // create fithdr string
-   fithdr[0]='\0';
-   strncat(fithdr,"SIMPLE  =                    T / file does conform to FITS standard             ",81);   
-   strncat(fithdr,"BITPIX  =                   16 / number of bits per data pixel                  ",81);   
-   strncat(fithdr,"NAXIS   =                    2 / number of data axes                            ",81);   
-   strncat(fithdr,naxis1card,81);   
-   strncat(fithdr,naxis2card,81);
-   strncat(fithdr,"EXTEND  =                    T / FITS dataset may contain extensions            ",81);   
-   strncat(fithdr,"CTYPE1  = 'RA---XPH'           / Healpix RA                                     ",81);   
-   strncat(fithdr,crval1card,81);   
-   strncat(fithdr,crpix1card,81);   
-   strncat(fithdr,cdelt1card,81);   
-   strncat(fithdr,"CTYPE2  = 'DEC--XPH'           / Healpix DEC                                    ",81);   
-   strncat(fithdr,crval2card,81);   
-   strncat(fithdr,crpix2card,81);   
-   strncat(fithdr,cdelt2card,81);   
-   strncat(fithdr,pc11card,81);   
-   strncat(fithdr,pc12card,81);   
-   strncat(fithdr,pc21card,81);   
-   strncat(fithdr,pc22card,81);   
-   strncat(fithdr,latpolecard,81);   
-   strncat(fithdr,lonpolecard,81);   
-   strncat(fithdr,"END                                                                             ",81);   
-
-   // Interpret the WCS keywords to create wcs struct
-   if ((status = wcspih(fithdr, 21, WCSHDR_all, -3, &nreject, &nwcs, &wcs0))) {
-      fprintf(stderr, "wcspih ERROR %d: %s.\n", status, wcshdr_errmsg[status]);
-      return(-1);
-   }
-   *wcs=wcs0;
+   // fill in parameters, the pole is the reference point here
+   strcpy(tparam->ctype1,"RA---XPH");
+   strcpy(tparam->ctype2,"DEC--XPH");
+   tparam->tside=tside;
+   tparam->crval1=0.0;
+   tparam->crval2=crval2;
+   tparam->crpix1=crpix1;
+   tparam->crpix2=crpix2;
+   tparam->cdelt1=cdelt1;
+   tparam->cdelt2=cdelt2;
+   tparam->pc11=pc11;
+   tparam->pc12=pc12;
+   tparam->pc21=pc21;
+   tparam->pc22=pc22;
+   tparam->lonpole=crval1;
+   tparam->latpole=crval2;
 
    return(0);
 
@@ -440,21 +1198,22 @@ int hsc_getwcs_pole(squid_type squid, squid_type tside, struct wcsprm **wcs) {
 // Get wcs struct for a given squid for any tside
 // Here tside is the number of pixels per side of the tile.
 int hsc_getwcs_equator(squid_type squid, squid_type tside, struct wcsprm **wcs) {
-   struct wcsprm *wcs0; // temp wcs pointer
+   struct tile_wcsparam tparam; // tile wcs parameters
+
+   if (hsc_getwcsparam_equator(squid, tside, &tparam) == -1) return(-1);
+
+   return(tile_wcsparam2wcs(&tparam, wcs));
+}
+
+// Get HSC projection wcs parameters for an equatorial squid for any tside
+int hsc_getwcsparam_equator(squid_type squid, squid_type tside, struct tile_wcsparam *tparam) {
    double pc11,pc12,pc21,pc22; //wcs rotation parameters
    double ra,ra2,dec,wx,wy,wxr,wyr;
    double xc,yc,rac,decc; // img center coords
    double crval1,crval2,cdelt1,cdelt2,crpix1,crpix2;
-   char fithdr[HDR_MAXLEN];
-   char naxis1card[81],naxis2card[81];
-   char crval1card[81],crpix1card[81],cdelt1card[81];
-   char crval2card[81],crpix2card[81],cdelt2card[81];
-   char pc11card[81],pc12card[81],pc21card[81],pc22card[81];
-   int status, nreject, nwcs; // output from libwcs
    int k; // squid resolution parameter
    double rot; // image rotation angle in deg
    long latpole,lonpole; // wcs projection pole coords
-   char latpolecard[81],lonpolecard[81];
 
    // get center coords
    k=squid_getres(squid);
@@ -494,52 +1253,22 @@ int hsc_getwcs_equator(squid_type squid, squid_type tside, struct wcsprm **wcs)
    crpix1=(double)xc-wxr/cdelt1;
    crpix2=(double)yc-wyr/cdelt2;
 
-   // set up variable header strings
-   sprintf(naxis1card,"NAXIS1  = %20ld / length of axis 1                               ",(long)tside); 
-   sprintf(naxis2card,"NAXIS2  = %20ld / length of axis 2                               ",(long)tside);
-   sprintf(crval1card,"CRVAL1  = %20.15f / ref world                                      ",crval1);
-   sprintf(crpix1card,"CRPIX1  = %20.12f / ref pix                                        ",crpix1);
-   sprintf(cdelt1card,"CDELT1  = %20.15f / deg/pix                                        ",cdelt1);
-   sprintf(crval2card,"CRVAL2  = %20.15f / ref world                                      ",crval2);
-   sprintf(crpix2card,"CRPIX2  = %20.12f / ref pix                                        ",crpix2);
-   sprintf(cdelt2card,"CDELT2  = %20.15f / deg/pix                                        ",cdelt2);
-   sprintf(pc11card,"PC1_1   = %20.15f / rotation matrix                                ",pc11);
-   sprintf(pc12card,"PC1_2   = %20.15f / rotation matrix                                ",pc12);
-   sprintf(pc21card,"PC2_1   = %20.15f / rotation matrix                                ",pc21);
-   sprintf(pc22card,"PC2_2   = %20.15f / rotation matrix                                ",pc22);
-   sprintf(lonpolecard,"LONPOLE = %20ld / native lat of pole                             ",lonpole);
-   sprintf(latpolecard,"LATPOLE = %20ld / native lat of pole                             ",latpole);
-
-   // create fithdr string
-   fithdr[0]='\0';
-   strncat(fithdr,"SIMPLE  =                    T / file does conform to FITS standard             ",81);   
-   strncat(fithdr,"BITPIX  =                   16 / number of bits per data pixel                  ",81);   
-   strncat(fithdr,"NAXIS   =                    2 / number of data axes                            ",81);   
-   strncat(fithdr,naxis1card,81);   
-   strncat(fithdr,naxis2card,81);
-   strncat(fithdr,"EXTEND  =                    T / FITS dataset may contain extensions            ",81);   
-   strncat(fithdr,"CTYPE1  = 'RA---HPX'           / Healpix RA                                     ",81);   
-   strncat(fithdr,crval1card,81);   
-   strncat(fithdr,crpix1card,81);   
-   strncat(fithdr,cdelt1card,81);   
-   strncat(fithdr,"CTYPE2  = 'DEC--HPX'           / Healpix DEC                                    ",81);   
-   strncat(fithdr,crval2card,81);   
-   strncat(fithdr,crpix2card,81);   
-   strncat(fithdr,cdelt2card,81);   
-   strncat(fithdr,pc11card,81);   
-   strncat(fithdr,pc12card,81);   
-   strncat(fithdr,pc21card,81);   
-   strncat(fithdr,pc22card,81);   
-   strncat(fithdr,latpolecard,81);   
-   strncat(fithdr,lonpolecard,81);   
-   strncat(fithdr,"END                                                                             ",81);   
-
-   // Interpret the WCS keywords to create wcs struct
-   if ((status = wcspih(fithdr, 21, WCSHDR_all, -3, &nreject, &nwcs, &wcs0))) {
-      fprintf(stderr, "wcspih ERROR %d: %s.\n", status, wcshdr_errmsg[status]);
-      return(-1);
-   }
-   *wcs=wcs0;
+   // fill in parameters
+   strcpy(tparam->ctype1,"RA---HPX");
+   strcpy(tparam->ctype2,"DEC--HPX");
+   tparam->tside=tside;
+   tparam->crval1=crval1;
+   tparam->crval2=crval2;
+   tparam->crpix1=crpix1;
+   tparam->crpix2=crpix2;
+   tparam->cdelt1=cdelt1;
+   tparam->cdelt2=cdelt2;
+   tparam->pc11=pc11;
+   tparam->pc12=pc12;
+   tparam->pc21=pc21;
+   tparam->pc22=pc22;
+   tparam->lonpole=lonpole;
+   tparam->latpole=latpole;
 
    return(0);
 
@@ -550,170 +1279,126 @@ int hsc_getwcs_equator(squid_type squid, squid_type tside, struct wcsprm **wcs)
 // Add wcs header to squid tile image fits file
 // 
 int tile_addwcs(int projection, squid_type squid, struct wcsprm *wcs, char *ihdr, fitsfile *ofptr) {
-   char *hcardx[] = CARD_EXCLUDE;
-   int xlen;
-   char *ihdrcpy, *ihdrcpy0;
-   int status=0; // return value for cfitsio calls
-   long i,j;
+
+   return(tile_addwcs_filter(projection, squid, wcs, ihdr, ofptr, NULL));
+}
+
+//
+// Same as tile_addwcs, with cards of the original header excluded by
+// filter instead of the default list (CARD_EXCLUDE and SIP keywords).
+// The cards are assembled in memory with a struct hdr_build, as views
+// into ihdr and the wcshdo output, and written to ofptr in one pass.
+//
+int tile_addwcs_filter(int projection, squid_type squid, struct wcsprm *wcs, char *ihdr, fitsfile *ofptr, const struct card_filter *filter) {
+   struct hdr_build hb; // output header cards
+   char keyname[FLEN_KEYWORD]; // card name
+   int status=0; // return value for wcslib calls
+   long i;
    double rac,decc; // img center coords
    double dtval;
-   char *wheader, *wheader0, *card, *card0; // wcs header
-   char *keyname; // card name
+   long ltval;
+   char *wheader, *card; // wcs header, current card
    int nkeyrec, ifkeys;
    int k;
-   int ihdrlen;
-   int cskip;
    char *maptype; // e.g. "TSC"
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_TILE_ADDWCS);
 
    // Make sure squid is valid
    if (squid_validate(squid) == 0) {
-      fprintf(stderr,"invalid squid argument in tile_addwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "tile_addwcs", "invalid squid argument");
       return(-1);
    }
 
    // get center coords
    k=squid_getres(squid);
    if (squid2sph(projection,squid,&rac,&decc) == -1) {
-      fprintf(stderr,"squid2sph failed in tile_addwcs\n");
+      squidwcs_error(SQUIDWCS_ERR_SQUID, 0, "tile_addwcs", "squid2sph failed");
       return(-1);
    }
    rac=rac/DD2R;
    decc=decc/DD2R;
 
+   // the hdrbuild functions record their own errors
+   if (hdrbuild_init(&hb) < 0) return(-1);
+
    //
    // Add header from original image
    //
-   ihdrcpy=strdup(ihdr);
-   ihdrcpy0=ihdrcpy;
-   ihdrlen=strlen(ihdr);
-   ifkeys=ihdrlen/80-1;
+   ifkeys=strlen(ihdr)/80-1;
    // loop over keys from original image
    for (i=0; i<ifkeys; i++) {
-      // get single card
-      card=strndup(ihdrcpy,80);
-      ihdrcpy=ihdrcpy+80; // advance to next card
-      // first check if card is a comment
-      if (strncmp("COMMENT",card,7) == 0) {
-         if (fits_write_comment(ofptr, card, &status)) {
-            fprintf(stderr,"fits_update_card failed in tile_addwcs\n");
-            fits_report_error(stderr, status);
-            free(card);
-            return(-1);
-         }
-         free(card);
-         continue;
-      }
-      // check if card is on excluded list
-      j=0;
-      cskip=0;
-      while (hcardx[j] != NULL) {
-         xlen=strlen(hcardx[j]);
-         if (strncmp(hcardx[j],card,xlen) == 0) {
-            cskip=1;
-            break;
-         }
-         j++;
-      }
-      // take out SIP parameters
-      if (strncmp("A_",card,2) == 0) cskip=1;
-      else if (strncmp("B_",card,2) == 0) cskip=1;
-      else if (strncmp("AP_",card,3) == 0) cskip=1;
-      else if (strncmp("BP_",card,3) == 0) cskip=1;
-      if (cskip) {
-         free(card);
-         continue;
-      }
-      // get key name
-      card0=strndup(card,80);
-      keyname=strtok(card0,"=");
-      if (keyname == NULL) {
-         free(card0);
-         continue;
-      }
-      // update card in new header
-      if (fits_update_card(ofptr, keyname, card, &status)) {
-         fprintf(stderr,"fits_update_card failed in tile_addwcs\n");
-         fits_report_error(stderr, status);
+      // get single card, skip excluded and SIP cards
+      card=ihdr+80*i;
+      if (card_filter_match(filter, card)) continue;
+      if (hdrbuild_update(&hb, card) < 0) {
+         hdrbuild_free(&hb);
          return(-1);
       }
-      free(keyname); // frees card0 as well
-      free(card);
    }
-   free(ihdrcpy0);
 
    //
    // write wcs header values
    //
    if (projection == TSC) {
-      maptype=strdup("TSC");
+      maptype="TSC";
    } else if (projection == CSC) {
-      maptype=strdup("CSC");
+      maptype="CSC";
    } else if (projection == QSC) {
-      maptype=strdup("QSC");
+      maptype="QSC";
    } else if (projection == HSC) {
-      maptype=strdup("HSC");
+      maptype="HSC";
    } else {
-      maptype=strdup("???");
-   }
-   if (fits_update_key(ofptr, TSTRING, "MAPTYPE", maptype,
-            "Map Projection Type", &status)) {
-      fits_report_error(stderr, status);
-      return(-1);
-   }
-   free(maptype);
-   if (fits_update_key(ofptr, TLONG, "MAPID", &squid,
-            "Map ID of Image Region", &status)) {
-      fits_report_error(stderr, status);
-      return(-1);
+      maptype="???";
    }
-   if (fits_update_key(ofptr, TINT, "MAPRES", &k,
-            "Map Resolution Parameter", &status)) {
-      fits_report_error(stderr, status);
+   ltval=(long)squid;
+   if ((hdrbuild_key(&hb, TSTRING, "MAPTYPE", maptype, "Map Projection Type") < 0)||
+       (hdrbuild_key(&hb, TLONG, "MAPID", &ltval, "Map ID of Image Region") < 0)||
+       (hdrbuild_key(&hb, TINT, "MAPRES", &k, "Map Resolution Parameter") < 0)) {
+      hdrbuild_free(&hb);
       return(-1);
    }
 
    if ((status=wcshdo(0, wcs, &nkeyrec, &wheader)) > 0) {
-      fprintf(stderr,"wcshdo failed in tile_addwcs, status=%d\n",status);
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_TILE_ADDWCS);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "tile_addwcs", "wcshdo failed");
+      hdrbuild_free(&hb);
       return(-1);
    }
-   wheader0=wheader;
-
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_TILE_ADDWCS);
    for (i=0; i < nkeyrec; i++) {
-      card=strndup(wheader,80);
-      if (strstr(card,"RESTFRQ") != NULL) {
-         free(card);
-         continue;
-      }
-      if (strstr(card,"RESTWAV") != NULL) {
-         free(card);
-         continue;
+      card=wheader+80*i;
+      if (card_keyword(card, keyname)) {
+         if (strcmp(keyname,"RESTFRQ") == 0) continue;
+         if (strcmp(keyname,"RESTWAV") == 0) continue;
       }
-      card0=strdup(card);
-      if (card0 == NULL) continue;
-      keyname=strtok(card0,"=");
-      if (keyname == NULL) continue;
-      if (fits_update_card(ofptr, keyname, card, &status)) {
-         fprintf(stderr,"tile_addwcs: fits_update_card failed on %s, status=%d\n",keyname,status);
+      if (hdrbuild_update(&hb, card) < 0) {
+         free(wheader);
+         hdrbuild_free(&hb);
          return(-1);
       }
-      free(keyname); // frees card0 as well
-      free(card);
-      wheader=wheader+80;
    }
-   free(wheader0);
 
    dtval=rac;
-   if (fits_update_key(ofptr, TDOUBLE, "CENTER1", &dtval,
-            "img center RA (deg)", &status)) {
-      fits_report_error(stderr, status);
+   if (hdrbuild_key(&hb, TDOUBLE, "CENTER1", &dtval, "img center RA (deg)") < 0) {
+      free(wheader);
+      hdrbuild_free(&hb);
       return(-1);
    }
    dtval=decc;
-   if (fits_update_key(ofptr, TDOUBLE, "CENTER2", &dtval,
-            "img center DEC (deg)", &status)) {
-      fits_report_error(stderr, status);
+   if (hdrbuild_key(&hb, TDOUBLE, "CENTER2", &dtval, "img center DEC (deg)") < 0) {
+      free(wheader);
+      hdrbuild_free(&hb);
+      return(-1);
+   }
+
+   // write all cards, the wcshdo cards are still in use until here
+   if (hdrbuild_write(&hb, ofptr) < 0) {
+      free(wheader);
+      hdrbuild_free(&hb);
       return(-1);
    }
+   free(wheader);
+   hdrbuild_free(&hb);
 
    return(0);
 
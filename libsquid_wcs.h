@@ -80,20 +80,469 @@ struct sip_param {
    double crval2; // lat reference point
    double crpix1; // img x reference point
    double crpix2; // img y reference point
+   int have_inv; // 1 if reverse AP,BP coefficients in header, 0 if not
+};
+
+// Set of squids with amortized O(1) insert, used to dedupe coverage samples.
+// Squids are kept in insertion order in list[], hash[] holds list index+1.
+struct squid_set {
+   long n; // number of squids in set
+   long nalloc; // allocated length of list
+   squid_type *list; // squids in insertion order
+   long hsize; // hash table size, power of 2
+   long *hash; // open addressing hash table
+};
+
+// WCS parameters of a squid tile.  These are the values that used to be
+// written as fits header cards and parsed back with wcspih.
+struct tile_wcsparam {
+   squid_type tside; // pixels per side of the tile
+   char ctype1[9]; // e.g. "RA---TSC"
+   char ctype2[9]; // e.g. "DEC--TSC"
+   double crval1; // lon reference point
+   double crval2; // lat reference point
+   double crpix1; // img x reference point
+   double crpix2; // img y reference point
+   double cdelt1; // deg/pix along x
+   double cdelt2; // deg/pix along y
+   double pc11,pc12,pc21,pc22; // rotation matrix
+   double lonpole; // native lon of pole
+   double latpole; // native lat of pole
+};
+
+// Entry of a tile wcs cache
+struct tile_wcscache_entry {
+   int projection; // key: squid projection
+   squid_type squid; // key: tile squid
+   squid_type tside; // key: pixels per side of tile
+   struct wcsprm *wcs; // tile wcs, owned by the cache
+   long prev,next; // LRU list links, -1 at the ends
+   long hnext; // next entry in hash bucket, -1 at the end
+};
+
+// Bounded LRU cache of ready to use tile wcs structs, see tile_wcscache_get
+struct tile_wcscache {
+   long capacity; // max number of entries
+   long n; // number of entries in use
+   long head,tail; // most and least recently used entry
+   long nbucket; // number of hash buckets
+   long *bucket; // first entry of each hash bucket, -1 if empty
+   struct tile_wcscache_entry *entry; // entries
+   long hits; // number of lookups found in cache
+   long misses; // number of lookups creating a new tile wcs
+   long evictions; // number of entries dropped to make room
+};
+
+// Template slots of a struct tile_wcstmpl
+#define TILE_TMPL_MAIN 0 // quadcube and HSC equatorial tiles
+#define TILE_TMPL_NORTH 1 // HSC north polar tiles
+#define TILE_TMPL_SOUTH 2 // HSC south polar tiles
+#define TILE_TMPL_N 3
+
+// Tile wcs templates for one projection, resolution and tside.  Tiles
+// only differ from their template by CRPIX, see tile_wcstmpl_get.
+struct tile_wcstmpl {
+   int projection; // squid projection
+   int k; // squid resolution
+   squid_type tside; // pixels per side of tile
+   struct tile_wcsparam param[TILE_TMPL_N]; // template parameters
+   struct wcsprm *wcs[TILE_TMPL_N]; // prepared templates, NULL until used
+};
+
+// Tile transform given as a template wcs and a pixel offset
+struct tile_wcsref {
+   struct wcsprm *wcs; // template wcs, owned by the struct tile_wcstmpl
+   double dx,dy; // template pix minus tile pix
+};
+
+// One private copy of a wcs struct per thread, see wcs_pool_init
+struct wcs_pool {
+   int n; // number of threads
+   struct wcsprm **wcs; // wcs of each thread
+};
+
+// Max number of cards formatted by hdrbuild_key in one header
+#define HDRBUILD_MAXKEY 16
+
+// Fits header cards assembled in memory before being written in one pass,
+// see hdrbuild_update and hdrbuild_write.  Cards are pointers into the
+// caller's header buffers, only hdrbuild_key cards are stored here.
+struct hdr_build {
+   long n; // number of cards
+   long nalloc; // allocated number of cards
+   const char **card; // 80 char cards, not NUL terminated
+   long hsize; // hash table size, power of 2
+   long *hash; // keyword hash table, holds card index+1
+   int nown; // number of cards in own
+   char own[HDRBUILD_MAXKEY][FLEN_CARD]; // cards made by hdrbuild_key
+};
+
+// Keywords excluded when copying an image header to a tile header,
+// see card_filter_init and tile_addwcs_filter
+struct card_filter {
+   int nkey; // number of exact keywords
+   int nkeyalloc; // allocated number of keywords
+   char (*key)[FLEN_KEYWORD]; // sorted exact keywords
+   int nprefix; // number of prefixes
+   int nprefixalloc; // allocated number of prefixes
+   char (*prefix)[FLEN_KEYWORD]; // keyword prefixes
+};
+
+// Number of coefficients in the valid triangle (i+j <= order) of a SIP
+// polynomial of the largest supported order.
+#define SIP_NCOEF_MAX ((SIP_ARRAY_MAX*(SIP_ARRAY_MAX+1))/2)
+
+// Defaults for the Newton refinement of the reverse SIP transform, see
+// sip_setinverse.  Tolerance is in pixels.
+#define SIP_INV_TOL 1e-8
+#define SIP_INV_MAXITER 20
+
+// stat value of a point whose reverse SIP refinement did not converge,
+// apart from the positive wcslib point status values
+#define SIP_STAT_NOCONV -1
+
+// Instruction sets for the batch SIP kernels
+#define SIP_ISA_SCALAR 0
+#define SIP_ISA_SSE2 1
+#define SIP_ISA_AVX2 2
+#define SIP_ISA_AVX512 3
+
+// Precompiled SIP polynomials, built once from a struct sip_param by
+// sip_compile.  Only the valid triangle of coefficients is kept, stored in
+// nested Horner order with the x and y coefficients interleaved so that
+// both axes are evaluated in the same pass.
+struct sip_compiled {
+   int have_sip; // 1 if sip in header, 0 if not
+   int order; // forward order, max of a_order and b_order
+   int porder; // reverse order, max of ap_order and bp_order
+   double crpix1; // img x reference point
+   double crpix2; // img y reference point
+   double fwd[2*SIP_NCOEF_MAX]; // forward a,b coefficient pairs
+   double rev[2*SIP_NCOEF_MAX]; // reverse ap,bp coefficient pairs
+   int have_inv; // 1 if rev holds AP,BP coefficients, 0 if not
+   int refine; // 1 to refine the reverse transform by Newton iteration
+   int maxiter; // max Newton iterations per point
+   double tol; // Newton step size tolerance in pixels
+};
+
+// Default node spacing in pixels of a SIP distortion table
+#define SIP_GRID_STEP 32
+
+// Forward SIP distortion tabulated on a coarse grid of nodes and
+// interpolated bicubically in between, see sip_grid_init.
+struct sip_grid {
+   const struct sip_compiled *scomp; // exact SIP, used outside the table
+   int step; // node spacing in pixels
+   long nx; // number of nodes along x
+   long ny; // number of nodes along y
+   double x0; // img x of node 0
+   double y0; // img y of node 0
+   double *d; // dx,dy pairs at the nodes, row major
+   double maxerr; // max interpolation error found, in pixels
+};
+
+// Max number of values per point interpolated by a wcs_surrogate
+#define SURROGATE_MAXCOMP 3
+
+// Size in pixels below which a surrogate cell is not split further
+#define SURROGATE_MINSIZE 4.0
+
+// Transform approximated by a wcs_surrogate: writes ncomp values per point
+// to out, non finite for bad points.  Returns 0, or -1 on failure.
+typedef int (*surrogate_fn)(void *ctx, long n, const double *x, const double *y, double *out);
+
+// One quadtree cell of a wcs_surrogate
+struct wcs_surrogate_cell {
+   double x0; // img x of cell corner
+   double y0; // img y of cell corner
+   double w; // cell width
+   double h; // cell height
+   long child; // index of the first of 4 children, -1 if none
+   long leaf; // index of the fitted samples, -1 if exact
+};
+
+// Adaptive interpolating surrogate of an image transform, see
+// wcs_surrogate_initfn and wcs_surrogate_init
+struct wcs_surrogate {
+   surrogate_fn fn; // exact transform
+   void *ctx; // context passed to fn
+   int ncomp; // values per point
+   double tol; // interpolation tolerance
+   long ncell; // number of cells, cell[0] covers the image
+   long ncellalloc; // allocated number of cells
+   struct wcs_surrogate_cell *cell; // quadtree cells
+   long nleaf; // number of fitted cells
+   long nleafalloc; // allocated number of fitted cells
+   double *val; // 3x3 node samples of each fitted cell
+   long nexact; // number of cells left to the exact transform
+   int depth; // max quadtree depth
+   double maxerr; // max interpolation error measured
+};
+
+// Reprojection kernels, see struct reproj_opts
+#define REPROJ_NEAREST 0
+#define REPROJ_BILINEAR 1
+#define REPROJ_LANCZOS 2 // Lanczos-3
+
+// Reprojection options, set defaults with reproj_opts_init
+struct reproj_opts {
+   int kernel; // REPROJ_NEAREST, REPROJ_BILINEAR or REPROJ_LANCZOS
+   double tol; // surrogate tolerance in source pixels, 0 for exact
+   int nthread; // number of threads, <= 0 for all cores
+};
+
+// One squid tile being reprojected: tile wcs, source pixel strip and
+// output pixels, filled in by the reproj_tile_* stages
+struct reproj_tile {
+   int projection; // squid projection
+   squid_type squid; // tile squid
+   squid_type tside; // pixels per side of tile
+   struct wcsprm *wcs; // tile wcs
+   long bbox[4]; // source pixels needed, x0,x1,y0,y1, empty if x0 > x1
+   long nx; // source strip width
+   long ny; // source strip height
+   float *src; // source strip pixels, NULL if none
+   float *pix; // tside*tside tile pixels, NAN if blank
+   long ngood; // number of non blank tile pixels
+};
+
+// Called by reproj_run with each finished tile
+typedef int (*reproj_fn)(const struct reproj_tile *tile, void *arg);
+
+// Stages of tilepipe_run, indexes into struct tilepipe_stats
+#define TILEPIPE_COVER 0 // coverage of the image in squids
+#define TILEPIPE_WCS 1 // tile wcs and source bounding box
+#define TILEPIPE_READ 2 // source strip read
+#define TILEPIPE_PIX 3 // resampling
+#define TILEPIPE_WRITE 4 // tile output
+#define TILEPIPE_NSTAGE 5
+
+// Pipeline options, set defaults with tilepipe_opts_init
+struct tilepipe_opts {
+   int nworker; // number of resample threads, <= 0 for all cores
+   int qdepth; // max tiles queued between stages, <= 0 for 2*nworker
+   size_t maxmem; // max bytes of tile memory in flight, 0 for no limit
+   struct reproj_opts ropts; // resampling options, nthread is not used
+};
+
+// Per stage timing of tilepipe_run, summed over the threads of a stage
+struct tilepipe_stats {
+   long ntile[TILEPIPE_NSTAGE]; // tiles through each stage
+   double busy[TILEPIPE_NSTAGE]; // seconds working
+   double wait[TILEPIPE_NSTAGE]; // seconds blocked on queues, memory or file
+   double wall; // seconds for the whole run
+   size_t maxmem; // peak bytes of tile memory in flight
+};
+
+// Argument of tilepipe_writefits
+struct tilepipe_fitsout {
+   const char *prefix; // output file name prefix, squid and .fits are appended
+   char *ihdr; // source image header string for tile_addwcs
+};
+
+// Error codes of struct squidwcs_error
+#define SQUIDWCS_OK 0
+#define SQUIDWCS_ERR_ARG 1 // invalid argument
+#define SQUIDWCS_ERR_ALLOC 2 // memory allocation failed
+#define SQUIDWCS_ERR_FULL 3 // output array too small
+#define SQUIDWCS_ERR_WCSLIB 4 // wcslib call failed, status is the wcslib status
+#define SQUIDWCS_ERR_FITSIO 5 // cfitsio call failed, status is the cfitsio status
+#define SQUIDWCS_ERR_SQUID 6 // libsquid call failed
+#define SQUIDWCS_ERR_SIP 7 // bad or missing SIP parameters
+#define SQUIDWCS_ERR_INPUT 8 // malformed input data
+#define SQUIDWCS_ERR_IO 9 // read or write failed
+#define SQUIDWCS_ERR_N 10
+
+// Failure recorded by a library function.  Recording is cheap: nothing is
+// formatted until a handler or squidwcs_error_format asks for it.
+struct squidwcs_error {
+   int code; // SQUIDWCS_ERR_*, SQUIDWCS_OK if no error
+   int status; // wcslib or cfitsio status, or other detail, else 0
+   const char *func; // library function that failed
+   const char *what; // what failed, a string constant
+};
+
+// Called with every recorded error, see squidwcs_error_handler
+typedef void (*squidwcs_error_fn)(const struct squidwcs_error *err, void *arg);
+
+// Hot path instrumentation, built in when the library is compiled with
+// LIBSQUIDWCS_STATS defined (cmake -DWITH_STATS=ON or make STATS=1).
+// Otherwise the hooks below compile to nothing and all counters read 0.
+// Counters are kept per thread and summed by squidwcs_stats_get.  Times
+// include nested library calls.  Indexes of the instrumented functions:
+#define SQUIDWCS_STAT_WCS_PIX2RD 0
+#define SQUIDWCS_STAT_WCS_RD2PIX 1
+#define SQUIDWCS_STAT_WCS_PIX2RD_BATCH 2
+#define SQUIDWCS_STAT_WCS_RD2PIX_BATCH 3
+#define SQUIDWCS_STAT_WCS_CLONE 4
+#define SQUIDWCS_STAT_WCS_POOL_INIT 5
+#define SQUIDWCS_STAT_SIP_READ 6
+#define SQUIDWCS_STAT_SIP_READHDR 7
+#define SQUIDWCS_STAT_SIP_FORWARD 8
+#define SQUIDWCS_STAT_SIP_REVERSE 9
+#define SQUIDWCS_STAT_SIP_COMPILE 10
+#define SQUIDWCS_STAT_SIP_FORWARD_COMPILED 11
+#define SQUIDWCS_STAT_SIP_REVERSE_COMPILED 12
+#define SQUIDWCS_STAT_SIP_REVERSE_REFINE 13
+#define SQUIDWCS_STAT_WCS_ADDSQUID 14
+#define SQUIDWCS_STAT_SQUIDSET_INIT 15
+#define SQUIDWCS_STAT_SQUIDSET_ADD 16
+#define SQUIDWCS_STAT_WCS_GETSQUIDS 17 // also wcs_getsquids_sorted and _omp
+#define SQUIDWCS_STAT_WCS_GETSQUIDS_POLY 18
+#define SQUIDWCS_STAT_WCS_GETSQUIDS_MOC 19
+#define SQUIDWCS_STAT_TILE_GETWCS 20
+#define SQUIDWCS_STAT_TILE_GETWCSPARAM 21
+#define SQUIDWCS_STAT_TILE_WCSPARAM2WCS 22
+#define SQUIDWCS_STAT_TILE_ADDWCS 23 // also tile_addwcs_filter
+#define SQUIDWCS_STAT_N 24
+
+// Counters of one instrumented function, see squidwcs_stats_get
+struct squidwcs_stat {
+   const char *name; // function name
+   unsigned long long calls; // number of calls
+   unsigned long long ns; // cumulative nanoseconds in the function
+   unsigned long long wcserr; // wcslib calls that returned an error
+   unsigned long long alloc; // memory allocations
+};
+
+#ifdef LIBSQUIDWCS_STATS
+// Open call of an instrumented function, closed when it goes out of scope
+struct squidwcs_stats_scope {
+   int fn; // SQUIDWCS_STAT_* index
+   unsigned long long t0; // squidwcs_stats_clock at entry
+};
+unsigned long long squidwcs_stats_clock(void);
+void squidwcs_stats_exit(struct squidwcs_stats_scope *scope);
+void squidwcs_stats_count(int fn, int what);
+// Declare at the top of an instrumented function to count and time it
+#define SQUIDWCS_STATS_FN(fn) struct squidwcs_stats_scope squidwcs_scope \
+   __attribute__((cleanup(squidwcs_stats_exit))) = {(fn), squidwcs_stats_clock()}
+#define SQUIDWCS_STATS_WCSERR(fn) squidwcs_stats_count((fn), 0)
+#define SQUIDWCS_STATS_ALLOC(fn) squidwcs_stats_count((fn), 1)
+#else
+#define SQUIDWCS_STATS_FN(fn)
+#define SQUIDWCS_STATS_WCSERR(fn) ((void)0)
+#define SQUIDWCS_STATS_ALLOC(fn) ((void)0)
+#endif
+
+// Image wcs parsed once from a fits header: the wcslib struct, the SIP
+// distortion (if any) and the image size.  See wcsimg_open.
+struct wcs_image {
+   int nwcs; // number of wcs structs returned by wcspih
+   struct wcsprm *wcs; // primary wcs, wcs[0]
+   struct sip_param sparam; // SIP parameters, sparam.have_sip=0 if none
+   struct sip_compiled scomp; // compiled SIP polynomials
+   long naxes[2]; // image size, 0 if not in header
 };
 
 int wcs_pix2rd(struct wcsprm *wcs, double x, double y, double *ra, double *dec);
 int wcs_rd2pix(struct wcsprm *wcs, double ra, double dec, double *x, double *y);
+int wcs_pix2rd_batch(struct wcsprm *wcs, long n, const double *x, const double *y, long xystride, double *ra, double *dec, long rdstride, int stat[]);
+int wcs_rd2pix_batch(struct wcsprm *wcs, long n, const double *ra, const double *dec, long rdstride, double *x, double *y, long xystride, int stat[]);
+int wcs_clone(const struct wcsprm *wcs, struct wcsprm **clone);
+int wcs_pool_init(struct wcs_pool *pool, struct wcsprm *wcs, int nthread);
+struct wcsprm *wcs_pool_get(struct wcs_pool *pool, int tid);
+void wcs_pool_free(struct wcs_pool *pool);
 int wcs_addsquid(int proj, struct wcsprm *wcs, int k, double x, double y, squid_type squidarr[], long squidarr_len, long *squidarr_used);
 int wcs_getsquids(int proj, struct wcsprm *wcs, double cdelt,long naxes[], int k, squid_type squidarr[], long squidarr_len, long *squidarr_used);
+int wcs_getsquids_sorted(int proj, struct wcsprm *wcs, double cdelt, long naxes[], int k, squid_type squidarr[], long squidarr_len, long *squidarr_used);
+int wcs_getsquids_omp(int proj, struct wcsprm *wcs, double cdelt, long naxes[], int k, int nthread, squid_type squidarr[], long squidarr_len, long *squidarr_used);
+int wcs_getsquids_poly(int proj, struct wcsprm *wcs, double cdelt, long naxes[], int k, squid_type squidarr[], long squidarr_len, long *squidarr_used);
+int wcs_getsquids_moc(int proj, struct wcsprm *wcs, double cdelt, long naxes[], int kmin, int kmax, squid_type squidarr[], long squidarr_len, long *squidarr_used);
+int squidset_init(struct squid_set *set);
+void squidset_free(struct squid_set *set);
+int squidset_add(struct squid_set *set, squid_type squid);
+int squidset_copy(struct squid_set *set, int sorted, squid_type squidarr[], long squidarr_len, long *squidarr_used);
 int tile_getwcs(int proj, squid_type squid, squid_type tside, struct wcsprm **wcs);
+int tile_getwcsparam(int proj, squid_type squid, squid_type tside, struct tile_wcsparam *tparam);
+int tile_wcsparam2wcs(struct tile_wcsparam *tparam, struct wcsprm **wcs);
+void wcs_free(struct wcsprm *wcs);
 int quadcube_getwcs(int proj, squid_type squid, squid_type tside, struct wcsprm **wcs);
+int quadcube_getwcsparam(int proj, squid_type squid, squid_type tside, struct tile_wcsparam *tparam);
 int hsc_getwcs_pole(squid_type squid, squid_type tside, struct wcsprm **wcs);
+int hsc_getwcsparam_pole(squid_type squid, squid_type tside, struct tile_wcsparam *tparam);
 int hsc_getwcs_equator(squid_type squid, squid_type tside, struct wcsprm **wcs);
+int hsc_getwcsparam_equator(squid_type squid, squid_type tside, struct tile_wcsparam *tparam);
+int tile_wcscache_init(struct tile_wcscache *cache, long capacity);
+void tile_wcscache_free(struct tile_wcscache *cache);
+int tile_wcscache_get(struct tile_wcscache *cache, int proj, squid_type squid, squid_type tside, struct wcsprm **wcs);
+int tile_wcstmpl_init(struct tile_wcstmpl *tmpl, int proj, int k, squid_type tside);
+void tile_wcstmpl_free(struct tile_wcstmpl *tmpl);
+int tile_wcstmpl_get(struct tile_wcstmpl *tmpl, squid_type squid, struct tile_wcsref *ref);
+int tile_pix2rd(struct tile_wcsref *ref, double x, double y, double *ra, double *dec);
+int tile_rd2pix(struct tile_wcsref *ref, double ra, double dec, double *x, double *y);
 int tile_addwcs(int proj, squid_type squid, struct wcsprm *wcs, char *ihdr, fitsfile *ofptr);
+int tile_addwcs_filter(int proj, squid_type squid, struct wcsprm *wcs, char *ihdr, fitsfile *ofptr, const struct card_filter *filter);
+int card_keyword(const char *card, char *keyname);
+int hdrbuild_init(struct hdr_build *hb);
+void hdrbuild_free(struct hdr_build *hb);
+int hdrbuild_update(struct hdr_build *hb, const char *card);
+int hdrbuild_key(struct hdr_build *hb, int datatype, const char *keyname, void *value, const char *comment);
+int hdrbuild_write(struct hdr_build *hb, fitsfile *ofptr);
+int card_filter_init(struct card_filter *filter);
+void card_filter_free(struct card_filter *filter);
+int card_filter_addkey(struct card_filter *filter, const char *keyname);
+int card_filter_addprefix(struct card_filter *filter, const char *prefix);
+int card_filter_match(const struct card_filter *filter, const char *card);
 int sip_read(fitsfile *fptr, struct sip_param *sparam);
+int sip_readhdr(const char *header, int nkeyrec, struct sip_param *sparam);
 int sip_forward(struct sip_param *sparam, double x, double y, double *xout, double *yout);
 int sip_reverse(struct sip_param *sparam, double x, double y, double *xout, double *yout);
+int sip_compile(struct sip_param *sparam, struct sip_compiled *scomp);
+int sip_forward_compiled(const struct sip_compiled *scomp, double x, double y, double *xout, double *yout);
+int sip_reverse_compiled(const struct sip_compiled *scomp, double x, double y, double *xout, double *yout);
+int sip_setinverse(struct sip_compiled *scomp, int refine, double tol, int maxiter);
+int sip_reverse_refine(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout, int stat[]);
+int wcsimg_open(fitsfile *fptr, struct wcs_image *img);
+int wcsimg_openfile(const char *filename, struct wcs_image *img);
+int wcsimg_fromhdr(const char *header, int nkeyrec, struct wcs_image *img);
+int wcsimg_frommem(void *buf, size_t size, struct wcs_image *img);
+int wcsimg_clone(const struct wcs_image *img, struct wcs_image *clone);
+void wcsimg_free(struct wcs_image *img);
+int wcsimg_pix2rd(const struct wcs_image *img, double x, double y, double *ra, double *dec);
+int wcsimg_rd2pix(const struct wcs_image *img, double ra, double dec, double *x, double *y);
+int wcsimg_pix2rd_batch(const struct wcs_image *img, long n, const double *x, const double *y, double *ra, double *dec, int stat[]);
+int wcsimg_rd2pix_batch(const struct wcs_image *img, long n, const double *ra, const double *dec, double *x, double *y, int stat[]);
+int wcsimg_stream(const struct wcs_image *img, int reverse, FILE *in, FILE *out, int binary, long blocksize, int nthread);
+int sip_grid_init(struct sip_grid *grid, const struct sip_compiled *scomp, long naxes[], int step);
+void sip_grid_free(struct sip_grid *grid);
+int sip_grid_forward(const struct sip_grid *grid, double x, double y, double *xout, double *yout);
+int sip_grid_forward_batch(const struct sip_grid *grid, long n, const double *x, const double *y, double *xout, double *yout);
+int sip_grid_forward_row(const struct sip_grid *grid, double x0, double y, long n, double *xout, double *yout);
+int wcs_surrogate_initfn(struct wcs_surrogate *sur, surrogate_fn fn, void *ctx, int ncomp, long naxes[], double tol);
+int wcs_surrogate_init(struct wcs_surrogate *sur, struct wcsprm *wcs, long naxes[], double tol);
+void wcs_surrogate_free(struct wcs_surrogate *sur);
+int wcs_surrogate_eval(const struct wcs_surrogate *sur, void *ctx, double x, double y, double *out);
+int wcs_surrogate_pix2rd(const struct wcs_surrogate *sur, struct wcsprm *wcs, double x, double y, double *ra, double *dec);
+int wcs_surrogate_pix2rd_batch(const struct wcs_surrogate *sur, struct wcsprm *wcs, long n, const double *x, const double *y, double *ra, double *dec);
+void reproj_opts_init(struct reproj_opts *opts);
+int reproj_tile_init(struct reproj_tile *tile, int projection, squid_type squid, squid_type tside);
+void reproj_tile_free(struct reproj_tile *tile);
+int reproj_tile_bbox(struct reproj_tile *tile, const struct wcs_image *img, int kernel);
+int reproj_tile_read(struct reproj_tile *tile, fitsfile *fptr);
+int reproj_tile_pix(struct reproj_tile *tile, const struct wcs_image *img, const struct reproj_opts *opts);
+int reproj_run(fitsfile *fptr, const struct wcs_image *img, int projection, squid_type squids[], long nsquid, squid_type tside,
+      const struct reproj_opts *opts, reproj_fn fn, void *arg);
+void tilepipe_opts_init(struct tilepipe_opts *opts);
+int tilepipe_run(fitsfile *fptr, const struct wcs_image *img, int projection, int k, double cdelt, squid_type tside,
+      const struct tilepipe_opts *opts, reproj_fn writefn, void *writearg, struct tilepipe_stats *stats);
+void tilepipe_stats_print(const struct tilepipe_stats *stats, FILE *out);
+int tilepipe_writefits(const struct reproj_tile *tile, void *arg);
+int squidwcs_error(int code, int status, const char *func, const char *what);
+const struct squidwcs_error *squidwcs_error_last(void);
+void squidwcs_error_clear(void);
+void squidwcs_error_handler(squidwcs_error_fn fn, void *arg);
+void squidwcs_error_stderr(const struct squidwcs_error *err, void *arg);
+const char *squidwcs_error_str(int code);
+int squidwcs_error_format(const struct squidwcs_error *err, char *buf, size_t len);
+int squidwcs_stats_enabled(void);
+int squidwcs_stats_get(struct squidwcs_stat stats[], int nstats);
+void squidwcs_stats_reset(void);
+void squidwcs_stats_dump(FILE *out);
+int sip_batch_setisa(int isa);
+int sip_batch_getisa(void);
+int sip_forward_batch(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout);
+int sip_reverse_batch(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout, int stat[]);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,596 @@
+//
+// Pipelined tiling driver: coverage, tile wcs, reprojection and writing
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+#include <pthread.h>
+
+// Number of coverage array sizes tried, growing 4x each time
+#define TILEPIPE_COVER_TRIES 3
+
+// Bounded queue of pointers between two pipeline stages.  A queue is
+// closed once all of its producers are done; pop then returns NULL when
+// it is empty.  Aborting closes it at once.
+struct tilepipe_queue {
+   pthread_mutex_t lock;
+   pthread_cond_t notempty;
+   pthread_cond_t notfull;
+   void **item; // ring buffer
+   int cap; // ring buffer size
+   int head; // index of first item
+   int n; // number of items
+   int nprod; // number of producers not done yet
+   int abort; // set when the pipeline fails
+};
+
+// Shared state of one tilepipe_run
+struct tilepipe {
+   fitsfile *fptr; // source image
+   const struct wcs_image *img; // source image wcs
+   int projection;
+   int k;
+   double cdelt;
+   squid_type tside;
+   const struct tilepipe_opts *opts;
+   reproj_fn writefn;
+   void *writearg;
+   squid_type *squids; // coverage, filled by the coverage stage
+   struct tilepipe_queue qsquid; // coverage -> tile wcs
+   struct tilepipe_queue qwcs; // tile wcs -> resample
+   struct tilepipe_queue qpix; // resample -> write
+   pthread_mutex_t readlock; // serializes reads of fptr
+   pthread_mutex_t memlock; // guards memused
+   pthread_cond_t memfree; // signalled when tile memory is released
+   size_t memused; // bytes of tile memory in flight
+   pthread_mutex_t statlock; // guards stats and fail
+   struct tilepipe_stats *stats;
+   int fail; // set when any stage fails
+};
+
+// Seconds from a monotonic clock
+static double tilepipe_now(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return(ts.tv_sec+1e-9*ts.tv_nsec);
+}
+
+static int tpq_init(struct tilepipe_queue *q, int cap, int nprod) {
+
+   memset(q, 0, sizeof(struct tilepipe_queue));
+   if ((q->item=(void **)malloc(cap*sizeof(void *))) == NULL) {
+      fprintf(stderr, "malloc failed in tpq_init\n");
+      return(-1);
+   }
+   q->cap=cap;
+   q->nprod=nprod;
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->notempty, NULL);
+   pthread_cond_init(&q->notfull, NULL);
+
+   return(0);
+}
+
+static void tpq_free(struct tilepipe_queue *q) {
+
+   pthread_mutex_destroy(&q->lock);
+   pthread_cond_destroy(&q->notempty);
+   pthread_cond_destroy(&q->notfull);
+   free(q->item);
+}
+
+// Add item, waiting while the queue is full.  Adds the wait time to *wait.
+// Returns 0, or -1 if the pipeline was aborted (item is not added).
+static int tpq_push(struct tilepipe_queue *q, void *item, double *wait) {
+   double t0;
+
+   t0=tilepipe_now();
+   pthread_mutex_lock(&q->lock);
+   while ((q->n == q->cap)&&(!q->abort)) pthread_cond_wait(&q->notfull, &q->lock);
+   if (q->abort) {
+      pthread_mutex_unlock(&q->lock);
+      return(-1);
+   }
+   q->item[(q->head+q->n)%q->cap]=item;
+   q->n++;
+   pthread_cond_signal(&q->notempty);
+   pthread_mutex_unlock(&q->lock);
+   *wait+=tilepipe_now()-t0;
+
+   return(0);
+}
+
+// Take the next item, waiting while the queue is empty and open.  Adds
+// the wait time to *wait.  Returns NULL once the queue is closed and empty.
+static void *tpq_pop(struct tilepipe_queue *q, double *wait) {
+   void *item=NULL;
+   double t0;
+
+   t0=tilepipe_now();
+   pthread_mutex_lock(&q->lock);
+   while ((q->n == 0)&&(q->nprod > 0)&&(!q->abort)) pthread_cond_wait(&q->notempty, &q->lock);
+   if ((q->n > 0)&&(!q->abort)) {
+      item=q->item[q->head];
+      q->head=(q->head+1)%q->cap;
+      q->n--;
+      pthread_cond_signal(&q->notfull);
+   }
+   pthread_mutex_unlock(&q->lock);
+   *wait+=tilepipe_now()-t0;
+
+   return(item);
+}
+
+// Called by each producer of q when it has no more items
+static void tpq_done(struct tilepipe_queue *q) {
+
+   pthread_mutex_lock(&q->lock);
+   q->nprod--;
+   pthread_cond_broadcast(&q->notempty);
+   pthread_mutex_unlock(&q->lock);
+}
+
+static void tpq_abort(struct tilepipe_queue *q) {
+
+   pthread_mutex_lock(&q->lock);
+   q->abort=1;
+   pthread_cond_broadcast(&q->notempty);
+   pthread_cond_broadcast(&q->notfull);
+   pthread_mutex_unlock(&q->lock);
+}
+
+// Stop the pipeline after a failure
+static void tilepipe_fail(struct tilepipe *tp) {
+
+   pthread_mutex_lock(&tp->statlock);
+   tp->fail=1;
+   pthread_mutex_unlock(&tp->statlock);
+   tpq_abort(&tp->qsquid);
+   tpq_abort(&tp->qwcs);
+   tpq_abort(&tp->qpix);
+   pthread_mutex_lock(&tp->memlock);
+   pthread_cond_broadcast(&tp->memfree);
+   pthread_mutex_unlock(&tp->memlock);
+}
+
+// Test if the pipeline has failed
+static int tilepipe_failed(struct tilepipe *tp) {
+   int fail;
+
+   pthread_mutex_lock(&tp->statlock);
+   fail=tp->fail;
+   pthread_mutex_unlock(&tp->statlock);
+
+   return(fail);
+}
+
+// Add a thread's stage timing to the run totals
+static void tilepipe_addstats(struct tilepipe *tp, int stage, long ntile, double busy, double wait) {
+
+   pthread_mutex_lock(&tp->statlock);
+   tp->stats->ntile[stage]+=ntile;
+   tp->stats->busy[stage]+=busy;
+   tp->stats->wait[stage]+=wait;
+   pthread_mutex_unlock(&tp->statlock);
+}
+
+// Tile memory: source strip and output pixels
+static size_t tilepipe_tilemem(const struct reproj_tile *tile) {
+   size_t n;
+
+   n=(size_t)tile->tside*tile->tside;
+   if (tile->bbox[0] <= tile->bbox[1]) n+=(size_t)(tile->bbox[1]-tile->bbox[0]+1)*(tile->bbox[3]-tile->bbox[2]+1);
+
+   return(n*sizeof(float));
+}
+
+// Wait until size bytes of tile memory fit under opts->maxmem.  A tile is
+// always let through when nothing else is in flight.
+// Returns 0, or -1 if the pipeline was aborted.
+static int tilepipe_memget(struct tilepipe *tp, size_t size) {
+   int fail;
+
+   pthread_mutex_lock(&tp->memlock);
+   while ((tp->opts->maxmem > 0)&&(tp->memused > 0)&&(tp->memused+size > tp->opts->maxmem)&&(!tilepipe_failed(tp))) {
+      pthread_cond_wait(&tp->memfree, &tp->memlock);
+   }
+   tp->memused+=size;
+   if (tp->memused > tp->stats->maxmem) tp->stats->maxmem=tp->memused;
+   pthread_mutex_unlock(&tp->memlock);
+   fail=tilepipe_failed(tp);
+
+   return(fail ? -1 : 0);
+}
+
+static void tilepipe_memput(struct tilepipe *tp, size_t size) {
+
+   pthread_mutex_lock(&tp->memlock);
+   tp->memused-=size;
+   pthread_cond_broadcast(&tp->memfree);
+   pthread_mutex_unlock(&tp->memlock);
+}
+
+// Free a tile taken out of a queue
+static void tilepipe_tilefree(struct reproj_tile *tile) {
+
+   reproj_tile_free(tile);
+   free(tile);
+}
+
+//
+// Coverage stage: find the squids the image covers and queue them
+//
+static void *tilepipe_cover(void *arg) {
+   struct tilepipe *tp=(struct tilepipe *)arg;
+   struct wcs_image img; // private copy of the image wcs
+   double t0, busy, wait=0.0, tsize;
+   long len, used=0, i;
+   int ret=-1, try;
+
+   t0=tilepipe_now();
+   if (wcsimg_clone(tp->img, &img) < 0) {
+      tilepipe_fail(tp);
+      tpq_done(&tp->qsquid);
+      return(NULL);
+   }
+   // guess the number of tiles from the image and tile sizes
+   tsize=90.0/(1 << tp->k);
+   len=(long)(4*(tp->img->naxes[0]*fabs(tp->cdelt)/tsize+2)*(tp->img->naxes[1]*fabs(tp->cdelt)/tsize+2))+64;
+   // an undersized guess only fails, so retry a few times with more room
+   for (try=0; try<TILEPIPE_COVER_TRIES; try++) {
+      if ((tp->squids=(squid_type *)malloc(len*sizeof(squid_type))) == NULL) break;
+      used=0;
+      if ((ret=wcs_getsquids_poly(tp->projection, img.wcs, tp->cdelt, img.naxes, tp->k, tp->squids, len, &used)) == 0) break;
+      free(tp->squids);
+      tp->squids=NULL;
+      len*=4;
+   }
+   wcsimg_free(&img);
+   if (ret < 0) {
+      fprintf(stderr, "wcs_getsquids_poly failed in tilepipe_cover\n");
+      tilepipe_fail(tp);
+      tpq_done(&tp->qsquid);
+      return(NULL);
+   }
+   busy=tilepipe_now()-t0;
+   for (i=0; i<used; i++) {
+      if (tpq_push(&tp->qsquid, &tp->squids[i], &wait) < 0) break;
+   }
+   tpq_done(&tp->qsquid);
+   tilepipe_addstats(tp, TILEPIPE_COVER, i, busy, wait);
+
+   return(NULL);
+}
+
+//
+// Tile wcs stage: build each tile's wcs and find its source box
+//
+static void *tilepipe_wcs(void *arg) {
+   struct tilepipe *tp=(struct tilepipe *)arg;
+   struct wcs_image img; // private copy of the image wcs
+   struct reproj_tile *tile;
+   squid_type *squid;
+   double t0, busy=0.0, wait=0.0;
+   long ntile=0;
+
+   if (wcsimg_clone(tp->img, &img) < 0) {
+      tilepipe_fail(tp);
+      tpq_done(&tp->qwcs);
+      return(NULL);
+   }
+   while ((squid=(squid_type *)tpq_pop(&tp->qsquid, &wait)) != NULL) {
+      t0=tilepipe_now();
+      if ((tile=(struct reproj_tile *)malloc(sizeof(struct reproj_tile))) == NULL) {
+         fprintf(stderr, "malloc failed in tilepipe_wcs\n");
+         tilepipe_fail(tp);
+         break;
+      }
+      if ((reproj_tile_init(tile, tp->projection, *squid, tp->tside) < 0)||
+          (reproj_tile_bbox(tile, &img, tp->opts->ropts.kernel) < 0)) {
+         tilepipe_tilefree(tile);
+         tilepipe_fail(tp);
+         break;
+      }
+      busy+=tilepipe_now()-t0;
+      ntile++;
+      if (tpq_push(&tp->qwcs, tile, &wait) < 0) {
+         tilepipe_tilefree(tile);
+         break;
+      }
+   }
+   wcsimg_free(&img);
+   tpq_done(&tp->qwcs);
+   tilepipe_addstats(tp, TILEPIPE_WCS, ntile, busy, wait);
+
+   return(NULL);
+}
+
+//
+// Resample stage, one or more threads: read each tile's source strip
+// (one thread at a time) and resample it
+//
+static void *tilepipe_pix(void *arg) {
+   struct tilepipe *tp=(struct tilepipe *)arg;
+   struct wcs_image img; // private copy of the image wcs
+   struct reproj_tile *tile;
+   double t0, t1, busy=0.0, wait=0.0, rbusy=0.0, rwait=0.0;
+   long ntile=0;
+   size_t size;
+   int ret;
+
+   if (wcsimg_clone(tp->img, &img) < 0) {
+      tilepipe_fail(tp);
+      tpq_done(&tp->qpix);
+      return(NULL);
+   }
+   while ((tile=(struct reproj_tile *)tpq_pop(&tp->qwcs, &wait)) != NULL) {
+      // read wait includes the wait for memory and for the source file
+      size=tilepipe_tilemem(tile);
+      t0=tilepipe_now();
+      if (tilepipe_memget(tp, size) < 0) {
+         tilepipe_memput(tp, size);
+         tilepipe_tilefree(tile);
+         break;
+      }
+      pthread_mutex_lock(&tp->readlock);
+      t1=tilepipe_now();
+      rwait+=t1-t0;
+      ret=reproj_tile_read(tile, tp->fptr);
+      pthread_mutex_unlock(&tp->readlock);
+      rbusy+=tilepipe_now()-t1;
+      // resample
+      t0=tilepipe_now();
+      if ((ret < 0)||(reproj_tile_pix(tile, &img, &tp->opts->ropts) < 0)) {
+         tilepipe_memput(tp, size);
+         tilepipe_tilefree(tile);
+         tilepipe_fail(tp);
+         break;
+      }
+      // source strip is no longer needed
+      free(tile->src);
+      tile->src=NULL;
+      tilepipe_memput(tp, size-(size_t)tile->tside*tile->tside*sizeof(float));
+      busy+=tilepipe_now()-t0;
+      ntile++;
+      if (tpq_push(&tp->qpix, tile, &wait) < 0) {
+         tilepipe_memput(tp, (size_t)tile->tside*tile->tside*sizeof(float));
+         tilepipe_tilefree(tile);
+         break;
+      }
+   }
+   wcsimg_free(&img);
+   tpq_done(&tp->qpix);
+   tilepipe_addstats(tp, TILEPIPE_READ, ntile, rbusy, rwait);
+   tilepipe_addstats(tp, TILEPIPE_PIX, ntile, busy, wait);
+
+   return(NULL);
+}
+
+//
+// Write stage, the dedicated I/O thread: hand each tile to writefn
+//
+static void *tilepipe_write(void *arg) {
+   struct tilepipe *tp=(struct tilepipe *)arg;
+   struct reproj_tile *tile;
+   double t0, busy=0.0, wait=0.0;
+   long ntile=0;
+   int ret;
+
+   while ((tile=(struct reproj_tile *)tpq_pop(&tp->qpix, &wait)) != NULL) {
+      t0=tilepipe_now();
+      ret=tp->writefn(tile, tp->writearg);
+      tilepipe_memput(tp, (size_t)tile->tside*tile->tside*sizeof(float));
+      tilepipe_tilefree(tile);
+      busy+=tilepipe_now()-t0;
+      if (ret < 0) {
+         fprintf(stderr, "tile write failed in tilepipe_write\n");
+         tilepipe_fail(tp);
+         break;
+      }
+      ntile++;
+   }
+   tilepipe_addstats(tp, TILEPIPE_WRITE, ntile, busy, wait);
+
+   return(NULL);
+}
+
+// Free the tiles left in a queue after an abort
+static void tilepipe_drain(struct tilepipe_queue *q) {
+
+   while (q->n > 0) {
+      tilepipe_tilefree((struct reproj_tile *)q->item[q->head]);
+      q->head=(q->head+1)%q->cap;
+      q->n--;
+   }
+}
+
+// Set opts to the defaults: one resample thread per core, queues of two
+// tiles per thread, no memory limit and the reproj_opts_init defaults
+void tilepipe_opts_init(struct tilepipe_opts *opts) {
+
+   opts->nworker=0;
+   opts->qdepth=0;
+   opts->maxmem=0;
+   reproj_opts_init(&opts->ropts);
+}
+
+//
+// Reproject the image in fptr (wcs img, pixel scale cdelt in deg) into
+// all the squid tiles of resolution k it covers, with tside pixels per
+// side, and hand each tile to writefn(tile, writearg).  The work runs as
+// a pipeline of threads joined by bounded queues of opts->qdepth tiles:
+// coverage (one thread, wcs_getsquids_poly), tile wcs and source box (one
+// thread), source read and resampling (opts->nworker threads, reads
+// serialized) and writing (one thread, so writefn is never called
+// concurrently).  Tiles wait before their source read while their memory
+// (source strip plus tile pixels) would take the total in flight over
+// opts->maxmem bytes.  Source reads and writefn run in different threads,
+// so cfitsio must be built reentrant.  If stats is not NULL it gets the
+// tile counts, busy and wait seconds of each stage (summed over threads),
+// the wall time and the peak tile memory.
+// Function returns 0 on success and -1 on failure
+//
+int tilepipe_run(fitsfile *fptr, const struct wcs_image *img, int projection, int k, double cdelt, squid_type tside,
+      const struct tilepipe_opts *opts, reproj_fn writefn, void *writearg, struct tilepipe_stats *stats) {
+   struct tilepipe tp;
+   struct tilepipe_stats tstats;
+   pthread_t tcover, twcs, twrite, *tpix;
+   int nworker, qdepth, i, npix=0;
+   int have_cover=0, have_wcs=0, have_write=0; // threads created
+   int fail;
+   double t0;
+
+   t0=tilepipe_now();
+   nworker=opts->nworker;
+   if (nworker <= 0) nworker=(int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (nworker <= 0) nworker=1;
+   qdepth=(opts->qdepth > 0) ? opts->qdepth : 2*nworker;
+   if (stats == NULL) stats=&tstats;
+   memset(stats, 0, sizeof(struct tilepipe_stats));
+
+   memset(&tp, 0, sizeof(struct tilepipe));
+   tp.fptr=fptr;
+   tp.img=img;
+   tp.projection=projection;
+   tp.k=k;
+   tp.cdelt=cdelt;
+   tp.tside=tside;
+   tp.opts=opts;
+   tp.writefn=writefn;
+   tp.writearg=writearg;
+   tp.stats=stats;
+   if ((tpix=(pthread_t *)malloc(nworker*sizeof(pthread_t))) == NULL) {
+      fprintf(stderr, "malloc failed in tilepipe_run\n");
+      return(-1);
+   }
+   if ((tpq_init(&tp.qsquid, qdepth, 1) < 0)||(tpq_init(&tp.qwcs, qdepth, 1) < 0)||
+       (tpq_init(&tp.qpix, qdepth, nworker) < 0)) {
+      free(tp.qsquid.item);
+      free(tp.qwcs.item);
+      free(tpix);
+      return(-1);
+   }
+   pthread_mutex_init(&tp.readlock, NULL);
+   pthread_mutex_init(&tp.memlock, NULL);
+   pthread_cond_init(&tp.memfree, NULL);
+   pthread_mutex_init(&tp.statlock, NULL);
+
+   // every thread that was created is joined below, whatever failed
+   if (pthread_create(&tcover, NULL, tilepipe_cover, &tp) == 0) have_cover=1;
+   if (have_cover&&(pthread_create(&twcs, NULL, tilepipe_wcs, &tp) == 0)) have_wcs=1;
+   for (i=0; have_wcs&&(i<nworker); i++) {
+      if (pthread_create(&tpix[i], NULL, tilepipe_pix, &tp) != 0) break;
+      npix++;
+   }
+   if (npix > 0) {
+      // run with the resample threads we got
+      for (i=npix; i<nworker; i++) tpq_done(&tp.qpix);
+      if (pthread_create(&twrite, NULL, tilepipe_write, &tp) == 0) have_write=1;
+   }
+   if ((!have_cover)||(!have_wcs)||(npix < nworker)||(!have_write)) {
+      fprintf(stderr, "pthread_create failed in tilepipe_run\n");
+      if ((npix == 0)||(!have_write)) tilepipe_fail(&tp);
+   }
+
+   if (have_cover) pthread_join(tcover, NULL);
+   if (have_wcs) pthread_join(twcs, NULL);
+   for (i=0; i<npix; i++) pthread_join(tpix[i], NULL);
+   if (have_write) pthread_join(twrite, NULL);
+   fail=tilepipe_failed(&tp);
+
+   tilepipe_drain(&tp.qwcs);
+   tilepipe_drain(&tp.qpix);
+   tpq_free(&tp.qsquid);
+   tpq_free(&tp.qwcs);
+   tpq_free(&tp.qpix);
+   pthread_mutex_destroy(&tp.readlock);
+   pthread_mutex_destroy(&tp.memlock);
+   pthread_cond_destroy(&tp.memfree);
+   pthread_mutex_destroy(&tp.statlock);
+   free(tp.squids);
+   free(tpix);
+   stats->wall=tilepipe_now()-t0;
+
+   return(fail ? -1 : 0);
+}
+
+// Print the stage timing of a tilepipe_run
+void tilepipe_stats_print(const struct tilepipe_stats *stats, FILE *out) {
+   const char *name[TILEPIPE_NSTAGE] = {"coverage", "tile wcs", "read", "resample", "write"};
+   int i;
+
+   fprintf(out, "%-10s %8s %10s %10s\n", "stage", "tiles", "busy(s)", "wait(s)");
+   for (i=0; i<TILEPIPE_NSTAGE; i++) {
+      fprintf(out, "%-10s %8li %10.3f %10.3f\n", name[i], stats->ntile[i], stats->busy[i], stats->wait[i]);
+   }
+   fprintf(out, "wall %.3f s, peak tile memory %.1f MB\n", stats->wall, stats->maxmem/1048576.0);
+}
+
+//
+// writefn for tilepipe_run and reproj_run that writes each tile to its own
+// fits file, named by prefix and squid, with a float image and the tile
+// wcs header from tile_addwcs (ihdr is the source image header string, as
+// from fits_hdr2str).  Tiles with no good pixels are skipped.
+// Function returns 0 on success and -1 on failure
+//
+int tilepipe_writefits(const struct reproj_tile *tile, void *arg) {
+   struct tilepipe_fitsout *fout=(struct tilepipe_fitsout *)arg;
+   char fname[FLEN_FILENAME];
+   fitsfile *ofptr;
+   long naxes[2];
+   int status=0;
+
+   if (tile->ngood == 0) return(0);
+   snprintf(fname, sizeof(fname), "!%s%ld.fits", fout->prefix, (long)tile->squid);
+   naxes[0]=tile->tside;
+   naxes[1]=tile->tside;
+   if (fits_create_file(&ofptr, fname, &status)) {
+      fits_report_error(stderr, status);
+      return(-1);
+   }
+   // on failure delete the half written file, which also closes it
+   if (fits_create_img(ofptr, FLOAT_IMG, 2, naxes, &status)) {
+      fits_report_error(stderr, status);
+      status=0;
+      fits_delete_file(ofptr, &status);
+      return(-1);
+   }
+   if (tile_addwcs(tile->projection, tile->squid, tile->wcs, fout->ihdr, ofptr) < 0) {
+      fprintf(stderr, "tile_addwcs failed in tilepipe_writefits\n");
+      fits_delete_file(ofptr, &status);
+      return(-1);
+   }
+   if (fits_write_img(ofptr, TFLOAT, 1, naxes[0]*naxes[1], tile->pix, &status)) {
+      fits_report_error(stderr, status);
+      status=0;
+      fits_delete_file(ofptr, &status);
+      return(-1);
+   }
+   if (fits_close_file(ofptr, &status)) {
+      fits_report_error(stderr, status);
+      return(-1);
+   }
+
+   return(0);
+}
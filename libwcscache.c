@@ -0,0 +1,248 @@
+//
+// Caching and sharing of tile wcs structs
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+#include <libsquid_wcs.h>
+
+// Hash bucket of a cache key
+static long wcscache_bucket(struct tile_wcscache *cache, int projection, squid_type squid, squid_type tside) {
+   unsigned long long h;
+
+   h=(unsigned long long)squid*0x9e3779b97f4a7c15ULL;
+   h=h^((unsigned long long)tside*0xbf58476d1ce4e5b9ULL);
+   h=h^(unsigned long long)projection;
+   h=h^(h >> 29);
+
+   return((long)(h % (unsigned long long)cache->nbucket));
+}
+
+// Unlink entry i from the LRU list
+static void wcscache_unlink(struct tile_wcscache *cache, long i) {
+   struct tile_wcscache_entry *e;
+
+   e=&cache->entry[i];
+   if (e->prev >= 0) cache->entry[e->prev].next=e->next;
+   else cache->head=e->next;
+   if (e->next >= 0) cache->entry[e->next].prev=e->prev;
+   else cache->tail=e->prev;
+   e->prev=-1;
+   e->next=-1;
+}
+
+// Put entry i at the most recently used end of the LRU list
+static void wcscache_push(struct tile_wcscache *cache, long i) {
+   struct tile_wcscache_entry *e;
+
+   e=&cache->entry[i];
+   e->prev=-1;
+   e->next=cache->head;
+   if (cache->head >= 0) cache->entry[cache->head].prev=i;
+   cache->head=i;
+   if (cache->tail < 0) cache->tail=i;
+}
+
+// Initialize an empty cache holding at most capacity tile wcs structs
+// Function returns 0 on success and -1 on failure
+int tile_wcscache_init(struct tile_wcscache *cache, long capacity) {
+   long i;
+
+   memset(cache, 0, sizeof(struct tile_wcscache));
+   if (capacity < 1) return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "tile_wcscache_init", "invalid capacity"));
+   cache->capacity=capacity;
+   cache->nbucket=2*capacity+1;
+   cache->head=-1;
+   cache->tail=-1;
+   cache->entry=(struct tile_wcscache_entry *)calloc(capacity,sizeof(struct tile_wcscache_entry));
+   cache->bucket=(long *)malloc(cache->nbucket*sizeof(long));
+   if ((cache->entry == NULL)||(cache->bucket == NULL)) {
+      tile_wcscache_free(cache);
+      return(squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "tile_wcscache_init", "malloc failed"));
+   }
+   for (i=0; i<cache->nbucket; i++) cache->bucket[i]=-1;
+
+   return(0);
+}
+
+// Free all cached wcs structs and the cache itself.
+// Any wcs pointer obtained from the cache is invalid afterwards.
+void tile_wcscache_free(struct tile_wcscache *cache) {
+   long i;
+
+   if (cache->entry != NULL) {
+      for (i=0; i<cache->n; i++) wcs_free(cache->entry[i].wcs);
+   }
+   free(cache->entry);
+   free(cache->bucket);
+   cache->entry=NULL;
+   cache->bucket=NULL;
+   cache->n=0;
+}
+
+// Get the wcs struct of a tile, creating it with tile_getwcs on a miss.
+// The returned wcs is owned by the cache: do not free it.  It stays valid
+// until it is evicted, which only happens in a later tile_wcscache_get
+// miss once the tile is the least recently used one, so the last
+// capacity distinct tiles returned are always valid.  The cache is not
+// thread safe, use one cache per thread.
+// Function returns 0 on success and -1 on failure
+int tile_wcscache_get(struct tile_wcscache *cache, int projection, squid_type squid, squid_type tside, struct wcsprm **wcs) {
+   struct tile_wcscache_entry *e;
+   struct wcsprm *wcs0;
+   long b,i,*link;
+
+   // look up key
+   b=wcscache_bucket(cache, projection, squid, tside);
+   for (i=cache->bucket[b]; i>=0; i=cache->entry[i].hnext) {
+      e=&cache->entry[i];
+      if ((e->squid == squid)&&(e->tside == tside)&&(e->projection == projection)) {
+         if (cache->head != i) {
+            wcscache_unlink(cache, i);
+            wcscache_push(cache, i);
+         }
+         cache->hits++;
+         *wcs=e->wcs;
+         return(0);
+      }
+   }
+
+   // miss, create the tile wcs before evicting anything
+   cache->misses++;
+   // tile_getwcs has recorded the error
+   if (tile_getwcs(projection, squid, tside, &wcs0) < 0) return(-1);
+   if (cache->n < cache->capacity) {
+      i=cache->n;
+      cache->n++;
+   } else {
+      // evict least recently used entry
+      i=cache->tail;
+      e=&cache->entry[i];
+      link=&cache->bucket[wcscache_bucket(cache, e->projection, e->squid, e->tside)];
+      while (*link != i) link=&cache->entry[*link].hnext;
+      *link=e->hnext;
+      wcscache_unlink(cache, i);
+      wcs_free(e->wcs);
+      cache->evictions++;
+   }
+   e=&cache->entry[i];
+   e->projection=projection;
+   e->squid=squid;
+   e->tside=tside;
+   e->wcs=wcs0;
+   e->hnext=cache->bucket[b];
+   cache->bucket[b]=i;
+   wcscache_push(cache, i);
+   *wcs=wcs0;
+
+   return(0);
+}
+
+// Template slot used by a tile with the given wcs parameters
+static int wcstmpl_slot(struct tile_wcsparam *tparam) {
+
+   if (strcmp(tparam->ctype1, "RA---XPH") == 0) {
+      return((tparam->latpole > 0) ? TILE_TMPL_NORTH : TILE_TMPL_SOUTH);
+   }
+
+   return(TILE_TMPL_MAIN);
+}
+
+// Initialize an empty set of tile wcs templates for one projection,
+// resolution k and tside.  Templates are built on first use.
+// Function returns 0 on success and -1 on failure
+int tile_wcstmpl_init(struct tile_wcstmpl *tmpl, int projection, int k, squid_type tside) {
+   int i;
+
+   if ((projection != TSC)&&(projection != CSC)&&(projection != QSC)&&(projection != HSC)) {
+      return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "tile_wcstmpl_init", "unknown projection"));
+   }
+   memset(tmpl, 0, sizeof(struct tile_wcstmpl));
+   tmpl->projection=projection;
+   tmpl->k=k;
+   tmpl->tside=tside;
+   for (i=0; i<TILE_TMPL_N; i++) tmpl->wcs[i]=NULL;
+
+   return(0);
+}
+
+// Free template wcs structs.  Any tile_wcsref obtained from the templates
+// is invalid afterwards.
+void tile_wcstmpl_free(struct tile_wcstmpl *tmpl) {
+   int i;
+
+   for (i=0; i<TILE_TMPL_N; i++) {
+      wcs_free(tmpl->wcs[i]);
+      tmpl->wcs[i]=NULL;
+   }
+}
+
+// Get the transform of a tile as a template wcs plus a pixel offset.
+// All tiles of a projection, k and tside share the same wcs apart from
+// CRPIX (HSC polar tiles share one per hemisphere), so the template is
+// prepared with wcsset once and each tile only costs the arithmetic of
+// tile_getwcsparam.  Tile pixel x,y is template pixel x+ref->dx,y+ref->dy,
+// see tile_pix2rd and tile_rd2pix.  The template wcs is owned by tmpl.
+// Function returns 0 on success and -1 on failure
+int tile_wcstmpl_get(struct tile_wcstmpl *tmpl, squid_type squid, struct tile_wcsref *ref) {
+   struct tile_wcsparam tparam; // tile wcs parameters
+   struct tile_wcsparam *t0; // template wcs parameters
+   int slot;
+
+   if (squid_getres(squid) != tmpl->k) {
+      return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "tile_wcstmpl_get", "squid resolution does not match template"));
+   }
+   // tile_getwcsparam and tile_wcsparam2wcs record their own errors
+   if (tile_getwcsparam(tmpl->projection, squid, tmpl->tside, &tparam) < 0) return(-1);
+   slot=wcstmpl_slot(&tparam);
+   t0=&tmpl->param[slot];
+   if (tmpl->wcs[slot] == NULL) {
+      if (tile_wcsparam2wcs(&tparam, &tmpl->wcs[slot]) < 0) return(-1);
+      *t0=tparam;
+   } else if ((strcmp(t0->ctype1, tparam.ctype1) != 0)||
+              (t0->crval1 != tparam.crval1)||(t0->crval2 != tparam.crval2)||
+              (t0->cdelt1 != tparam.cdelt1)||(t0->cdelt2 != tparam.cdelt2)||
+              (t0->pc11 != tparam.pc11)||(t0->pc12 != tparam.pc12)||
+              (t0->pc21 != tparam.pc21)||(t0->pc22 != tparam.pc22)||
+              (t0->lonpole != tparam.lonpole)||(t0->latpole != tparam.latpole)) {
+      return(squidwcs_error(SQUIDWCS_ERR_ARG, 0, "tile_wcstmpl_get", "tile wcs differs from template by more than CRPIX"));
+   }
+   ref->wcs=tmpl->wcs[slot];
+   ref->dx=t0->crpix1-tparam.crpix1;
+   ref->dy=t0->crpix2-tparam.crpix2;
+
+   return(0);
+}
+
+// Convert tile x,y to sky ra,dec (in deg) through a template
+int tile_pix2rd(struct tile_wcsref *ref, double x, double y, double *ra, double *dec) {
+
+   return(wcs_pix2rd(ref->wcs, x+ref->dx, y+ref->dy, ra, dec));
+}
+
+// Convert sky ra,dec (in deg) to tile x,y through a template
+int tile_rd2pix(struct tile_wcsref *ref, double ra, double dec, double *x, double *y) {
+
+   if (wcs_rd2pix(ref->wcs, ra, dec, x, y) != 0) return(-1);
+   *x=*x-ref->dx;
+   *y=*y-ref->dy;
+
+   return(0);
+}
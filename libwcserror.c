@@ -0,0 +1,125 @@
+//
+// Structured error reporting: thread local last error and user handler
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+
+static const char *error_str[SQUIDWCS_ERR_N] = {
+   "no error", "invalid argument", "memory allocation failed", "output array too small",
+   "wcslib error", "cfitsio error", "libsquid error", "bad SIP parameters",
+   "malformed input", "read or write failed"};
+
+// Last error of each thread
+static __thread struct squidwcs_error error_last={SQUIDWCS_OK, 0, NULL, NULL};
+
+// Handler for all threads, none (record only) until set with
+// squidwcs_error_handler
+static squidwcs_error_fn error_fn=NULL;
+static void *error_arg=NULL;
+
+//
+// Record an error of the calling thread and pass it to the handler.
+// Library functions call this where they fail, with a string constant for
+// what, and then return their failure value.
+// Function always returns -1
+//
+int squidwcs_error(int code, int status, const char *func, const char *what) {
+   squidwcs_error_fn fn;
+
+   error_last.code=code;
+   error_last.status=status;
+   error_last.func=func;
+   error_last.what=what;
+   fn=__atomic_load_n(&error_fn, __ATOMIC_ACQUIRE);
+   if (fn != NULL) fn(&error_last, error_arg);
+
+   return(-1);
+}
+
+// Last error recorded in the calling thread, code is SQUIDWCS_OK if none
+// since the last squidwcs_error_clear
+const struct squidwcs_error *squidwcs_error_last(void) {
+
+   return(&error_last);
+}
+
+// Forget the last error of the calling thread
+void squidwcs_error_clear(void) {
+
+   error_last.code=SQUIDWCS_OK;
+   error_last.status=0;
+   error_last.func=NULL;
+   error_last.what=NULL;
+}
+
+//
+// Set the function called with every error from any thread, with arg.
+// By default (fn NULL) errors are only recorded, to be read with
+// squidwcs_error_last, which keeps failures in tight loops cheap; pass
+// squidwcs_error_stderr to print each error on stderr, as the tools do.
+// fn may be called from several threads at once.  Set the handler before
+// starting threads that use the library.
+//
+void squidwcs_error_handler(squidwcs_error_fn fn, void *arg) {
+
+   error_arg=arg;
+   __atomic_store_n(&error_fn, fn, __ATOMIC_RELEASE);
+}
+
+// Error handler that prints err on stderr
+void squidwcs_error_stderr(const struct squidwcs_error *err, void *arg) {
+   char msg[256];
+
+   (void)arg;
+   squidwcs_error_format(err, msg, sizeof(msg));
+   fprintf(stderr, "%s\n", msg);
+}
+
+// Description of an error code
+const char *squidwcs_error_str(int code) {
+
+   if ((code < 0)||(code >= SQUIDWCS_ERR_N)) return("unknown error");
+
+   return(error_str[code]);
+}
+
+//
+// Format err as "<what> in <func>", with the status (and its meaning for
+// cfitsio errors), into buf of len bytes.
+// Returns the length of the full message, as snprintf
+//
+int squidwcs_error_format(const struct squidwcs_error *err, char *buf, size_t len) {
+   char fitsmsg[FLEN_ERRMSG];
+   const char *what;
+
+   if (err->code == SQUIDWCS_OK) return(snprintf(buf, len, "%s", error_str[SQUIDWCS_OK]));
+   what=(err->what != NULL) ? err->what : squidwcs_error_str(err->code);
+   if ((err->code == SQUIDWCS_ERR_FITSIO)&&(err->status != 0)) {
+      fits_get_errstatus(err->status, fitsmsg);
+      return(snprintf(buf, len, "%s in %s, cfitsio status=%d: %s", what, err->func, err->status, fitsmsg));
+   }
+   if ((err->code == SQUIDWCS_ERR_WCSLIB)&&(err->status != 0)) return(snprintf(buf, len, "%s in %s, wcslib status=%d", what, err->func, err->status));
+   if (err->status != 0) return(snprintf(buf, len, "%s in %s, status=%d", what, err->func, err->status));
+
+   return(snprintf(buf, len, "%s in %s", what, err->func));
+}
@@ -0,0 +1,460 @@
+//
+// Image wcs context: header, SIP and wcslib struct parsed once
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Number of points per block in the batch conversions
+#define WCSIMG_BLOCK 1024
+
+// Default number of points per block read by wcsimg_stream
+#define WCSIMG_STREAM_BLOCK 65536
+
+// Get the integer value of keyname from a header string, 0 if not found
+static long wcsimg_hdrlong(const char *header, int nkeyrec, const char *keyname) {
+   char card[FLEN_CARD]; // NUL terminated copy of a card
+   char key[FLEN_KEYWORD]; // card keyword
+   char value[FLEN_VALUE]; // card value string
+   char comment[FLEN_COMMENT]; // card comment
+   int status;
+   int k;
+
+   for (k=0; k<nkeyrec; k++) {
+      memcpy(card, header+80*k, 80);
+      card[80]='\0';
+      if ((!card_keyword(card, key))||(strcmp(key, keyname) != 0)) continue;
+      status=0;
+      if (fits_parse_value(card, value, comment, &status)) return(0);
+      return(atol(value));
+   }
+
+   return(0);
+}
+
+// Test if a card holds a SIP key, A_*, B_*, AP_* or BP_*
+static int wcsimg_sipcard(const char *card) {
+
+   return((strncmp(card, "A_", 2) == 0)||(strncmp(card, "B_", 2) == 0)||
+          (strncmp(card, "AP_", 3) == 0)||(strncmp(card, "BP_", 3) == 0));
+}
+
+// Parse the wcs of a header string into img.  sparam must already be set.
+// Function returns 0 on success and -1 on failure
+static int wcsimg_parse(char *header, int nkeyrec, struct wcs_image *img) {
+   int status=0; // wcslib status
+   int nreject; // number of rejected keywords
+
+   if (sip_compile(&img->sparam, &img->scomp) < 0) {
+      return(-1);
+   }
+   if ((status=wcspih(header, nkeyrec, WCSHDR_all, -3, &nreject, &img->nwcs, &img->wcs))) {
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcsimg_parse", "wcspih failed");
+      img->nwcs=0;
+      img->wcs=NULL;
+      return(-1);
+   }
+   if ((img->nwcs < 1)||(img->wcs == NULL)) {
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, 0, "wcsimg_parse", "no wcs found");
+      wcsimg_free(img);
+      return(-1);
+   }
+   if ((status=wcsset(img->wcs))) {
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcsimg_parse", "wcsset failed");
+      wcsimg_free(img);
+      return(-1);
+   }
+
+   return(0);
+}
+
+//
+// Read the wcs of the current HDU of fptr into img: SIP parameters,
+// wcslib struct and image size.  SCAMP PV?_* keys are left out of the
+// header given to wcslib because they screw up wcslib, and so are the SIP
+// keys, which are applied here rather than by wcslib.  Nothing in fptr is
+// modified.  Free with wcsimg_free.
+// Function returns 0 on success and -1 on failure
+//
+int wcsimg_open(fitsfile *fptr, struct wcs_image *img) {
+   char *exclist[] = {"PV?_*", "A_*", "B_*", "AP_*", "BP_*"};
+   char *header; // header string for wcspih
+   int nkeyrec; // number of cards in header
+   int bitpix, naxis;
+   int status=0; // cfitsio status
+
+   memset(img, 0, sizeof(struct wcs_image));
+   if (fits_get_img_param(fptr, 2, &bitpix, &naxis, img->naxes, &status)) {
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "wcsimg_open", "fits_get_img_param failed");
+      return(-1);
+   }
+   // read SIP parameters if any
+   if (sip_read(fptr, &img->sparam) < 0) {
+      // read of sip failed, ignore sip correction
+      img->sparam.have_sip=0;
+   }
+   if (fits_hdr2str(fptr, 1, exclist, img->sparam.have_sip ? 5 : 1, &header, &nkeyrec, &status)) {
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "wcsimg_open", "fits_hdr2str failed");
+      return(-1);
+   }
+   if (wcsimg_parse(header, nkeyrec, img) < 0) {
+      free(header);
+      return(-1);
+   }
+   free(header);
+
+   return(0);
+}
+
+// Same as wcsimg_open for a fits file name
+// Function returns 0 on success and -1 on failure
+int wcsimg_openfile(const char *filename, struct wcs_image *img) {
+   fitsfile *fptr;
+   int status=0; // cfitsio status
+
+   if (fits_open_file(&fptr, filename, READONLY, &status)) {
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "wcsimg_openfile", "fits_open_file failed");
+      return(-1);
+   }
+   if (wcsimg_open(fptr, img) < 0) {
+      fits_close_file(fptr, &status);
+      return(-1);
+   }
+   fits_close_file(fptr, &status);
+
+   return(0);
+}
+
+//
+// Same as wcsimg_open for a header string of nkeyrec 80 char cards, as
+// returned by fits_hdr2str.  The SIP parameters are parsed from the cards
+// and, as in wcsimg_open, their cards are blanked in the copy given to
+// wcslib so SIP is applied only once.  The PV?_* keys are still passed on
+// to wcslib, so leave them out of header if needed.
+// Function returns 0 on success and -1 on failure
+//
+int wcsimg_fromhdr(const char *header, int nkeyrec, struct wcs_image *img) {
+   char *hcopy; // copy of header, wcspih may modify its input
+   int status;
+   int k;
+
+   memset(img, 0, sizeof(struct wcs_image));
+   img->naxes[0]=wcsimg_hdrlong(header, nkeyrec, "NAXIS1");
+   img->naxes[1]=wcsimg_hdrlong(header, nkeyrec, "NAXIS2");
+   if (sip_readhdr(header, nkeyrec, &img->sparam) < 0) {
+      // read of sip failed, ignore sip correction
+      img->sparam.have_sip=0;
+   }
+   if ((hcopy=(char *)malloc(80*(size_t)nkeyrec+1)) == NULL) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcsimg_fromhdr", "malloc failed");
+      return(-1);
+   }
+   memcpy(hcopy, header, 80*(size_t)nkeyrec);
+   hcopy[80*(size_t)nkeyrec]='\0';
+   if (img->sparam.have_sip) {
+      for (k=0; k<nkeyrec; k++) {
+         if (wcsimg_sipcard(hcopy+80*k)) memset(hcopy+80*k, ' ', 80);
+      }
+   }
+   status=wcsimg_parse(hcopy, nkeyrec, img);
+   free(hcopy);
+
+   return(status);
+}
+
+// Same as wcsimg_open for a fits file held in memory
+// Function returns 0 on success and -1 on failure
+int wcsimg_frommem(void *buf, size_t size, struct wcs_image *img) {
+   fitsfile *fptr;
+   int status=0; // cfitsio status
+
+   if (fits_open_memfile(&fptr, "wcsimg", READONLY, &buf, &size, 0, NULL, &status)) {
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "wcsimg_frommem", "fits_open_memfile failed");
+      return(-1);
+   }
+   if (wcsimg_open(fptr, img) < 0) {
+      fits_close_file(fptr, &status);
+      return(-1);
+   }
+   fits_close_file(fptr, &status);
+
+   return(0);
+}
+
+// Make a private copy of img for use by another thread.  wcslib writes
+// into the wcsprm it converts with, so each thread converting with the
+// same image needs its own copy (see wcs_pool_init).  Only the primary
+// wcs is copied.  Free with wcsimg_free.
+// Function returns 0 on success and -1 on failure
+int wcsimg_clone(const struct wcs_image *img, struct wcs_image *clone) {
+
+   memcpy(clone, img, sizeof(struct wcs_image));
+   clone->nwcs=0;
+   clone->wcs=NULL;
+   if (wcs_clone(img->wcs, &clone->wcs) < 0) {
+      return(-1);
+   }
+   clone->nwcs=1;
+
+   return(0);
+}
+
+// Free memory held by img
+void wcsimg_free(struct wcs_image *img) {
+
+   if (img->wcs != NULL) wcsvfree(&img->nwcs, &img->wcs);
+   img->wcs=NULL;
+   img->nwcs=0;
+}
+
+//
+// Convert image x,y to sky ra,dec (in deg), applying the SIP distortion
+// before the wcslib transform.  Threads converting at the same time must
+// each use their own copy of img, see wcsimg_clone.
+// Function returns 0 on success and -1 on failure
+//
+int wcsimg_pix2rd(const struct wcs_image *img, double x, double y, double *ra, double *dec) {
+   double xsip, ysip; // sip corrected pixel
+
+   xsip=x;
+   ysip=y;
+   if (img->scomp.have_sip) sip_forward_compiled(&img->scomp, x, y, &xsip, &ysip);
+
+   return(wcs_pix2rd(img->wcs, xsip, ysip, ra, dec));
+}
+
+// Convert sky ra,dec (in deg) to image x,y, applying the SIP distortion
+// after the wcslib transform.
+// Function returns 0 on success and -1 on failure
+int wcsimg_rd2pix(const struct wcs_image *img, double ra, double dec, double *x, double *y) {
+   double xlin, ylin; // undistorted pixel
+
+   if (wcs_rd2pix(img->wcs, ra, dec, &xlin, &ylin) < 0) return(-1);
+   if (img->scomp.have_sip) {
+      if (sip_reverse_compiled(&img->scomp, xlin, ylin, x, y) < 0) return(-1);
+   } else {
+      *x=xlin;
+      *y=ylin;
+   }
+
+   return(0);
+}
+
+//
+// Batch version of wcsimg_pix2rd for n points, see wcs_pix2rd_batch.
+// Bad points get ra,dec set to NAN.
+// Returns the number of bad points, or -1 on failure.
+//
+int wcsimg_pix2rd_batch(const struct wcs_image *img, long n, const double *x, const double *y, double *ra, double *dec, int stat[]) {
+   double xsip[WCSIMG_BLOCK], ysip[WCSIMG_BLOCK]; // sip corrected block
+   long i, nblk;
+   int nbad=0, ret;
+
+   if (!img->scomp.have_sip) return(wcs_pix2rd_batch(img->wcs, n, x, y, 1, ra, dec, 1, stat));
+
+   for (i=0; i<n; i+=nblk) {
+      nblk=((n-i) < WCSIMG_BLOCK) ? n-i : WCSIMG_BLOCK;
+      sip_forward_batch(&img->scomp, nblk, x+i, y+i, xsip, ysip);
+      if ((ret=wcs_pix2rd_batch(img->wcs, nblk, xsip, ysip, 1, ra+i, dec+i, 1, stat ? stat+i : NULL)) < 0) return(-1);
+      nbad+=ret;
+   }
+
+   return(nbad);
+}
+
+// Batch version of wcsimg_rd2pix for n points, see wcs_rd2pix_batch.
+// Bad points, including those where the reverse SIP refinement did not
+// converge (stat SIP_STAT_NOCONV), get x,y set to NAN.
+// Returns the number of bad points, or -1 on failure.
+int wcsimg_rd2pix_batch(const struct wcs_image *img, long n, const double *ra, const double *dec, double *x, double *y, int stat[]) {
+   int nbad;
+
+   if ((nbad=wcs_rd2pix_batch(img->wcs, n, ra, dec, 1, x, y, 1, stat)) < 0) return(-1);
+   if (img->scomp.have_sip) nbad+=sip_reverse_batch(&img->scomp, n, x, y, x, y, stat);
+
+   return(nbad);
+}
+
+// Read up to n coordinate pairs, one pair per line, into xy (interleaved).
+// Blank lines and lines starting with # are skipped.
+// Returns the number of pairs read, or -1 on a malformed line.
+static long wcsimg_readtext(FILE *in, long n, double *xy, long *lineno) {
+   char line[1024];
+   char *p, *end;
+   long i=0;
+
+   while ((i < n)&&(fgets(line, sizeof(line), in) != NULL)) {
+      (*lineno)++;
+      p=line;
+      while ((*p == ' ')||(*p == '\t')) p++;
+      if ((*p == '\n')||(*p == '\r')||(*p == '\0')||(*p == '#')) continue;
+      xy[2*i]=strtod(p, &end);
+      if (end == p) {
+         squidwcs_error(SQUIDWCS_ERR_INPUT, (int)*lineno, "wcsimg_stream", "bad coordinates");
+         return(-1);
+      }
+      p=end;
+      xy[2*i+1]=strtod(p, &end);
+      if (end == p) {
+         squidwcs_error(SQUIDWCS_ERR_INPUT, (int)*lineno, "wcsimg_stream", "bad coordinates");
+         return(-1);
+      }
+      i++;
+   }
+
+   return(i);
+}
+
+// Convert n points with img in the direction given by reverse
+static int wcsimg_convert(const struct wcs_image *img, int reverse, long n, const double *a, const double *b, double *c, double *d) {
+
+   if (reverse) return(wcsimg_rd2pix_batch(img, n, a, b, c, d, NULL));
+
+   return(wcsimg_pix2rd_batch(img, n, a, b, c, d, NULL));
+}
+
+//
+// Convert a stream of coordinate pairs read from in and write the results
+// to out, blocksize points at a time.  reverse=0 converts x,y to ra,dec
+// and reverse=1 converts ra,dec to x,y.  With binary=0 the pairs are text,
+// one pair per line, and the results are written the same way, bare
+// "ra dec" (%.5f) or "x y" (%.3f) without the labels of the single point
+// tools so the output can be streamed back in; with binary=1 both are
+// native doubles, x y x y ...
+// Each block is split over nthread threads (<= 0 for all cores), each with
+// its own copy of img.  Points that cannot be converted come out as nan.
+// Function returns 0 on success and -1 on failure
+//
+int wcsimg_stream(const struct wcs_image *img, int reverse, FILE *in, FILE *out, int binary, long blocksize, int nthread) {
+   struct wcs_image *clone=NULL; // per thread copies of img
+   double *xy, *a, *b, *c, *d; // interleaved input, split input, output
+   long n, i, lineno=0;
+   int fail=0, t;
+
+   if (blocksize <= 0) blocksize=WCSIMG_STREAM_BLOCK;
+#ifdef _OPENMP
+   if (nthread <= 0) nthread=omp_get_max_threads();
+#else
+   nthread=1;
+#endif
+   xy=(double *)malloc(6*blocksize*sizeof(double));
+   if (xy == NULL) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcsimg_stream", "malloc failed");
+      return(-1);
+   }
+   a=xy+2*blocksize;
+   b=a+blocksize;
+   c=b+blocksize;
+   d=c+blocksize;
+   if (nthread > 1) {
+      clone=(struct wcs_image *)calloc(nthread, sizeof(struct wcs_image));
+      if (clone == NULL) {
+         squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcsimg_stream", "calloc failed");
+         free(xy);
+         return(-1);
+      }
+      for (t=0; t<nthread; t++) {
+         if (wcsimg_clone(img, &clone[t]) < 0) {
+            fail=1;
+            break;
+         }
+      }
+   }
+
+   while (!fail) {
+      // read a block
+      if (binary) {
+         n=(long)fread(xy, 2*sizeof(double), blocksize, in);
+      } else {
+         n=wcsimg_readtext(in, blocksize, xy, &lineno);
+      }
+      if (n < 0) {
+         fail=1;
+         break;
+      }
+      if (n == 0) break;
+      for (i=0; i<n; i++) {
+         a[i]=xy[2*i];
+         b[i]=xy[2*i+1];
+      }
+
+      // convert it
+      if (nthread > 1) {
+#ifdef _OPENMP
+         #pragma omp parallel num_threads(nthread)
+         {
+            long i0, i1;
+            int tid;
+
+            tid=omp_get_thread_num();
+            i0=n*tid/nthread;
+            i1=n*(tid+1)/nthread;
+            if (wcsimg_convert(&clone[tid], reverse, i1-i0, a+i0, b+i0, c+i0, d+i0) < 0) {
+               #pragma omp critical(wcsimg_stream_fail)
+               fail=1;
+            }
+         }
+#endif
+         // the worker raised into its own thread's last error
+         if (fail) squidwcs_error(SQUIDWCS_ERR_WCSLIB, 0, "wcsimg_stream", "conversion failed");
+      } else {
+         if (wcsimg_convert(img, reverse, n, a, b, c, d) < 0) fail=1;
+      }
+      if (fail) break;
+
+      // write it
+      if (binary) {
+         for (i=0; i<n; i++) {
+            xy[2*i]=c[i];
+            xy[2*i+1]=d[i];
+         }
+         if (fwrite(xy, 2*sizeof(double), n, out) != (size_t)n) fail=1;
+      } else {
+         for (i=0; i<n; i++) {
+            if (fprintf(out, reverse ? "%.3f %.3f\n" : "%.5f %.5f\n", c[i], d[i]) < 0) {
+               fail=1;
+               break;
+            }
+         }
+      }
+      if (fail) {
+         squidwcs_error(SQUIDWCS_ERR_IO, 0, "wcsimg_stream", "write failed");
+         break;
+      }
+   }
+   if ((!fail)&&binary&&ferror(in)) {
+      squidwcs_error(SQUIDWCS_ERR_IO, 0, "wcsimg_stream", "read failed");
+      fail=1;
+   }
+
+   if (clone != NULL) {
+      for (t=0; t<nthread; t++) wcsimg_free(&clone[t]);
+      free(clone);
+   }
+   free(xy);
+
+   return(fail ? -1 : 0);
+}
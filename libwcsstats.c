@@ -0,0 +1,285 @@
+//
+// Hot path instrumentation counters and timers
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define STATS_HAVE_TSC
+#endif
+
+// Counter kinds, first index of the per thread counter array
+#define STATS_CALLS 0
+#define STATS_TICKS 1
+#define STATS_WCSERR 2
+#define STATS_ALLOC 3
+#define STATS_NKIND 4
+
+static const char *stats_name[SQUIDWCS_STAT_N] = {
+   "wcs_pix2rd", "wcs_rd2pix", "wcs_pix2rd_batch", "wcs_rd2pix_batch", "wcs_clone",
+   "wcs_pool_init", "sip_read", "sip_readhdr", "sip_forward", "sip_reverse", "sip_compile",
+   "sip_forward_compiled", "sip_reverse_compiled", "sip_reverse_refine", "wcs_addsquid",
+   "squidset_init", "squidset_add", "wcs_getsquids", "wcs_getsquids_poly", "wcs_getsquids_moc",
+   "tile_getwcs", "tile_getwcsparam", "tile_wcsparam2wcs", "tile_addwcs"};
+
+#ifdef LIBSQUIDWCS_STATS
+
+// Counters of one thread.  Only the owning thread writes count, so it
+// needs no locking; base is the value at the last reset and is only
+// touched under stats_lock.
+struct stats_thread {
+   unsigned long long count[STATS_NKIND][SQUIDWCS_STAT_N];
+   unsigned long long base[STATS_NKIND][SQUIDWCS_STAT_N];
+   struct stats_thread *prev, *next; // list of the running threads
+};
+
+static pthread_mutex_t stats_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_list=NULL;
+static __thread struct stats_thread *stats_self __attribute__((tls_model("initial-exec")))=NULL;
+
+// Counts since the last reset of the threads that have exited, folded in
+// by stats_thread_exit so that stats_list only holds running threads
+static unsigned long long stats_retired[STATS_NKIND][SQUIDWCS_STAT_N];
+
+// Key whose destructor retires the counters of an exiting thread
+static pthread_once_t stats_once=PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static int stats_havekey=0;
+
+// Clock reading when the first thread was registered, for the tick to ns
+// conversion
+static int stats_started=0;
+static unsigned long long stats_tick0;
+static struct timespec stats_ts0;
+
+// Raw clock, cpu timestamp counter ticks where available, else ns
+unsigned long long squidwcs_stats_clock(void) {
+#ifdef STATS_HAVE_TSC
+   return(__rdtsc());
+#else
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return(ts.tv_sec*1000000000ULL+ts.tv_nsec);
+#endif
+}
+
+// Fold the counters of an exiting thread into stats_retired and drop them
+static void stats_thread_exit(void *arg) {
+   struct stats_thread *st=(struct stats_thread *)arg;
+   int kind, fn;
+
+   pthread_mutex_lock(&stats_lock);
+   for (kind=0; kind<STATS_NKIND; kind++) {
+      for (fn=0; fn<SQUIDWCS_STAT_N; fn++) stats_retired[kind][fn]+=st->count[kind][fn]-st->base[kind][fn];
+   }
+   if (st->prev != NULL) st->prev->next=st->next;
+   else stats_list=st->next;
+   if (st->next != NULL) st->next->prev=st->prev;
+   pthread_mutex_unlock(&stats_lock);
+   if (stats_self == st) stats_self=NULL;
+   free(st);
+}
+
+static void stats_key_init(void) {
+
+   stats_havekey=(pthread_key_create(&stats_key, stats_thread_exit) == 0);
+}
+
+// Counters of the calling thread, registered on first use.
+// Returns NULL if they cannot be allocated, the event is then not counted.
+static struct stats_thread *stats_thread_get(void) {
+   struct stats_thread *st;
+
+   if (stats_self != NULL) return(stats_self);
+   pthread_once(&stats_once, stats_key_init);
+   if ((st=(struct stats_thread *)calloc(1, sizeof(struct stats_thread))) == NULL) return(NULL);
+   pthread_mutex_lock(&stats_lock);
+   if (!stats_started) {
+      stats_tick0=squidwcs_stats_clock();
+      clock_gettime(CLOCK_MONOTONIC, &stats_ts0);
+      stats_started=1;
+   }
+   st->next=stats_list;
+   if (stats_list != NULL) stats_list->prev=st;
+   stats_list=st;
+   pthread_mutex_unlock(&stats_lock);
+   // without the key the block stays on the list when the thread exits
+   if (stats_havekey) pthread_setspecific(stats_key, st);
+   stats_self=st;
+
+   return(st);
+}
+
+// Add to a counter of the calling thread, a plain store as only this
+// thread writes it
+static inline void stats_add(struct stats_thread *st, int kind, int fn, unsigned long long n) {
+
+   __atomic_store_n(&st->count[kind][fn], st->count[kind][fn]+n, __ATOMIC_RELAXED);
+}
+
+// Close the call opened by SQUIDWCS_STATS_FN
+void squidwcs_stats_exit(struct squidwcs_stats_scope *scope) {
+   unsigned long long t1;
+   struct stats_thread *st;
+
+   t1=squidwcs_stats_clock();
+   if ((st=stats_thread_get()) == NULL) return;
+   stats_add(st, STATS_CALLS, scope->fn, 1);
+   stats_add(st, STATS_TICKS, scope->fn, t1-scope->t0);
+}
+
+// Count a wcslib error (what=0) or an allocation (what=1) in function fn
+void squidwcs_stats_count(int fn, int what) {
+   struct stats_thread *st;
+
+   if ((st=stats_thread_get()) == NULL) return;
+   stats_add(st, (what == 0) ? STATS_WCSERR : STATS_ALLOC, fn, 1);
+}
+
+// Nanoseconds per clock tick, measured against the monotonic clock since
+// the first thread was registered.  Call without stats_lock held: if
+// that was less than 10 ms ago this sleeps until it is not, and must not
+// hold up threads registering meanwhile.
+static double stats_tick2ns(void) {
+#ifdef STATS_HAVE_TSC
+   struct timespec ts, ts0, wait={0, 10000000};
+   unsigned long long tick, tick0;
+   double ns;
+   int started;
+
+   pthread_mutex_lock(&stats_lock);
+   started=stats_started;
+   tick0=stats_tick0;
+   ts0=stats_ts0;
+   pthread_mutex_unlock(&stats_lock);
+   if (!started) return(1.0);
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   ns=1e9*(ts.tv_sec-ts0.tv_sec)+(ts.tv_nsec-ts0.tv_nsec);
+   if (ns < 1e7) {
+      // too short to calibrate, wait a bit
+      nanosleep(&wait, NULL);
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ns=1e9*(ts.tv_sec-ts0.tv_sec)+(ts.tv_nsec-ts0.tv_nsec);
+   }
+   tick=squidwcs_stats_clock();
+
+   return((tick > tick0) ? ns/(tick-tick0) : 1.0);
+#else
+   return(1.0);
+#endif
+}
+
+#endif //LIBSQUIDWCS_STATS
+
+// Returns 1 if the library was built with instrumentation, else 0
+int squidwcs_stats_enabled(void) {
+
+#ifdef LIBSQUIDWCS_STATS
+   return(1);
+#else
+   return(0);
+#endif
+}
+
+//
+// Fill stats with the counters of every instrumented function (at most
+// nstats, SQUIDWCS_STAT_N covers all), summed over all threads since the
+// last squidwcs_stats_reset.  Counts of threads still running may lag by
+// the calls in progress.
+// Function returns the number of entries filled
+//
+int squidwcs_stats_get(struct squidwcs_stat stats[], int nstats) {
+   int fn;
+#ifdef LIBSQUIDWCS_STATS
+   struct stats_thread *st;
+   unsigned long long ticks;
+   double tick2ns;
+#endif
+
+   if (nstats > SQUIDWCS_STAT_N) nstats=SQUIDWCS_STAT_N;
+   for (fn=0; fn<nstats; fn++) {
+      memset(&stats[fn], 0, sizeof(struct squidwcs_stat));
+      stats[fn].name=stats_name[fn];
+   }
+#ifdef LIBSQUIDWCS_STATS
+   tick2ns=stats_tick2ns();
+   pthread_mutex_lock(&stats_lock);
+   for (fn=0; fn<nstats; fn++) {
+      stats[fn].calls=stats_retired[STATS_CALLS][fn];
+      ticks=stats_retired[STATS_TICKS][fn];
+      stats[fn].wcserr=stats_retired[STATS_WCSERR][fn];
+      stats[fn].alloc=stats_retired[STATS_ALLOC][fn];
+      for (st=stats_list; st!=NULL; st=st->next) {
+         stats[fn].calls+=__atomic_load_n(&st->count[STATS_CALLS][fn], __ATOMIC_RELAXED)-st->base[STATS_CALLS][fn];
+         ticks+=__atomic_load_n(&st->count[STATS_TICKS][fn], __ATOMIC_RELAXED)-st->base[STATS_TICKS][fn];
+         stats[fn].wcserr+=__atomic_load_n(&st->count[STATS_WCSERR][fn], __ATOMIC_RELAXED)-st->base[STATS_WCSERR][fn];
+         stats[fn].alloc+=__atomic_load_n(&st->count[STATS_ALLOC][fn], __ATOMIC_RELAXED)-st->base[STATS_ALLOC][fn];
+      }
+      stats[fn].ns=(unsigned long long)(ticks*tick2ns+0.5);
+   }
+   pthread_mutex_unlock(&stats_lock);
+#endif
+
+   return(nstats);
+}
+
+// Zero all counters, for all threads
+void squidwcs_stats_reset(void) {
+#ifdef LIBSQUIDWCS_STATS
+   struct stats_thread *st;
+   int kind, fn;
+
+   pthread_mutex_lock(&stats_lock);
+   memset(stats_retired, 0, sizeof(stats_retired));
+   for (st=stats_list; st!=NULL; st=st->next) {
+      for (kind=0; kind<STATS_NKIND; kind++) {
+         for (fn=0; fn<SQUIDWCS_STAT_N; fn++) {
+            st->base[kind][fn]=__atomic_load_n(&st->count[kind][fn], __ATOMIC_RELAXED);
+         }
+      }
+   }
+   pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+// Print a table of the functions called since the last reset
+void squidwcs_stats_dump(FILE *out) {
+   struct squidwcs_stat stats[SQUIDWCS_STAT_N];
+   int fn, n;
+
+   if (!squidwcs_stats_enabled()) {
+      fprintf(out, "libsquid_wcs built without LIBSQUIDWCS_STATS, no counters\n");
+      return;
+   }
+   n=squidwcs_stats_get(stats, SQUIDWCS_STAT_N);
+   fprintf(out, "%-22s %12s %12s %10s %10s %10s\n", "function", "calls", "total ms", "ns/call", "wcserr", "alloc");
+   for (fn=0; fn<n; fn++) {
+      if (stats[fn].calls == 0) continue;
+      fprintf(out, "%-22s %12llu %12.3f %10.1f %10llu %10llu\n", stats[fn].name, stats[fn].calls, 1e-6*stats[fn].ns,
+              (double)stats[fn].ns/stats[fn].calls, stats[fn].wcserr, stats[fn].alloc);
+   }
+}
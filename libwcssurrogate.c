@@ -0,0 +1,301 @@
+//
+// Adaptive interpolating surrogate of pixel to sky (or pixel) transforms
+//
+// -------------------------- LICENSE -----------------------------------
+//
+// This file is part of the LibSQUID software libraray.
+//
+// LibSQUID is free software: you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// LibSQUID is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with LibSQUID.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014 James Wren and Los Alamos National Laboratory
+//
+
+
+#include <libsquid_wcs.h>
+
+// Offsets (in cell units) of the points where a fitted cell is checked
+// against the exact transform
+static const double surrogate_chk[4][2] = {{0.25,0.25}, {0.75,0.25}, {0.25,0.75}, {0.75,0.75}};
+
+// Quadratic Lagrange weights for nodes at s=0, 1/2, 1
+static inline void surrogate_weights(double s, double w[3]) {
+
+   w[0]=2.0*(s-0.5)*(s-1.0);
+   w[1]=-4.0*s*(s-1.0);
+   w[2]=2.0*s*(s-0.5);
+}
+
+// Interpolate the ncomp values of leaf samples val (3x3 nodes, row major)
+// at cell coords s,t
+static inline void surrogate_interp(const double *val, int ncomp, double s, double t, double *out) {
+   double ws[3],wt[3];
+   const double *v;
+   int c;
+
+   surrogate_weights(s, ws);
+   surrogate_weights(t, wt);
+   for (c=0; c<ncomp; c++) {
+      v=val+c;
+      out[c]=wt[0]*(ws[0]*v[0]+ws[1]*v[ncomp]+ws[2]*v[2*ncomp])+
+             wt[1]*(ws[0]*v[3*ncomp]+ws[1]*v[4*ncomp]+ws[2]*v[5*ncomp])+
+             wt[2]*(ws[0]*v[6*ncomp]+ws[1]*v[7*ncomp]+ws[2]*v[8*ncomp]);
+   }
+}
+
+// Add n cells to sur, returning the index of the first one or -1
+static long surrogate_newcell(struct wcs_surrogate *sur, long n) {
+   struct wcs_surrogate_cell *cell;
+   long i;
+
+   if (sur->ncell+n > sur->ncellalloc) {
+      cell=(struct wcs_surrogate_cell *)realloc(sur->cell, 2*(sur->ncellalloc+n)*sizeof(struct wcs_surrogate_cell));
+      if (cell == NULL) {
+         fprintf(stderr, "realloc failed in wcs_surrogate_init\n");
+         return(-1);
+      }
+      sur->cell=cell;
+      sur->ncellalloc=2*(sur->ncellalloc+n);
+   }
+   i=sur->ncell;
+   sur->ncell+=n;
+
+   return(i);
+}
+
+// Add the samples of a leaf to sur, returning the index of the leaf or -1
+static long surrogate_newleaf(struct wcs_surrogate *sur, const double *val) {
+   double *v;
+
+   if (sur->nleaf >= sur->nleafalloc) {
+      v=(double *)realloc(sur->val, 2*(sur->nleafalloc+16)*9*sur->ncomp*sizeof(double));
+      if (v == NULL) {
+         fprintf(stderr, "realloc failed in wcs_surrogate_init\n");
+         return(-1);
+      }
+      sur->val=v;
+      sur->nleafalloc=2*(sur->nleafalloc+16);
+   }
+   memcpy(sur->val+sur->nleaf*9*sur->ncomp, val, 9*sur->ncomp*sizeof(double));
+
+   return(sur->nleaf++);
+}
+
+//
+// Fit cell ic covering x0..x0+w, y0..y0+h: sample the exact transform on
+// 3x3 nodes, and check the quadratic interpolation at 4 more points.  If
+// the error is above tolerance (or some samples are bad) the cell is split
+// in 4 and each quarter fitted in turn.  Cells with all samples bad, and
+// cells that are still not good at SURROGATE_MINSIZE pixels, are left to
+// the exact transform.
+// Function returns 0 on success and -1 on failure
+//
+static int surrogate_build(struct wcs_surrogate *sur, long ic, double x0, double y0, double w, double h, int depth) {
+   double x[13],y[13]; // 9 nodes then 4 check points
+   double out[13*SURROGATE_MAXCOMP]; // exact values
+   double fit[SURROGATE_MAXCOMP]; // interpolated value
+   double err=0.0, e;
+   long child, leaf;
+   int i,c,good,nbad;
+
+   sur->cell[ic].x0=x0;
+   sur->cell[ic].y0=y0;
+   sur->cell[ic].w=w;
+   sur->cell[ic].h=h;
+   sur->cell[ic].child=-1;
+   sur->cell[ic].leaf=-1;
+   if (depth > sur->depth) sur->depth=depth;
+
+   for (i=0; i<9; i++) {
+      x[i]=x0+0.5*w*(i%3);
+      y[i]=y0+0.5*h*(i/3);
+   }
+   for (i=0; i<4; i++) {
+      x[9+i]=x0+surrogate_chk[i][0]*w;
+      y[9+i]=y0+surrogate_chk[i][1]*h;
+   }
+   if (sur->fn(sur->ctx, 13, x, y, out) < 0) return(-1);
+   nbad=0;
+   for (i=0; i<13; i++) {
+      for (c=0; c<sur->ncomp; c++) {
+         if (!isfinite(out[i*sur->ncomp+c])) break;
+      }
+      if (c < sur->ncomp) nbad++;
+   }
+   if (nbad == 13) {
+      // assume the cell is all outside the transform
+      sur->nexact++;
+      return(0);
+   }
+   good=(nbad == 0);
+   for (i=0; (good)&&(i<4); i++) {
+      surrogate_interp(out, sur->ncomp, surrogate_chk[i][0], surrogate_chk[i][1], fit);
+      for (c=0; c<sur->ncomp; c++) {
+         e=fabs(fit[c]-out[(9+i)*sur->ncomp+c]);
+         if (e > err) err=e;
+      }
+   }
+   if ((good)&&(err <= sur->tol)) {
+      if ((leaf=surrogate_newleaf(sur, out)) < 0) return(-1);
+      sur->cell[ic].leaf=leaf;
+      if (err > sur->maxerr) sur->maxerr=err;
+      return(0);
+   }
+   if ((w <= SURROGATE_MINSIZE)&&(h <= SURROGATE_MINSIZE)) {
+      // leave this cell to the exact transform
+      sur->nexact++;
+      return(0);
+   }
+
+   // split in 4, children are reserved first so they stay contiguous
+   if ((child=surrogate_newcell(sur, 4)) < 0) return(-1);
+   sur->cell[ic].child=child;
+   w*=0.5;
+   h*=0.5;
+   if ((surrogate_build(sur, child, x0, y0, w, h, depth+1) < 0)||
+       (surrogate_build(sur, child+1, x0+w, y0, w, h, depth+1) < 0)||
+       (surrogate_build(sur, child+2, x0, y0+h, w, h, depth+1) < 0)||
+       (surrogate_build(sur, child+3, x0+w, y0+h, w, h, depth+1) < 0)) return(-1);
+
+   return(0);
+}
+
+//
+// Build a surrogate of the transform fn over an image of naxes pixels
+// (x,y from 0.5 to naxes+0.5).  fn(ctx, n, x, y, out) must write ncomp
+// (<= SURROGATE_MAXCOMP) values per point to out, non finite for points
+// it cannot transform, and return 0 or -1 on failure.  The image is
+// split adaptively (quadtree) into cells on which quadratic
+// interpolation of 3x3 exact samples is within tol of the exact values,
+// as measured at 4 extra points per cell; the largest error measured is
+// kept in sur->maxerr.  Free with wcs_surrogate_free.
+// Function returns 0 on success and -1 on failure
+//
+int wcs_surrogate_initfn(struct wcs_surrogate *sur, surrogate_fn fn, void *ctx, int ncomp, long naxes[], double tol) {
+
+   memset(sur, 0, sizeof(struct wcs_surrogate));
+   if ((ncomp < 1)||(ncomp > SURROGATE_MAXCOMP)||(naxes[0] < 1)||(naxes[1] < 1)||(!(tol > 0.0))) {
+      fprintf(stderr, "bad argument in wcs_surrogate_initfn\n");
+      return(-1);
+   }
+   sur->fn=fn;
+   sur->ctx=ctx;
+   sur->ncomp=ncomp;
+   sur->tol=tol;
+   if ((surrogate_newcell(sur, 1) < 0)||
+       (surrogate_build(sur, 0, 0.5, 0.5, (double)naxes[0], (double)naxes[1], 0) < 0)) {
+      fprintf(stderr, "surrogate_build failed in wcs_surrogate_initfn\n");
+      wcs_surrogate_free(sur);
+      return(-1);
+   }
+
+   return(0);
+}
+
+// Free memory held by sur
+void wcs_surrogate_free(struct wcs_surrogate *sur) {
+
+   free(sur->cell);
+   free(sur->val);
+   sur->cell=NULL;
+   sur->val=NULL;
+   sur->ncell=0;
+   sur->nleaf=0;
+}
+
+//
+// Evaluate the surrogate at image x,y into out (ncomp values).  Points in
+// cells left to the exact transform, or outside the image, are passed to
+// fn with context ctx (NULL for the one given to wcs_surrogate_initfn), so
+// threads that share sur can each pass their own context.
+// Function returns 0 on success and -1 on failure
+//
+int wcs_surrogate_eval(const struct wcs_surrogate *sur, void *ctx, double x, double y, double *out) {
+   const struct wcs_surrogate_cell *cell;
+
+   cell=sur->cell;
+   if ((sur->ncell > 0)&&(x >= cell->x0)&&(y >= cell->y0)&&(x <= cell->x0+cell->w)&&(y <= cell->y0+cell->h)) {
+      while (cell->child >= 0) {
+         cell=sur->cell+cell->child+((x >= cell->x0+0.5*cell->w) ? 1 : 0)+((y >= cell->y0+0.5*cell->h) ? 2 : 0);
+      }
+      if (cell->leaf >= 0) {
+         surrogate_interp(sur->val+cell->leaf*9*sur->ncomp, sur->ncomp, (x-cell->x0)/cell->w, (y-cell->y0)/cell->h, out);
+         return(0);
+      }
+   }
+
+   return(sur->fn((ctx != NULL) ? ctx : sur->ctx, 1, &x, &y, out));
+}
+
+// Transform used by wcs_surrogate_init: image x,y to sky unit vectors
+static int surrogate_pix2vec(void *ctx, long n, const double *x, const double *y, double *out) {
+   double ra[13],dec[13]; // at most 13 points per call from the fit, 1 from eval
+   long i;
+
+   if (n > 13) return(-1);
+   if (wcs_pix2rd_batch((struct wcsprm *)ctx, n, x, y, 1, ra, dec, 1, NULL) < 0) return(-1);
+   for (i=0; i<n; i++) {
+      out[3*i]=cos(dec[i]*DD2R)*cos(ra[i]*DD2R);
+      out[3*i+1]=cos(dec[i]*DD2R)*sin(ra[i]*DD2R);
+      out[3*i+2]=sin(dec[i]*DD2R);
+   }
+
+   return(0);
+}
+
+//
+// Build a surrogate of wcs_pix2rd for wcs over an image of naxes pixels,
+// accurate to tol degrees.  Sky positions are interpolated as unit
+// vectors so there is no trouble at ra=0/360 or near the poles.
+// Function returns 0 on success and -1 on failure
+//
+int wcs_surrogate_init(struct wcs_surrogate *sur, struct wcsprm *wcs, long naxes[], double tol) {
+
+   return(wcs_surrogate_initfn(sur, surrogate_pix2vec, wcs, 3, naxes, tol*DD2R));
+}
+
+//
+// Same as wcs_pix2rd using the surrogate built by wcs_surrogate_init.
+// wcs is used for points the surrogate does not cover (NULL for the wcs
+// given to wcs_surrogate_init), see wcs_surrogate_eval.
+// Function returns 0 on success and -1 on failure
+//
+int wcs_surrogate_pix2rd(const struct wcs_surrogate *sur, struct wcsprm *wcs, double x, double y, double *ra, double *dec) {
+   double v[3],r;
+
+   if (wcs_surrogate_eval(sur, wcs, x, y, v) < 0) return(-1);
+   r=sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+   if (!(r > 0.0)) return(-1);
+   *ra=atan2(v[1],v[0])/DD2R;
+   if (*ra < 0.0) *ra+=360.0;
+   *dec=asin(v[2]/r)/DD2R;
+
+   return(0);
+}
+
+// Batch version of wcs_surrogate_pix2rd.  Bad points get ra,dec set to NAN.
+// Returns the number of bad points.
+int wcs_surrogate_pix2rd_batch(const struct wcs_surrogate *sur, struct wcsprm *wcs, long n, const double *x, const double *y, double *ra, double *dec) {
+   long i;
+   int nbad=0;
+
+   for (i=0; i<n; i++) {
+      if (wcs_surrogate_pix2rd(sur, wcs, x[i], y[i], &ra[i], &dec[i]) < 0) {
+         ra[i]=NAN;
+         dec[i]=NAN;
+         nbad++;
+      }
+   }
+
+   return(nbad);
+}
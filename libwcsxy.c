@@ -28,11 +28,13 @@
 int wcs_pix2rd(struct wcsprm *wcs, double x, double y, double *ra, double *dec) {
    double pixcrd[2],imgcrd[2],phi[1],theta[1],wcor[2];
    int status, wstat[1];
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_PIX2RD);
 
    pixcrd[0]=x;
    pixcrd[1]=y;
    if ((status=wcsp2s(wcs,1,2,pixcrd,imgcrd,phi,theta,wcor,wstat)) > 0) {
-      fprintf(stderr, "wcsp2s returned status=%d wstat=%d in hpxwcs_pix2rd()\n", status, wstat[0]);
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_PIX2RD);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_pix2rd", "wcsp2s failed");
       return(-1);
    }
    *ra = wcor[0];
@@ -46,12 +48,14 @@ int wcs_pix2rd(struct wcsprm *wcs, double x, double y, double *ra, double *dec)
 int wcs_rd2pix(struct wcsprm *wcs, double ra, double dec, double *x, double *y) {
    double pixcrd[2],imgcrd[2],phi[1],theta[1],wcor[2];
    int status, wstat[1];
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_RD2PIX);
 
    wcor[0]=ra;
    wcor[1]=dec;
    if ((status=wcss2p(wcs,1,2,wcor,phi,theta,imgcrd,pixcrd,wstat)) > 0) {
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_RD2PIX);
       //fprintf(stderr, "wcss2p returned status=%d in wcs_rd2pix\n", status);
-      fprintf(stderr,"wcss2p returned status=%d wstat=%d in wcs_rd2pix\n", status, wstat[0]);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_rd2pix", "wcss2p failed");
       return(-1);
    }
    *x = pixcrd[0];
@@ -60,6 +64,229 @@ int wcs_rd2pix(struct wcsprm *wcs, double ra, double dec, double *x, double *y)
    return(0);
 }
 
+// Number of points handed to wcslib per call in the batch conversions.
+// Large enough to amortize the per-call overhead, small enough that the
+// scratch arrays stay in cache.
+#define WCS_BATCH_BLOCK 1024
+
+// Batch version of wcs_pix2rd.  Converts n image x,y points to sky ra,dec
+// (in deg), handing whole blocks to wcsp2s instead of one point per call.
+// x,y are read with stride xystride and ra,dec written with stride rdstride
+// (in elements, so plain arrays use 1).  If stat is not NULL, stat[i] is set
+// to 0 for a good point and to the wcslib status for a bad one.  Bad points
+// get ra,dec set to NAN and do not stop the conversion.
+// Returns the number of bad points, or -1 on failure.
+int wcs_pix2rd_batch(struct wcsprm *wcs, long n, const double *x, const double *y, long xystride, double *ra, double *dec, long rdstride, int stat[]) {
+   double *pixcrd,*imgcrd,*phi,*theta,*wcor; // wcslib scratch arrays
+   int *wstat; // per point wcslib status
+   long i,i0,nblk,nbad;
+   int status;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_PIX2RD_BATCH);
+
+   if (n <= 0) return(0);
+   nblk=(n < WCS_BATCH_BLOCK) ? n : WCS_BATCH_BLOCK;
+   pixcrd=(double *)malloc(8*nblk*sizeof(double));
+   wstat=(int *)malloc(nblk*sizeof(int));
+   if ((pixcrd == NULL)||(wstat == NULL)) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcs_pix2rd_batch", "malloc failed");
+      free(pixcrd);
+      free(wstat);
+      return(-1);
+   }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_PIX2RD_BATCH);
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_PIX2RD_BATCH);
+   imgcrd=pixcrd+2*nblk;
+   wcor=imgcrd+2*nblk;
+   phi=wcor+2*nblk;
+   theta=phi+nblk;
+
+   nbad=0;
+   for (i0=0; i0<n; i0=i0+nblk) {
+      if (n-i0 < nblk) nblk=n-i0;
+      for (i=0; i<nblk; i++) {
+         pixcrd[2*i]=x[(i0+i)*xystride];
+         pixcrd[2*i+1]=y[(i0+i)*xystride];
+      }
+      // WCSERR_BAD_PIX only flags bad points, the rest of the block is still valid
+      if (((status=wcsp2s(wcs,(int)nblk,2,pixcrd,imgcrd,phi,theta,wcor,wstat)) > 0) && (status != WCSERR_BAD_PIX)) {
+         SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_PIX2RD_BATCH);
+         squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_pix2rd_batch", "wcsp2s failed");
+         free(pixcrd);
+         free(wstat);
+         return(-1);
+      }
+      if (status) SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_PIX2RD_BATCH);
+      for (i=0; i<nblk; i++) {
+         if (status && wstat[i]) {
+            ra[(i0+i)*rdstride]=NAN;
+            dec[(i0+i)*rdstride]=NAN;
+            nbad++;
+         } else {
+            ra[(i0+i)*rdstride]=wcor[2*i];
+            dec[(i0+i)*rdstride]=wcor[2*i+1];
+         }
+         if (stat != NULL) stat[i0+i]=(status ? wstat[i] : 0);
+      }
+   }
+   free(pixcrd);
+   free(wstat);
+
+   return(nbad);
+}
+
+// Batch version of wcs_rd2pix.  Converts n sky ra,dec points (in deg) to
+// image x,y, handing whole blocks to wcss2p.  Strides, stat, NAN output and
+// the return value work as in wcs_pix2rd_batch.
+int wcs_rd2pix_batch(struct wcsprm *wcs, long n, const double *ra, const double *dec, long rdstride, double *x, double *y, long xystride, int stat[]) {
+   double *pixcrd,*imgcrd,*phi,*theta,*wcor; // wcslib scratch arrays
+   int *wstat; // per point wcslib status
+   long i,i0,nblk,nbad;
+   int status;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_RD2PIX_BATCH);
+
+   if (n <= 0) return(0);
+   nblk=(n < WCS_BATCH_BLOCK) ? n : WCS_BATCH_BLOCK;
+   pixcrd=(double *)malloc(8*nblk*sizeof(double));
+   wstat=(int *)malloc(nblk*sizeof(int));
+   if ((pixcrd == NULL)||(wstat == NULL)) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcs_rd2pix_batch", "malloc failed");
+      free(pixcrd);
+      free(wstat);
+      return(-1);
+   }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_RD2PIX_BATCH);
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_RD2PIX_BATCH);
+   imgcrd=pixcrd+2*nblk;
+   wcor=imgcrd+2*nblk;
+   phi=wcor+2*nblk;
+   theta=phi+nblk;
+
+   nbad=0;
+   for (i0=0; i0<n; i0=i0+nblk) {
+      if (n-i0 < nblk) nblk=n-i0;
+      for (i=0; i<nblk; i++) {
+         wcor[2*i]=ra[(i0+i)*rdstride];
+         wcor[2*i+1]=dec[(i0+i)*rdstride];
+      }
+      // WCSERR_BAD_WORLD only flags bad points, the rest of the block is still valid
+      if (((status=wcss2p(wcs,(int)nblk,2,wcor,phi,theta,imgcrd,pixcrd,wstat)) > 0) && (status != WCSERR_BAD_WORLD)) {
+         SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_RD2PIX_BATCH);
+         squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_rd2pix_batch", "wcss2p failed");
+         free(pixcrd);
+         free(wstat);
+         return(-1);
+      }
+      if (status) SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_RD2PIX_BATCH);
+      for (i=0; i<nblk; i++) {
+         if (status && wstat[i]) {
+            x[(i0+i)*xystride]=NAN;
+            y[(i0+i)*xystride]=NAN;
+            nbad++;
+         } else {
+            x[(i0+i)*xystride]=pixcrd[2*i];
+            y[(i0+i)*xystride]=pixcrd[2*i+1];
+         }
+         if (stat != NULL) stat[i0+i]=(status ? wstat[i] : 0);
+      }
+   }
+   free(pixcrd);
+   free(wstat);
+
+   return(nbad);
+}
+
+// Make an independent deep copy of a wcs struct with wcssub, ready to use
+// (wcsset already called).  Free the copy with wcs_free.
+// Function returns 0 on success and -1 on failure
+int wcs_clone(const struct wcsprm *wcs, struct wcsprm **clone) {
+   struct wcsprm *wcs0; // temp wcs pointer
+   int status; // output from wcslib
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_CLONE);
+
+   wcs0=(struct wcsprm *)malloc(sizeof(struct wcsprm));
+   if (wcs0 == NULL) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcs_clone", "malloc failed");
+      return(-1);
+   }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_CLONE);
+   wcs0->flag=-1;
+   if ((status=wcssub(1, wcs, 0x0, 0x0, wcs0))) {
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_CLONE);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_clone", "wcssub failed");
+      free(wcs0);
+      return(-1);
+   }
+   if ((status=wcsset(wcs0))) {
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_CLONE);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_clone", "wcsset failed");
+      wcs_free(wcs0);
+      return(-1);
+   }
+   *clone=wcs0;
+
+   return(0);
+}
+
+// Set up one private copy of wcs for each of nthread threads.
+// wcslib writes into the wcsprm it converts with (lazy wcsset, error
+// records and distortion scratch space), so one wcsprm must never be used
+// by two threads at once.  Call this once from a single thread; wcs is
+// prepared with wcsset and cloned, and is not modified afterwards.  Each
+// thread then uses only wcs_pool_get(pool, tid) for its conversions,
+// while wcs itself may still be used by the calling thread.
+// Function returns 0 on success and -1 on failure
+int wcs_pool_init(struct wcs_pool *pool, struct wcsprm *wcs, int nthread) {
+   int i,status;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_WCS_POOL_INIT);
+
+   pool->n=0;
+   pool->wcs=NULL;
+   if (nthread < 1) {
+      squidwcs_error(SQUIDWCS_ERR_ARG, 0, "wcs_pool_init", "invalid nthread");
+      return(-1);
+   }
+   if ((status=wcsset(wcs))) {
+      SQUIDWCS_STATS_WCSERR(SQUIDWCS_STAT_WCS_POOL_INIT);
+      squidwcs_error(SQUIDWCS_ERR_WCSLIB, status, "wcs_pool_init", "wcsset failed");
+      return(-1);
+   }
+   pool->wcs=(struct wcsprm **)calloc(nthread,sizeof(struct wcsprm *));
+   if (pool->wcs == NULL) {
+      squidwcs_error(SQUIDWCS_ERR_ALLOC, 0, "wcs_pool_init", "calloc failed");
+      return(-1);
+   }
+   SQUIDWCS_STATS_ALLOC(SQUIDWCS_STAT_WCS_POOL_INIT);
+   for (i=0; i<nthread; i++) {
+      if (wcs_clone(wcs, &pool->wcs[i]) < 0) {
+         wcs_pool_free(pool);
+         return(-1);
+      }
+      pool->n++;
+   }
+
+   return(0);
+}
+
+// Get the private wcs struct of thread tid (0 <= tid < nthread)
+struct wcsprm *wcs_pool_get(struct wcs_pool *pool, int tid) {
+
+   if ((tid < 0)||(tid >= pool->n)) return(NULL);
+
+   return(pool->wcs[tid]);
+}
+
+// Free all per thread wcs structs
+void wcs_pool_free(struct wcs_pool *pool) {
+   int i;
+
+   if (pool->wcs != NULL) {
+      for (i=0; i<pool->n; i++) wcs_free(pool->wcs[i]);
+   }
+   free(pool->wcs);
+   pool->wcs=NULL;
+   pool->n=0;
+}
+
 // Read in SIP keywords from header.
 // Returns: sip parameter structure pointer
 //          sparam->have_sip set to 0 if no sip params fournd and rest left undefined
@@ -72,14 +299,14 @@ int sip_read(fitsfile *fptr, struct sip_param *sparam) {
    char tmp_comment[100]; // fits header comment
    int status=0;  // cfitsio error status
    int i,j; // loop counters
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_READ);
 
    // First check if the wcs has SIP distortions or not using the CTYPE1 card.
    if (fits_read_key(fptr, TSTRING, "CTYPE1", tmp_str, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    if (strstr(tmp_str, "-SIP") == NULL) {
-      printf("The fits header does not have SIP parameters\n");
       sparam->have_sip=0;
       return(0);      
    } else {
@@ -88,47 +315,58 @@ int sip_read(fitsfile *fptr, struct sip_param *sparam) {
 
    // Read in crval1, crval2, crpix1, crpix2
    if (fits_read_key(fptr, TDOUBLE, "CRVAL1", &tmp_double, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    sparam->crval1=tmp_double;
    if (fits_read_key(fptr, TDOUBLE, "CRVAL2", &tmp_double, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    sparam->crval2=tmp_double;
    if (fits_read_key(fptr, TDOUBLE, "CRPIX1", &tmp_double, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    sparam->crpix1=tmp_double;
    if (fits_read_key(fptr, TDOUBLE, "CRPIX2", &tmp_double, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    sparam->crpix2=tmp_double;
 
    // Next read in the sip order parameters
    if (fits_read_key(fptr, TINT, "A_ORDER", &tmp_int, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    sparam->a_order=tmp_int;
    if (fits_read_key(fptr, TINT, "B_ORDER", &tmp_int, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
+      squidwcs_error(SQUIDWCS_ERR_FITSIO, status, "sip_read", "fits_read_key failed");
       return(-1);
    }
    sparam->b_order=tmp_int;
+   // the reverse coefficients are optional, without them the reverse
+   // transform is solved by iteration (see sip_setinverse)
+   sparam->have_inv=1;
    if (fits_read_key(fptr, TINT, "AP_ORDER", &tmp_int, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
-      return(-1);
+      sparam->have_inv=0;
+      status=0;
+      fits_clear_errmsg();
    }
    sparam->ap_order=tmp_int;
-   if (fits_read_key(fptr, TINT, "BP_ORDER", &tmp_int, tmp_comment, &status)) {
-      fits_report_error(stderr, status);
-      return(-1);
+   if ((sparam->have_inv)&&(fits_read_key(fptr, TINT, "BP_ORDER", &tmp_int, tmp_comment, &status))) {
+      sparam->have_inv=0;
+      status=0;
+      fits_clear_errmsg();
    }
    sparam->bp_order=tmp_int;
+   if (!sparam->have_inv) {
+      sparam->ap_order=0;
+      sparam->bp_order=0;
+      sparam->ap[0][0]=0.0;
+      sparam->bp[0][0]=0.0;
+   }
 
    // Now populate matrices
    for (i=0; i<=sparam->a_order; i++) {
@@ -155,7 +393,7 @@ int sip_read(fitsfile *fptr, struct sip_param *sparam) {
          }
       }
    }
-   for (i=0; i<=sparam->ap_order; i++) {
+   for (i=0; (sparam->have_inv)&&(i<=sparam->ap_order); i++) {
       for (j=0; j<=sparam->ap_order; j++) {
          sprintf(tmp_key,"AP_%d_%d",i,j);
          if (fits_read_key(fptr,TDOUBLE, tmp_key, &tmp_double, tmp_comment, &status)) {
@@ -167,7 +405,7 @@ int sip_read(fitsfile *fptr, struct sip_param *sparam) {
          }
       }
    }
-   for (i=0; i<=sparam->bp_order; i++) {
+   for (i=0; (sparam->have_inv)&&(i<=sparam->bp_order); i++) {
       for (j=0; j<=sparam->bp_order; j++) {
          sprintf(tmp_key,"BP_%d_%d",i,j);
          if (fits_read_key(fptr,TDOUBLE, tmp_key, &tmp_double, tmp_comment, &status)) {
@@ -183,11 +421,91 @@ int sip_read(fitsfile *fptr, struct sip_param *sparam) {
    return(0);
 }
 
+// Same as sip_read but from a header string of nkeyrec 80 char cards, as
+// returned by fits_hdr2str, in a single pass over the cards.
+// Function returns 0 on success and -1 on failure
+int sip_readhdr(const char *header, int nkeyrec, struct sip_param *sparam) {
+   char card[FLEN_CARD]; // NUL terminated copy of a card
+   char keyname[FLEN_KEYWORD]; // card keyword
+   char value[FLEN_VALUE]; // card value string
+   char comment[FLEN_COMMENT]; // card comment
+   int status=0;  // cfitsio error status
+   int nref=0; // number of crval/crpix keys found
+   int i,j,k; // loop counters
+   double (*coef)[SIP_ARRAY_MAX]; // matrix for an A_i_j style key
+   int *order; // order for an A_ORDER style key
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_READHDR);
+
+   memset(sparam, 0, sizeof(struct sip_param));
+   sparam->a_order=sparam->b_order=sparam->ap_order=sparam->bp_order=-1;
+   for (k=0; k<nkeyrec; k++) {
+      memcpy(card, header+80*k, 80);
+      card[80]='\0';
+      if (!card_keyword(card, keyname)) continue;
+      status=0;
+      if (fits_parse_value(card, value, comment, &status)) continue;
+      if (strcmp(keyname, "CTYPE1") == 0) {
+         if (strstr(value, "-SIP") != NULL) sparam->have_sip=1;
+         continue;
+      }
+      if (strcmp(keyname, "CRVAL1") == 0) { sparam->crval1=atof(value); nref++; continue; }
+      if (strcmp(keyname, "CRVAL2") == 0) { sparam->crval2=atof(value); nref++; continue; }
+      if (strcmp(keyname, "CRPIX1") == 0) { sparam->crpix1=atof(value); nref++; continue; }
+      if (strcmp(keyname, "CRPIX2") == 0) { sparam->crpix2=atof(value); nref++; continue; }
+
+      // orders and coefficients
+      order=NULL;
+      coef=NULL;
+      if (strcmp(keyname, "A_ORDER") == 0) order=&sparam->a_order;
+      else if (strcmp(keyname, "B_ORDER") == 0) order=&sparam->b_order;
+      else if (strcmp(keyname, "AP_ORDER") == 0) order=&sparam->ap_order;
+      else if (strcmp(keyname, "BP_ORDER") == 0) order=&sparam->bp_order;
+      else if (sscanf(keyname, "A_%d_%d", &i, &j) == 2) coef=sparam->a;
+      else if (sscanf(keyname, "B_%d_%d", &i, &j) == 2) coef=sparam->b;
+      else if (sscanf(keyname, "AP_%d_%d", &i, &j) == 2) coef=sparam->ap;
+      else if (sscanf(keyname, "BP_%d_%d", &i, &j) == 2) coef=sparam->bp;
+      if (order != NULL) {
+         *order=atoi(value);
+      } else if ((coef != NULL)&&(i >= 0)&&(i < SIP_ARRAY_MAX)&&(j >= 0)&&(j < SIP_ARRAY_MAX)) {
+         coef[i][j]=atof(value);
+      }
+   }
+   if (!sparam->have_sip) return(0);
+
+   if ((nref != 4)||(sparam->a_order < 0)||(sparam->b_order < 0)) {
+      squidwcs_error(SQUIDWCS_ERR_SIP, 0, "sip_readhdr", "missing SIP keywords");
+      return(-1);
+   }
+   // the reverse coefficients are optional, as in sip_read
+   sparam->have_inv=((sparam->ap_order >= 0)&&(sparam->bp_order >= 0));
+   if (!sparam->have_inv) {
+      sparam->ap_order=0;
+      sparam->bp_order=0;
+   }
+   if ((sparam->a_order >= SIP_ARRAY_MAX)||(sparam->b_order >= SIP_ARRAY_MAX)||
+       (sparam->ap_order >= SIP_ARRAY_MAX)||(sparam->bp_order >= SIP_ARRAY_MAX)) {
+      squidwcs_error(SQUIDWCS_ERR_SIP, 0, "sip_readhdr", "SIP order out of range");
+      return(-1);
+   }
+   // like sip_read, only coefficients up to the order are used
+   for (i=0; i<SIP_ARRAY_MAX; i++) {
+      for (j=0; j<SIP_ARRAY_MAX; j++) {
+         if ((i > sparam->a_order)||(j > sparam->a_order)) sparam->a[i][j]=0.0;
+         if ((i > sparam->b_order)||(j > sparam->b_order)) sparam->b[i][j]=0.0;
+         if ((i > sparam->ap_order)||(j > sparam->ap_order)) sparam->ap[i][j]=0.0;
+         if ((i > sparam->bp_order)||(j > sparam->bp_order)) sparam->bp[i][j]=0.0;
+      }
+   }
+
+   return(0);
+}
+
 // Apply SIP distortion if forward direction (going from image to sky/earth)
 int sip_forward(struct sip_param *sparam, double x, double y, double *xout, double *yout) {
    double f,g; // sip polynomial sums for x,y respectively
    double u,v; // pix values relative to crpix1 and crpix2
    int i,j; // loop counters
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_FORWARD);
 
    // get relative pixel locations
    u=x-sparam->crpix1;
@@ -219,6 +537,7 @@ int sip_reverse(struct sip_param *sparam, double x, double y, double *xout, doub
    double f,g; // sip polynomial sums for x,y respectively
    double u,v; // pix values relative to crpix1 and crpix2
    int i,j; // loop counters
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_REVERSE);
 
    // get relative pixel locations
    u=x-sparam->crpix1;
@@ -244,3 +563,199 @@ int sip_reverse(struct sip_param *sparam, double x, double y, double *xout, doub
 
    return(0);
 }
+
+// Pack the valid triangle of one pair of SIP coefficient matrices into
+// Horner order (i from order down to 0, then j from order-i down to 0),
+// interleaving x and y.  Terms beyond an axis' own order are zero.
+static void sip_pack(double xc[SIP_ARRAY_MAX][SIP_ARRAY_MAX], int xorder,
+      double yc[SIP_ARRAY_MAX][SIP_ARRAY_MAX], int yorder, int order, double *coef) {
+   int i,j,n; // loop counters, coef index
+
+   n=0;
+   for (i=order; i>=0; i--) {
+      for (j=order-i; j>=0; j--) {
+         coef[n++]=((i+j) <= xorder) ? xc[i][j] : 0.0;
+         coef[n++]=((i+j) <= yorder) ? yc[i][j] : 0.0;
+      }
+   }
+}
+
+// Evaluate both packed SIP polynomials at u,v using nested Horner form.
+static inline void sip_horner(const double *coef, int order, double u, double v, double *f, double *g) {
+   double pf,pg; // inner polynomials in v
+   double fs,gs; // outer sums in u
+   int i,j,n;
+
+   fs=0.0;
+   gs=0.0;
+   n=0;
+   for (i=order; i>=0; i--) {
+      pf=0.0;
+      pg=0.0;
+      for (j=order-i; j>=0; j--) {
+         pf=pf*v+coef[n++];
+         pg=pg*v+coef[n++];
+      }
+      fs=fs*u+pf;
+      gs=gs*u+pg;
+   }
+   *f=fs;
+   *g=gs;
+}
+
+// Build a compiled SIP representation from sip parameters read by sip_read.
+// Function returns 0 on success and -1 on failure
+int sip_compile(struct sip_param *sparam, struct sip_compiled *scomp) {
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_COMPILE);
+
+   memset(scomp, 0, sizeof(struct sip_compiled));
+   scomp->have_sip=sparam->have_sip;
+   if (!sparam->have_sip) return(0);
+
+   if ((sparam->a_order < 0)||(sparam->a_order >= SIP_ARRAY_MAX)||
+       (sparam->b_order < 0)||(sparam->b_order >= SIP_ARRAY_MAX)||
+       (sparam->ap_order < 0)||(sparam->ap_order >= SIP_ARRAY_MAX)||
+       (sparam->bp_order < 0)||(sparam->bp_order >= SIP_ARRAY_MAX)) {
+      squidwcs_error(SQUIDWCS_ERR_SIP, 0, "sip_compile", "SIP order out of range");
+      return(-1);
+   }
+   scomp->crpix1=sparam->crpix1;
+   scomp->crpix2=sparam->crpix2;
+   scomp->order=(sparam->a_order > sparam->b_order) ? sparam->a_order : sparam->b_order;
+   scomp->porder=(sparam->ap_order > sparam->bp_order) ? sparam->ap_order : sparam->bp_order;
+   sip_pack(sparam->a, sparam->a_order, sparam->b, sparam->b_order, scomp->order, scomp->fwd);
+   sip_pack(sparam->ap, sparam->ap_order, sparam->bp, sparam->bp_order, scomp->porder, scomp->rev);
+   scomp->have_inv=sparam->have_inv;
+   if (!scomp->have_inv) memset(scomp->rev, 0, sizeof(scomp->rev));
+   sip_setinverse(scomp, !scomp->have_inv, SIP_INV_TOL, SIP_INV_MAXITER);
+
+   return(0);
+}
+
+// Same as sip_forward but using the compiled polynomials
+int sip_forward_compiled(const struct sip_compiled *scomp, double x, double y, double *xout, double *yout) {
+   double f,g; // sip polynomial sums for x,y respectively
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_FORWARD_COMPILED);
+
+   sip_horner(scomp->fwd, scomp->order, x-scomp->crpix1, y-scomp->crpix2, &f, &g);
+   *xout=x+f;
+   *yout=y+g;
+
+   return(0);
+}
+
+// Same as sip_reverse but using the compiled polynomials.  If refinement
+// is on (see sip_setinverse) the AP,BP result is only the starting guess.
+// Function returns 0 on success and -1 if the refinement did not converge
+int sip_reverse_compiled(const struct sip_compiled *scomp, double x, double y, double *xout, double *yout) {
+   double f,g; // sip polynomial sums for x,y respectively
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_REVERSE_COMPILED);
+
+   sip_horner(scomp->rev, scomp->porder, x-scomp->crpix1, y-scomp->crpix2, &f, &g);
+   *xout=x+f;
+   *yout=y+g;
+   if (scomp->refine) return(sip_reverse_refine(scomp, 1, &x, &y, xout, yout, NULL) ? -1 : 0);
+
+   return(0);
+}
+
+// Evaluate both packed SIP polynomials and their partial derivatives at
+// u,v in the same nested Horner pass as sip_horner.
+static inline void sip_horner_grad(const double *coef, int order, double u, double v, double *f, double *g,
+      double *fu, double *fv, double *gu, double *gv) {
+   double pf,pg,dpf,dpg; // inner polynomials in v and their v derivatives
+   double fs,gs,fsu,gsu,fsv,gsv; // outer sums in u and their derivatives
+   int i,j,n;
+
+   fs=gs=fsu=gsu=fsv=gsv=0.0;
+   n=0;
+   for (i=order; i>=0; i--) {
+      pf=pg=dpf=dpg=0.0;
+      for (j=order-i; j>=0; j--) {
+         dpf=dpf*v+pf;
+         dpg=dpg*v+pg;
+         pf=pf*v+coef[n++];
+         pg=pg*v+coef[n++];
+      }
+      fsu=fsu*u+fs;
+      gsu=gsu*u+gs;
+      fsv=fsv*u+dpf;
+      gsv=gsv*u+dpg;
+      fs=fs*u+pf;
+      gs=gs*u+pg;
+   }
+   *f=fs;
+   *g=gs;
+   *fu=fsu;
+   *fv=fsv;
+   *gu=gsu;
+   *gv=gsv;
+}
+
+// Configure the reverse SIP transform of scomp.  With refine=0 the AP,BP
+// polynomials are used as is.  With refine=1 their result is refined by
+// Newton iteration against the forward A,B polynomials (with analytic
+// Jacobian) until the step is below tol pixels, for at most maxiter
+// iterations.  sip_compile turns refinement on only when the header has
+// no AP,BP coefficients, in which case the iteration starts from the
+// undistorted point.  tol <= 0 or maxiter <= 0 select the defaults.
+// Function returns 0 on success and -1 on failure
+int sip_setinverse(struct sip_compiled *scomp, int refine, double tol, int maxiter) {
+
+   if ((!refine)&&(!scomp->have_inv)&&(scomp->have_sip)) {
+      squidwcs_error(SQUIDWCS_ERR_SIP, 0, "sip_setinverse", "no AP,BP coefficients, refinement needed");
+      return(-1);
+   }
+   scomp->refine=(refine != 0);
+   scomp->tol=(tol > 0.0) ? tol : SIP_INV_TOL;
+   scomp->maxiter=(maxiter > 0) ? maxiter : SIP_INV_MAXITER;
+
+   return(0);
+}
+
+// Newton refinement of the reverse SIP transform for n points.  x,y are
+// the undistorted points and xout,yout hold the starting guesses on input
+// and the refined points on output; they must not be the same arrays.
+// Points that do not converge are set to NAN and, if stat is not NULL, get
+// SIP_STAT_NOCONV in stat.  Points that are not finite are left as is.
+// Returns the number of points that did not converge.
+int sip_reverse_refine(const struct sip_compiled *scomp, long n, const double *x, const double *y, double *xout, double *yout, int stat[]) {
+   double px,py; // current estimate
+   double f,g,fu,fv,gu,gv; // forward distortion and its partial derivatives
+   double rx,ry; // residual
+   double det,dx,dy; // Jacobian determinant, Newton step
+   double tol2;
+   long i;
+   int it, nfail=0;
+   SQUIDWCS_STATS_FN(SQUIDWCS_STAT_SIP_REVERSE_REFINE);
+
+   tol2=scomp->tol*scomp->tol;
+   for (i=0; i<n; i++) {
+      px=xout[i];
+      py=yout[i];
+      if (!(isfinite(px)&&isfinite(py)&&isfinite(x[i])&&isfinite(y[i]))) continue;
+      for (it=0; it<scomp->maxiter; it++) {
+         sip_horner_grad(scomp->fwd, scomp->order, px-scomp->crpix1, py-scomp->crpix2, &f, &g, &fu, &fv, &gu, &gv);
+         rx=px+f-x[i];
+         ry=py+g-y[i];
+         // Jacobian of p+F(p) is I+dF
+         det=(1.0+fu)*(1.0+gv)-fv*gu;
+         if (det == 0.0) break;
+         dx=((1.0+gv)*rx-fv*ry)/det;
+         dy=((1.0+fu)*ry-gu*rx)/det;
+         px-=dx;
+         py-=dy;
+         if (dx*dx+dy*dy <= tol2) break;
+      }
+      if ((it == scomp->maxiter)||(det == 0.0)) {
+         px=NAN;
+         py=NAN;
+         if (stat != NULL) stat[i]=SIP_STAT_NOCONV;
+         nfail++;
+      }
+      xout[i]=px;
+      yout[i]=py;
+   }
+
+   return(nfail);
+}